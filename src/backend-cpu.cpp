@@ -0,0 +1,591 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include "backend-cpu.h"
+#include "thread-pool.h"
+
+namespace backend {
+namespace cpu {
+
+static std::mutex& kernel_registry_mutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+static std::unordered_map<std::string, KernelFactory>& kernel_registry() {
+  static std::unordered_map<std::string, KernelFactory> registry;
+  return registry;
+}
+
+void register_kernel(const std::string& name, Kernel kernel) {
+  register_kernel(name, [kernel](const FunctionConstants& constants, Kernel* out,
+                                 std::string* error) {
+    *out = kernel;
+    return true;
+  });
+}
+
+void register_kernel(const std::string& name, KernelFactory factory) {
+  std::lock_guard<std::mutex> lock(kernel_registry_mutex());
+  kernel_registry()[name] = factory;
+}
+
+bool find_kernel(const std::string& name, KernelFactory* factory) {
+  std::lock_guard<std::mutex> lock(kernel_registry_mutex());
+  auto item = kernel_registry().find(name);
+  if (item == kernel_registry().end()) {
+    return false;
+  }
+
+  *factory = item->second;
+  return true;
+}
+
+class CpuDevice;
+
+class CpuBuffer : public Buffer {
+ public:
+  explicit CpuBuffer(size_t size) : data_(nullptr), size_(size) {}
+
+  CpuBuffer(void* data, size_t size, std::function<void()> deallocator)
+      : data_(data), size_(size), deallocator_(deallocator) {}
+
+  ~CpuBuffer() {
+    if (deallocator_) {
+      deallocator_();
+    } else {
+      std::free(data_);
+    }
+  }
+
+  bool allocate() {
+    // Page-aligned like Metal's shared buffers; aligned_alloc() requires a
+    // size that is a multiple of the alignment
+    size_t alloc_size = ((size_ + kAlignment - 1) / kAlignment) * kAlignment;
+    data_ = std::aligned_alloc(kAlignment, alloc_size == 0 ? kAlignment : alloc_size);
+    if (data_ != nullptr) {
+      std::memset(data_, 0, size_);
+    }
+    return data_ != nullptr;
+  }
+
+  void* contents() override { return data_; }
+  size_t length() const override { return size_; }
+
+  static constexpr size_t kAlignment = 4096;
+
+ private:
+  void* data_;
+  size_t size_;
+  std::function<void()> deallocator_;
+};
+
+// "Compiling" resolves the kernels declared in the source against the kernel
+// registry, so a compiled library is the list of kernel names and factories.
+// It's saved as the kernel names, one per line.
+class CpuCompiledLibrary : public CompiledLibrary {
+ public:
+  CpuCompiledLibrary(std::vector<std::string> names, std::vector<KernelFactory> kernels)
+      : names_(names), kernels_(kernels) {}
+
+  bool serialize(std::string* out) const override {
+    out->clear();
+    for (const std::string& name : names_) {
+      *out += name + "\n";
+    }
+
+    return true;
+  }
+
+  const std::vector<std::string>& names() const { return names_; }
+  const std::vector<KernelFactory>& kernels() const { return kernels_; }
+
+ private:
+  std::vector<std::string> names_;
+  std::vector<KernelFactory> kernels_;
+};
+
+// A function whose kernel couldn't be created (because it needs function
+// constants that weren't set) can't create a pipeline, like in Metal
+class CpuFunction : public Function {
+ public:
+  CpuFunction(Device* device, CpuCompiledLibrary* compiled, const std::string& name,
+              Kernel kernel, const std::string& specialization_key,
+              const std::string& error)
+      : device_(device),
+        compiled_(compiled),
+        name_(name),
+        kernel_(kernel),
+        specialization_key_(specialization_key),
+        error_(error) {
+    device_->retain();
+    compiled_->retain();
+  }
+
+  ~CpuFunction() {
+    compiled_->release();
+    device_->release();
+  }
+
+  std::string name() const override { return name_; }
+  FunctionType type() const override { return FunctionType::Kernel; }
+  Device* device() override { return device_; }
+  CompiledLibrary* compiled_library() override { return compiled_; }
+  std::string specialization_key() const override { return specialization_key_; }
+
+  const Kernel& kernel() const { return kernel_; }
+  const std::string& error() const { return error_; }
+
+ private:
+  Device* device_;
+  CpuCompiledLibrary* compiled_;
+  std::string name_;
+  Kernel kernel_;
+  std::string specialization_key_;
+  std::string error_;
+};
+
+class CpuLibrary : public Library {
+ public:
+  CpuLibrary(Device* device, CpuCompiledLibrary* compiled)
+      : device_(device), compiled_(compiled) {
+    device_->retain();
+    compiled_->retain();
+  }
+
+  ~CpuLibrary() {
+    compiled_->release();
+    device_->release();
+  }
+
+  std::vector<std::string> function_names() const override { return compiled_->names(); }
+
+  Function* new_function(const std::string& name) override {
+    const KernelFactory* factory = find_factory(name);
+    if (factory == nullptr) {
+      return nullptr;
+    }
+
+    Kernel kernel;
+    std::string error;
+    if (!(*factory)(FunctionConstants(), &kernel, &error)) {
+      kernel = nullptr;
+    }
+
+    return new CpuFunction(device_, compiled_, name, kernel, "", error);
+  }
+
+  Function* new_specialized_function(const std::string& name,
+                                     const FunctionConstants& constants,
+                                     std::string* error) override {
+    const KernelFactory* factory = find_factory(name);
+    if (factory == nullptr) {
+      *error = "No function named '" + name + "' in library";
+      return nullptr;
+    }
+
+    Kernel kernel;
+    if (!(*factory)(constants, &kernel, error)) {
+      return nullptr;
+    }
+
+    return new CpuFunction(device_, compiled_, name, kernel, constants.key(), "");
+  }
+
+ private:
+  Device* device_;
+  CpuCompiledLibrary* compiled_;
+
+  const KernelFactory* find_factory(const std::string& name) const {
+    const std::vector<std::string>& names = compiled_->names();
+    for (size_t i = 0; i < names.size(); i++) {
+      if (names[i] == name) {
+        return &compiled_->kernels()[i];
+      }
+    }
+
+    return nullptr;
+  }
+};
+
+class CpuComputePipeline : public ComputePipeline {
+ public:
+  explicit CpuComputePipeline(Kernel kernel) : kernel_(kernel) {}
+
+  // Match Apple GPUs so that the threadgroup heuristics behave identically
+  size_t max_total_threads_per_threadgroup() const override { return 1024; }
+  size_t thread_execution_width() const override { return 32; }
+
+  // Threadgroups of at most 1024 threads are often too little work to be worth
+  // handing to a worker thread one at a time
+  bool has_chunk_size() const override { return true; }
+
+  const Kernel& kernel() const { return kernel_; }
+
+ private:
+  Kernel kernel_;
+};
+
+static size_t n_groups(size_t grid, size_t threadgroup) {
+  return (grid + threadgroup - 1) / threadgroup;
+}
+
+// Runs one dispatch by distributing its threadgroups among the pool's threads
+// chunk_size threadgroups at a time
+static void execute_dispatch(ThreadPool* pool, const Dispatch& dispatch) {
+  auto pipeline = static_cast<CpuComputePipeline*>(dispatch.pipeline);
+  const Size& grid = dispatch.grid;
+  const Size& tg = dispatch.threadgroup;
+  if (grid.count() == 0) {
+    return;
+  }
+
+  size_t groups_x = n_groups(grid.width, tg.width);
+  size_t groups_y = n_groups(grid.height, tg.height);
+  size_t groups_z = n_groups(grid.depth, tg.depth);
+
+  size_t n_groups_total = groups_x * groups_y * groups_z;
+  size_t chunk_size = std::max<size_t>(dispatch.chunk_size, 1);
+
+  KernelArguments args(dispatch);
+  const Kernel& kernel = pipeline->kernel();
+
+  pool->parallel_for(n_groups(n_groups_total, chunk_size), [&](size_t chunk) {
+    size_t end = std::min(n_groups_total, (chunk + 1) * chunk_size);
+    for (size_t i = chunk * chunk_size; i < end; i++) {
+      ThreadgroupContext ctx;
+      ctx.threadgroup_position_in_grid =
+          Size{i % groups_x, (i / groups_x) % groups_y, i / (groups_x * groups_y)};
+      ctx.threads_per_threadgroup = tg;
+      ctx.threads_per_grid = grid;
+      kernel(args, ctx);
+    }
+  });
+}
+
+// A single thread that runs posted tasks in order, like a serial Metal command
+// queue. Its state is shared with the thread so that the worker can outlive
+// the queue that owns it (e.g., when the last reference to a queue is
+// released by the command buffer that the worker just finished).
+class SerialWorker {
+ public:
+  SerialWorker() : state_(std::make_shared<State>()) {}
+
+  ~SerialWorker() {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->stopping = true;
+    }
+    state_->work_available.notify_one();
+
+    if (thread_.joinable()) {
+      if (thread_.get_id() == std::this_thread::get_id()) {
+        thread_.detach();
+      } else {
+        thread_.join();
+      }
+    }
+  }
+
+  void post(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->tasks.push_back(task);
+      if (!thread_.joinable()) {
+        std::shared_ptr<State> state = state_;
+        thread_ = std::thread([state] { run(state); });
+      }
+    }
+
+    state_->work_available.notify_one();
+  }
+
+ private:
+  struct State {
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+  };
+
+  std::shared_ptr<State> state_;
+  std::thread thread_;
+
+  static void run(std::shared_ptr<State> state) {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->work_available.wait(
+            lock, [&] { return state->stopping || !state->tasks.empty(); });
+        if (state->tasks.empty()) {
+          return;
+        }
+
+        task = std::move(state->tasks.front());
+        state->tasks.pop_front();
+      }
+
+      task();
+    }
+  }
+};
+
+class CpuCommandQueue;
+
+class CpuCommandBuffer : public CommandBuffer {
+ public:
+  CpuCommandBuffer(CpuCommandQueue* queue, ThreadPool* pool);
+  ~CpuCommandBuffer();
+
+  bool encode(const Dispatch& dispatch, std::string* error) override {
+    if (dynamic_cast<CpuComputePipeline*>(dispatch.pipeline) == nullptr) {
+      *error = "Compute pipeline was not created by a CPU device";
+      return false;
+    }
+
+    Size tg = dispatch.threadgroup;
+    if (tg.count() == 0) {
+      *error = "Threadgroup size must be non-zero in all dimensions";
+      return false;
+    }
+
+    size_t max_threads = dispatch.pipeline->max_total_threads_per_threadgroup();
+    if (tg.count() > max_threads) {
+      *error = "Threadgroup of " + std::to_string(tg.count()) +
+               " threads exceeds the maximum of " + std::to_string(max_threads);
+      return false;
+    }
+
+    dispatch.pipeline->retain();
+    for (Buffer* buffer : dispatch.buffers) {
+      if (buffer != nullptr) {
+        buffer->retain();
+      }
+    }
+
+    dispatches_.push_back(dispatch);
+    return true;
+  }
+
+  // Dispatches are always replayed in order, each using every thread in the
+  // pool, so a barrier is implied between every dispatch
+  void barrier() override {}
+
+  void commit() override;
+
+  void wait_until_completed() override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    completed_.wait(lock, [&] { return status_ != Status::Committed; });
+  }
+
+  bool is_completed() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return status_ == Status::Completed;
+  }
+
+  std::string error() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+  }
+
+  // Called on the queue's worker thread
+  void run() {
+    std::string error;
+    try {
+      for (const Dispatch& dispatch : dispatches_) {
+        execute_dispatch(pool_, dispatch);
+      }
+    } catch (std::exception& e) {
+      error = e.what();
+    } catch (...) {
+      error = "Unknown error executing command buffer";
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = error;
+      status_ = Status::Completed;
+    }
+    completed_.notify_all();
+  }
+
+ private:
+  enum class Status { NotCommitted, Committed, Completed };
+
+  CpuCommandQueue* queue_;
+  ThreadPool* pool_;
+  std::vector<Dispatch> dispatches_;
+  std::mutex mutex_;
+  std::condition_variable completed_;
+  Status status_;
+  std::string error_;
+};
+
+class CpuCommandQueue : public CommandQueue {
+ public:
+  explicit CpuCommandQueue(std::shared_ptr<ThreadPool> pool) : pool_(pool) {}
+
+  CommandBuffer* new_command_buffer(DispatchType dispatch_type) override {
+    return new CpuCommandBuffer(this, pool_.get());
+  }
+
+  void submit(CpuCommandBuffer* command_buffer) {
+    command_buffer->retain();
+    worker_.post([command_buffer] {
+      command_buffer->run();
+      command_buffer->release();
+    });
+  }
+
+ private:
+  std::shared_ptr<ThreadPool> pool_;
+  SerialWorker worker_;
+};
+
+CpuCommandBuffer::CpuCommandBuffer(CpuCommandQueue* queue, ThreadPool* pool)
+    : queue_(queue), pool_(pool), status_(Status::NotCommitted) {
+  queue_->retain();
+}
+
+CpuCommandBuffer::~CpuCommandBuffer() {
+  for (Dispatch& dispatch : dispatches_) {
+    dispatch.pipeline->release();
+    for (Buffer* buffer : dispatch.buffers) {
+      if (buffer != nullptr) {
+        buffer->release();
+      }
+    }
+  }
+
+  queue_->release();
+}
+
+void CpuCommandBuffer::commit() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (status_ != Status::NotCommitted) {
+      return;
+    }
+
+    status_ = Status::Committed;
+  }
+
+  queue_->submit(this);
+}
+
+class CpuDevice : public Device {
+ public:
+  explicit CpuDevice(int n_threads) : pool_(std::make_shared<ThreadPool>(n_threads)) {}
+
+  std::string backend_name() const override { return "cpu"; }
+
+  std::string name() const override { return "CPU"; }
+
+  std::string description() const override {
+    return "CPU backend with " + std::to_string(pool_->num_threads()) + " thread(s)";
+  }
+
+  CompiledLibrary* compile_library(const std::string& code, const CompileOptions& options,
+                                   std::string* error) override {
+    static const std::regex kernel_decl("kernel\\s+void\\s+([A-Za-z_][A-Za-z0-9_]*)\\s*\\(");
+
+    std::vector<std::string> names;
+    std::vector<KernelFactory> kernels;
+    auto begin = std::sregex_iterator(code.begin(), code.end(), kernel_decl);
+    for (auto it = begin; it != std::sregex_iterator(); ++it) {
+      std::string name = (*it)[1];
+      KernelFactory kernel;
+      if (!find_kernel(name, &kernel)) {
+        *error = "No CPU implementation registered for kernel '" + name + "'";
+        return nullptr;
+      }
+
+      names.push_back(name);
+      kernels.push_back(kernel);
+    }
+
+    if (names.empty()) {
+      *error = "No kernel functions declared in source:\n" + code;
+      return nullptr;
+    }
+
+    return new CpuCompiledLibrary(names, kernels);
+  }
+
+  CompiledLibrary* load_compiled_library(const std::string& data) override {
+    std::vector<std::string> names;
+    std::vector<KernelFactory> kernels;
+    std::istringstream lines(data);
+    std::string name;
+    while (std::getline(lines, name)) {
+      KernelFactory kernel;
+      if (!find_kernel(name, &kernel)) {
+        return nullptr;
+      }
+
+      names.push_back(name);
+      kernels.push_back(kernel);
+    }
+
+    if (names.empty()) {
+      return nullptr;
+    }
+
+    return new CpuCompiledLibrary(names, kernels);
+  }
+
+  Library* wrap_compiled_library(CompiledLibrary* compiled) override {
+    return new CpuLibrary(this, static_cast<CpuCompiledLibrary*>(compiled));
+  }
+
+  Buffer* new_buffer(size_t size) override {
+    CpuBuffer* buffer = new CpuBuffer(size);
+    if (!buffer->allocate()) {
+      buffer->release();
+      return nullptr;
+    }
+
+    return buffer;
+  }
+
+  // CPU kernels address memory directly, so any memory can be aliased
+  Buffer* new_buffer_no_copy(void* ptr, size_t size,
+                             std::function<void()> deallocator) override {
+    return new CpuBuffer(ptr, size, deallocator);
+  }
+
+  CommandQueue* new_command_queue() override { return new CpuCommandQueue(pool_); }
+
+  ComputePipeline* compile_compute_pipeline(Function* function,
+                                            std::string* error) override {
+    auto cpu_function = dynamic_cast<CpuFunction*>(function);
+    if (cpu_function == nullptr) {
+      *error = "Function was not created by a CPU device";
+      return nullptr;
+    } else if (!cpu_function->kernel()) {
+      *error = cpu_function->error();
+      return nullptr;
+    }
+
+    return new CpuComputePipeline(cpu_function->kernel());
+  }
+
+ private:
+  std::shared_ptr<ThreadPool> pool_;
+};
+
+}  // namespace cpu
+
+Device* create_cpu_device(int n_threads) { return new cpu::CpuDevice(n_threads); }
+
+}  // namespace backend
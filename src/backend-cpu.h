@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "backend.h"
+
+// Kernels for the CPU backend are C++ functors that are registered by name.
+// A library "compiled" on a CPU device resolves each `kernel` declared in the
+// Metal source against this registry, so the same R code that runs a Metal
+// kernel runs the registered C++ implementation on a CPU device. Kernels are
+// executed one threadgroup at a time using the same grid/threadgroup model
+// as dispatchThreads(): threadgroups are distributed among worker threads
+// and partial threadgroups at the edge of the grid are clipped.
+//
+// Kernels that use function constants are registered with a KernelFactory
+// instead, which creates the kernel for the values of the constants when a
+// function is created. Like the Metal compiler does for function constants,
+// factories usually make the values compile-time constants by instantiating
+// a template with them (see with_constant()).
+namespace backend {
+namespace cpu {
+
+// Every accessor checks that the argument exists and has the type (and size)
+// that the kernel expects and otherwise throws, which stops the dispatch and
+// is reported by CommandBuffer::error(), like an invalid encoding is on Metal.
+class KernelArguments {
+ public:
+  explicit KernelArguments(const Dispatch& dispatch)
+      : buffers_(dispatch.buffers), bytes_(dispatch.bytes) {}
+
+  size_t size() const { return buffers_.size(); }
+
+  template <typename T>
+  T* buffer(size_t i) const {
+    return reinterpret_cast<T*>(checked_buffer(i)->contents());
+  }
+
+  // The same, after checking that the buffer has at least n elements
+  template <typename T>
+  T* buffer(size_t i, size_t n) const {
+    if (length(i) / sizeof(T) < n) {
+      throw std::runtime_error("Buffer argument " + std::to_string(i) +
+                               " has fewer than " + std::to_string(n) + " elements");
+    }
+
+    return buffer<T>(i);
+  }
+
+  size_t length(size_t i) const { return checked_buffer(i)->length(); }
+
+  // The value of an argument that was passed by value (e.g., `constant float&
+  // alpha` in Metal source) instead of as a buffer
+  template <typename T>
+  T value(size_t i) const {
+    const std::string& value_bytes = bytes(i);
+    if (value_bytes.size() != sizeof(T)) {
+      throw std::runtime_error("Argument " + std::to_string(i) + " must be a value of " +
+                               std::to_string(sizeof(T)) + " bytes");
+    }
+
+    T out;
+    std::memcpy(&out, value_bytes.data(), sizeof(T));
+    return out;
+  }
+
+  bool has_value(size_t i) const { return i < bytes_.size() && !bytes_[i].empty(); }
+
+  // All of the bytes of an argument that was passed by value (e.g., `constant
+  // uint* program`, whose length isn't known when the kernel is compiled)
+  const std::string& bytes(size_t i) const {
+    if (!has_value(i)) {
+      throw std::runtime_error("Argument " + std::to_string(i) + " must be a value");
+    }
+
+    return bytes_[i];
+  }
+
+ private:
+  const std::vector<Buffer*>& buffers_;
+  const std::vector<std::string>& bytes_;
+
+  Buffer* checked_buffer(size_t i) const {
+    if (i >= buffers_.size() || buffers_[i] == nullptr) {
+      throw std::runtime_error("Argument " + std::to_string(i) + " must be a buffer");
+    }
+
+    return buffers_[i];
+  }
+};
+
+struct ThreadgroupContext {
+  Size threadgroup_position_in_grid;
+  Size threads_per_threadgroup;
+  Size threads_per_grid;
+};
+
+using Kernel =
+    std::function<void(const KernelArguments& args, const ThreadgroupContext& ctx)>;
+
+// Wraps a functor called as f(args, thread_position_in_grid) into a Kernel that
+// loops over each thread of a threadgroup
+template <typename F>
+Kernel per_thread(F f) {
+  return [f](const KernelArguments& args, const ThreadgroupContext& ctx) {
+    const Size& group = ctx.threadgroup_position_in_grid;
+    const Size& tg = ctx.threads_per_threadgroup;
+    const Size& grid = ctx.threads_per_grid;
+
+    size_t x0 = group.width * tg.width;
+    size_t y0 = group.height * tg.height;
+    size_t z0 = group.depth * tg.depth;
+    size_t x1 = std::min(x0 + tg.width, grid.width);
+    size_t y1 = std::min(y0 + tg.height, grid.height);
+    size_t z1 = std::min(z0 + tg.depth, grid.depth);
+
+    for (size_t z = z0; z < z1; z++) {
+      for (size_t y = y0; y < y1; y++) {
+        for (size_t x = x0; x < x1; x++) {
+          f(args, Size{x, y, z});
+        }
+      }
+    }
+  };
+}
+
+// Returns false with an error if the constants that the kernel needs are missing
+// or have the wrong type. Constants that the kernel doesn't use are ignored.
+using KernelFactory = std::function<bool(const FunctionConstants& constants,
+                                         Kernel* kernel, std::string* error)>;
+
+// Calls f(std::integral_constant<T, V>()) for the V in Values that equals value
+// or returns false if there isn't one, e.g., with_constant<uint32_t, 1, 2, 4>(
+// n, [&](auto n) { ... }) to use a template instantiated for n
+template <typename T, T... Values, typename F>
+bool with_constant(T value, F f) {
+  return ((value == Values && (f(std::integral_constant<T, Values>()), true)) || ...);
+}
+
+void register_kernel(const std::string& name, Kernel kernel);
+void register_kernel(const std::string& name, KernelFactory factory);
+bool find_kernel(const std::string& name, KernelFactory* factory);
+
+// Registers a kernel at load time, e.g.,
+// static KernelRegistration add_arrays("mtl_test_add_arrays", per_thread(...));
+class KernelRegistration {
+ public:
+  KernelRegistration(const std::string& name, Kernel kernel) {
+    register_kernel(name, kernel);
+  }
+
+  KernelRegistration(const std::string& name, KernelFactory factory) {
+    register_kernel(name, factory);
+  }
+};
+
+}  // namespace cpu
+}  // namespace backend
@@ -0,0 +1,468 @@
+#include "backend.h"
+
+#if defined(__APPLE__)
+
+#include <unistd.h>
+
+#include "Metal/Metal.hpp"
+
+namespace backend {
+namespace metal {
+
+static std::string utf8_string(NS::String* string) {
+  if (string == nullptr) {
+    return "";
+  }
+
+  return string->utf8String();
+}
+
+static std::string error_description(NS::Error* error) {
+  if (error == nullptr) {
+    return "unknown error";
+  }
+
+  return utf8_string(error->localizedDescription());
+}
+
+class MetalBuffer : public Buffer {
+ public:
+  explicit MetalBuffer(MTL::Buffer* buffer) : buffer_(buffer) {}
+
+  MetalBuffer(MTL::Buffer* buffer, std::function<void()> deallocator)
+      : buffer_(buffer), deallocator_(deallocator) {}
+
+  // Command buffers retain this object until the GPU has finished with them,
+  // so aliased memory can be released as soon as the MTL::Buffer is
+  ~MetalBuffer() {
+    buffer_->release();
+    if (deallocator_) {
+      deallocator_();
+    }
+  }
+
+  void* contents() override { return buffer_->contents(); }
+  size_t length() const override { return buffer_->length(); }
+
+  MTL::Buffer* get() { return buffer_; }
+
+ private:
+  MTL::Buffer* buffer_;
+  std::function<void()> deallocator_;
+};
+
+class MetalCompiledLibrary : public CompiledLibrary {
+ public:
+  explicit MetalCompiledLibrary(MTL::Library* library) : library_(library) {}
+  ~MetalCompiledLibrary() { library_->release(); }
+
+  MTL::Library* get() { return library_; }
+
+ private:
+  MTL::Library* library_;
+};
+
+class MetalFunction : public Function {
+ public:
+  MetalFunction(Device* device, MetalCompiledLibrary* compiled, MTL::Function* function,
+                const std::string& specialization_key = "")
+      : device_(device),
+        compiled_(compiled),
+        function_(function),
+        specialization_key_(specialization_key) {
+    device_->retain();
+    compiled_->retain();
+  }
+
+  ~MetalFunction() {
+    function_->release();
+    compiled_->release();
+    device_->release();
+  }
+
+  std::string name() const override { return utf8_string(function_->name()); }
+
+  FunctionType type() const override {
+    switch (function_->functionType()) {
+      case MTL::FunctionType::FunctionTypeFragment:
+        return FunctionType::Fragment;
+      case MTL::FunctionType::FunctionTypeIntersection:
+        return FunctionType::Intersection;
+      case MTL::FunctionType::FunctionTypeKernel:
+        return FunctionType::Kernel;
+      case MTL::FunctionType::FunctionTypeVertex:
+        return FunctionType::Vertex;
+      default:
+        return FunctionType::Unknown;
+    }
+  }
+
+  Device* device() override { return device_; }
+  CompiledLibrary* compiled_library() override { return compiled_; }
+  std::string specialization_key() const override { return specialization_key_; }
+
+  MTL::Function* get() { return function_; }
+
+ private:
+  Device* device_;
+  MetalCompiledLibrary* compiled_;
+  MTL::Function* function_;
+  std::string specialization_key_;
+};
+
+static MTL::DataType constant_data_type(ConstantType type) {
+  switch (type) {
+    case ConstantType::Bool:
+      return MTL::DataTypeBool;
+    case ConstantType::Int:
+      return MTL::DataTypeInt;
+    case ConstantType::UInt:
+      return MTL::DataTypeUInt;
+    case ConstantType::Short:
+      return MTL::DataTypeShort;
+    case ConstantType::UShort:
+      return MTL::DataTypeUShort;
+    case ConstantType::UChar:
+      return MTL::DataTypeUChar;
+    case ConstantType::Float:
+      return MTL::DataTypeFloat;
+    case ConstantType::Half:
+      return MTL::DataTypeHalf;
+  }
+
+  return MTL::DataTypeNone;
+}
+
+class MetalLibrary : public Library {
+ public:
+  MetalLibrary(Device* device, MetalCompiledLibrary* compiled)
+      : device_(device), compiled_(compiled), library_(compiled->get()) {
+    device_->retain();
+    compiled_->retain();
+  }
+
+  ~MetalLibrary() {
+    compiled_->release();
+    device_->release();
+  }
+
+  std::vector<std::string> function_names() const override {
+    NS::Array* ns_names = library_->functionNames();
+    std::vector<std::string> out;
+    for (NS::UInteger i = 0; i < ns_names->count(); i++) {
+      out.push_back(utf8_string(static_cast<NS::String*>(ns_names->object(i))));
+    }
+
+    return out;
+  }
+
+  Function* new_function(const std::string& name) override {
+    NS::String* ns_name =
+        NS::String::string(name.c_str(), NS::StringEncoding::UTF8StringEncoding);
+    MTL::Function* function = library_->newFunction(ns_name);
+    if (function == nullptr) {
+      return nullptr;
+    }
+
+    return new MetalFunction(device_, compiled_, function);
+  }
+
+  Function* new_specialized_function(const std::string& name,
+                                     const FunctionConstants& constants,
+                                     std::string* error) override {
+    MTL::FunctionConstantValues* values = MTL::FunctionConstantValues::alloc()->init();
+    for (const FunctionConstant& constant : constants.constants()) {
+      NS::String* ns_constant_name = NS::String::string(
+          constant.name.c_str(), NS::StringEncoding::UTF8StringEncoding);
+      values->setConstantValue(constant.bytes.data(), constant_data_type(constant.type),
+                               ns_constant_name);
+    }
+
+    NS::Error* ns_error = nullptr;
+    NS::String* ns_name =
+        NS::String::string(name.c_str(), NS::StringEncoding::UTF8StringEncoding);
+    MTL::Function* function = library_->newFunction(ns_name, values, &ns_error);
+    values->release();
+    if (function == nullptr) {
+      *error = error_description(ns_error);
+      return nullptr;
+    }
+
+    return new MetalFunction(device_, compiled_, function, constants.key());
+  }
+
+ private:
+  Device* device_;
+  MetalCompiledLibrary* compiled_;
+  MTL::Library* library_;
+};
+
+class MetalComputePipeline : public ComputePipeline {
+ public:
+  explicit MetalComputePipeline(MTL::ComputePipelineState* pipeline)
+      : pipeline_(pipeline) {}
+  ~MetalComputePipeline() { pipeline_->release(); }
+
+  size_t max_total_threads_per_threadgroup() const override {
+    return pipeline_->maxTotalThreadsPerThreadgroup();
+  }
+
+  size_t thread_execution_width() const override {
+    return pipeline_->threadExecutionWidth();
+  }
+
+  MTL::ComputePipelineState* get() { return pipeline_; }
+
+ private:
+  MTL::ComputePipelineState* pipeline_;
+};
+
+static MTL::Size mtl_size(const Size& size) {
+  return MTL::Size::Make(size.width, size.height, size.depth);
+}
+
+class MetalCommandBuffer : public CommandBuffer {
+ public:
+  MetalCommandBuffer(MTL::CommandBuffer* command_buffer, DispatchType dispatch_type)
+      : command_buffer_(command_buffer), dispatch_type_(dispatch_type), encoder_(nullptr) {
+    command_buffer_->retain();
+  }
+
+  ~MetalCommandBuffer() {
+    release_resources(resources_);
+
+    if (encoder_ != nullptr) {
+      encoder_->release();
+    }
+
+    command_buffer_->release();
+  }
+
+  bool encode(const Dispatch& dispatch, std::string* error) override {
+    auto pipeline = dynamic_cast<MetalComputePipeline*>(dispatch.pipeline);
+    if (pipeline == nullptr) {
+      *error = "Compute pipeline was not created by a Metal device";
+      return false;
+    }
+
+    for (Buffer* buffer : dispatch.buffers) {
+      if (buffer != nullptr && dynamic_cast<MetalBuffer*>(buffer->storage()) == nullptr) {
+        *error = "Buffer was not allocated by a Metal device";
+        return false;
+      }
+    }
+
+    ensure_encoder();
+    encoder_->setComputePipelineState(pipeline->get());
+    resources_.push_back(pipeline->retain());
+    for (size_t i = 0; i < dispatch.buffers.size(); i++) {
+      if (i < dispatch.bytes.size() && !dispatch.bytes[i].empty()) {
+        const std::string& bytes = dispatch.bytes[i];
+        encoder_->setBytes(bytes.data(), bytes.size(), i);
+        continue;
+      }
+
+      if (dispatch.buffers[i] == nullptr) {
+        continue;
+      }
+
+      // Retain the buffer that was encoded (not its storage) so that a
+      // pooled buffer isn't recycled while the GPU is using it
+      auto buffer = static_cast<MetalBuffer*>(dispatch.buffers[i]->storage());
+      encoder_->setBuffer(buffer->get(), 0, i);
+      resources_.push_back(dispatch.buffers[i]->retain());
+    }
+
+    encoder_->dispatchThreads(mtl_size(dispatch.grid), mtl_size(dispatch.threadgroup));
+    return true;
+  }
+
+  void barrier() override {
+    if (encoder_ != nullptr) {
+      encoder_->memoryBarrier(MTL::BarrierScopeBuffers);
+    }
+  }
+
+  void commit() override {
+    if (encoder_ != nullptr) {
+      encoder_->endEncoding();
+    }
+
+    // Keep the objects referenced by the encoded commands alive until the GPU
+    // is done with them, even if this command buffer is released first
+    std::vector<Object*> resources = std::move(resources_);
+    resources_.clear();
+    command_buffer_->addCompletedHandler(
+        [resources](MTL::CommandBuffer*) { release_resources(resources); });
+
+    command_buffer_->commit();
+  }
+
+  void wait_until_completed() override { command_buffer_->waitUntilCompleted(); }
+
+  bool is_completed() override {
+    MTL::CommandBufferStatus status = command_buffer_->status();
+    return status == MTL::CommandBufferStatusCompleted ||
+           status == MTL::CommandBufferStatusError;
+  }
+
+  std::string error() override {
+    if (command_buffer_->status() != MTL::CommandBufferStatusError) {
+      return "";
+    }
+
+    return error_description(command_buffer_->error());
+  }
+
+ private:
+  MTL::CommandBuffer* command_buffer_;
+  DispatchType dispatch_type_;
+  MTL::ComputeCommandEncoder* encoder_;
+  std::vector<Object*> resources_;
+
+  void ensure_encoder() {
+    if (encoder_ != nullptr) {
+      return;
+    }
+
+    if (dispatch_type_ == DispatchType::Concurrent) {
+      encoder_ = command_buffer_->computeCommandEncoder(MTL::DispatchTypeConcurrent);
+    } else {
+      encoder_ = command_buffer_->computeCommandEncoder(MTL::DispatchTypeSerial);
+    }
+
+    encoder_->retain();
+  }
+
+  static void release_resources(const std::vector<Object*>& resources) {
+    for (Object* resource : resources) {
+      resource->release();
+    }
+  }
+};
+
+class MetalCommandQueue : public CommandQueue {
+ public:
+  explicit MetalCommandQueue(MTL::CommandQueue* queue) : queue_(queue) {}
+  ~MetalCommandQueue() { queue_->release(); }
+
+  CommandBuffer* new_command_buffer(DispatchType dispatch_type) override {
+    return new MetalCommandBuffer(queue_->commandBuffer(), dispatch_type);
+  }
+
+ private:
+  MTL::CommandQueue* queue_;
+};
+
+class MetalDevice : public Device {
+ public:
+  explicit MetalDevice(MTL::Device* device) : device_(device) {}
+  ~MetalDevice() { device_->release(); }
+
+  std::string backend_name() const override { return "metal"; }
+  std::string name() const override { return utf8_string(device_->name()); }
+
+  std::string description() const override {
+    return utf8_string(device_->description());
+  }
+
+  // Libraries compiled from source can't be serialized, so these are only
+  // cached in memory
+  CompiledLibrary* compile_library(const std::string& code, const CompileOptions& options,
+                                   std::string* error) override {
+    NS::Error* ns_error = nullptr;
+    NS::String* ns_code =
+        NS::String::string(code.c_str(), NS::StringEncoding::UTF8StringEncoding);
+    MTL::CompileOptions* mtl_options = MTL::CompileOptions::alloc()->init();
+    mtl_options->setFastMathEnabled(options.fast_math);
+
+    MTL::Library* library = device_->newLibrary(ns_code, mtl_options, &ns_error);
+    mtl_options->release();
+    if (library == nullptr) {
+      *error = error_description(ns_error);
+      return nullptr;
+    }
+
+    return new MetalCompiledLibrary(library);
+  }
+
+  Library* wrap_compiled_library(CompiledLibrary* compiled) override {
+    return new MetalLibrary(this, static_cast<MetalCompiledLibrary*>(compiled));
+  }
+
+  Buffer* new_buffer(size_t size) override {
+    MTL::Buffer* buffer = device_->newBuffer(size, MTL::ResourceStorageModeShared);
+    if (buffer == nullptr) {
+      return nullptr;
+    }
+
+    return new MetalBuffer(buffer);
+  }
+
+  // newBufferWithBytesNoCopy requires a page-aligned pointer and length
+  Buffer* new_buffer_no_copy(void* ptr, size_t size,
+                             std::function<void()> deallocator) override {
+    size_t page_size = getpagesize();
+    if (size == 0 || (reinterpret_cast<uintptr_t>(ptr) % page_size) != 0 ||
+        (size % page_size) != 0) {
+      return nullptr;
+    }
+
+    MTL::Buffer* buffer =
+        device_->newBuffer(ptr, size, MTL::ResourceStorageModeShared, nullptr);
+    if (buffer == nullptr) {
+      return nullptr;
+    }
+
+    return new MetalBuffer(buffer, deallocator);
+  }
+
+  CommandQueue* new_command_queue() override {
+    return new MetalCommandQueue(device_->newCommandQueue());
+  }
+
+  ComputePipeline* compile_compute_pipeline(Function* function,
+                                            std::string* error) override {
+    auto metal_function = dynamic_cast<MetalFunction*>(function);
+    if (metal_function == nullptr) {
+      *error = "Function was not created by a Metal device";
+      return nullptr;
+    }
+
+    NS::Error* ns_error = nullptr;
+    MTL::ComputePipelineState* pipeline =
+        device_->newComputePipelineState(metal_function->get(), &ns_error);
+    if (pipeline == nullptr) {
+      *error = error_description(ns_error);
+      return nullptr;
+    }
+
+    return new MetalComputePipeline(pipeline);
+  }
+
+ private:
+  MTL::Device* device_;
+};
+
+}  // namespace metal
+
+Device* create_system_default_device() {
+  MTL::Device* device = MTL::CreateSystemDefaultDevice();
+  if (device == nullptr) {
+    return nullptr;
+  }
+
+  return new metal::MetalDevice(device);
+}
+
+}  // namespace backend
+
+#else
+
+namespace backend {
+
+Device* create_system_default_device() { return nullptr; }
+
+}  // namespace backend
+
+#endif
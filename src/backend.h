@@ -0,0 +1,332 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// The objects the R bindings in metal.cpp talk to. Each backend (Metal on
+// macOS, the multithreaded CPU backend everywhere) implements these and the
+// bindings never touch a backend-specific type. Objects are reference counted
+// with retain()/release() so that they can be managed exactly like metal-cpp
+// objects (i.e., by Owner<T> in metal.cpp). Methods that can fail return
+// nullptr and populate an error message, like the NS::Error** pattern in Metal.
+namespace backend {
+
+struct Size {
+  size_t width;
+  size_t height;
+  size_t depth;
+
+  static Size Make(size_t width, size_t height = 1, size_t depth = 1) {
+    return Size{width, height, depth};
+  }
+
+  size_t count() const { return width * height * depth; }
+};
+
+class Object {
+ public:
+  Object() : ref_count_(1) {}
+  virtual ~Object() {}
+
+  Object* retain() {
+    ref_count_.fetch_add(1);
+    return this;
+  }
+
+  void release() {
+    if (ref_count_.fetch_sub(1) == 1) {
+      delete this;
+    }
+  }
+
+ private:
+  std::atomic<int64_t> ref_count_;
+};
+
+enum class FunctionType { Kernel, Vertex, Fragment, Intersection, Unknown };
+
+class Device;
+class BufferPool;
+class CompiledLibrary;
+class LibraryCache;
+class PipelineCache;
+class TuningCache;
+
+class Buffer : public Object {
+ public:
+  virtual void* contents() = 0;
+  virtual size_t length() const = 0;
+
+  // The buffer allocated by the backend whose memory this buffer uses, which
+  // is only different for buffers that wrap another buffer (e.g., from a pool)
+  virtual Buffer* storage() { return this; }
+};
+
+class Function : public Object {
+ public:
+  virtual std::string name() const = 0;
+  virtual FunctionType type() const = 0;
+  virtual Device* device() = 0;
+
+  // The compiled code that this function was created from, which (with the
+  // name and the specialization key) identifies the pipelines it creates
+  virtual CompiledLibrary* compiled_library() = 0;
+
+  // Distinguishes functions with the same name that were specialized
+  // differently
+  virtual std::string specialization_key() const { return ""; }
+};
+
+// The types that a function constant (e.g., `constant uint n
+// [[function_constant(0)]]` in Metal source) can have
+enum class ConstantType { Bool, Int, UInt, Short, UShort, UChar, Float, Half };
+
+// The value of one function constant, identified by name, as the bytes of its
+// type in the kernel
+struct FunctionConstant {
+  std::string name;
+  ConstantType type;
+  std::string bytes;
+};
+
+class FunctionConstants {
+ public:
+  void add(const std::string& name, ConstantType type, const std::string& bytes) {
+    constants_.push_back(FunctionConstant{name, type, bytes});
+  }
+
+  const std::vector<FunctionConstant>& constants() const { return constants_; }
+  bool empty() const { return constants_.empty(); }
+
+  // Returns false if there is no constant with this name and type (whose
+  // bytes are the size of T)
+  template <typename T>
+  bool value(const std::string& name, ConstantType type, T* out) const {
+    for (const FunctionConstant& constant : constants_) {
+      if (constant.name == name && constant.type == type &&
+          constant.bytes.size() == sizeof(T)) {
+        std::memcpy(out, constant.bytes.data(), sizeof(T));
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // The Function::specialization_key() of a function specialized with these
+  // constants, which doesn't depend on the order they were added in
+  std::string key() const;
+
+ private:
+  std::vector<FunctionConstant> constants_;
+};
+
+class Library : public Object {
+ public:
+  virtual std::vector<std::string> function_names() const = 0;
+
+  // Returns nullptr if there is no function with this name
+  virtual Function* new_function(const std::string& name) = 0;
+
+  // Like new_function() but with the function constants of the function set
+  // to constants (like newFunction(name, constantValues, error) in Metal).
+  // Returns nullptr with an error if there is no function with this name or
+  // the constants don't match the function.
+  virtual Function* new_specialized_function(const std::string& name,
+                                             const FunctionConstants& constants,
+                                             std::string* error) = 0;
+};
+
+struct CompileOptions {
+  bool fast_math;
+
+  CompileOptions() : fast_math(true) {}
+
+  // Distinguishes libraries compiled from the same source in a cache key
+  std::string key() const { return fast_math ? "fast_math=1" : "fast_math=0"; }
+};
+
+// The result of compiling source code, from which any number of Library
+// objects can be created. It must not retain the device that compiled it so
+// that it can be cached by that device (see library-cache.h).
+class CompiledLibrary : public Object {
+ public:
+  CompiledLibrary() : source_hash_(0) {}
+
+  // Returns false if this backend can't save compiled libraries across sessions
+  virtual bool serialize(std::string* out) const { return false; }
+
+  // A hash of the device, options, and source that this library was compiled
+  // from (see LibraryCache::key()), which is stable across sessions
+  uint64_t source_hash() const { return source_hash_; }
+  void set_source_hash(uint64_t source_hash) { source_hash_ = source_hash; }
+
+ private:
+  uint64_t source_hash_;
+};
+
+class ComputePipeline : public Object {
+ public:
+  virtual size_t max_total_threads_per_threadgroup() const = 0;
+  virtual size_t thread_execution_width() const = 0;
+
+  // True if dispatches of this pipeline use Dispatch::chunk_size
+  virtual bool has_chunk_size() const { return false; }
+
+  // Pipelines created by Device::new_compute_pipeline() use the tuned
+  // threadgroup for the function they were created from (see tuning-cache.h)
+  // when a dispatch doesn't specify one
+  const std::string& function_key() const { return function_key_; }
+  TuningCache* tuning_cache() const { return tuning_cache_.get(); }
+
+  void set_tuning_cache(const std::string& function_key,
+                        std::shared_ptr<TuningCache> tuning_cache) {
+    function_key_ = function_key;
+    tuning_cache_ = tuning_cache;
+  }
+
+ private:
+  std::string function_key_;
+  std::shared_ptr<TuningCache> tuning_cache_;
+};
+
+// One dispatchThreads() call: the pipeline, the buffer bound to each argument
+// index (nullptr for unbound indices), and the grid/threadgroup shape. An
+// argument can instead be a small value that is copied into the command
+// (like setBytes()), in which case bytes has the same size as buffers and the
+// element for that index is non-empty. Backends that run threadgroups on
+// worker threads hand out chunk_size threadgroups at a time (zero uses one).
+struct Dispatch {
+  ComputePipeline* pipeline;
+  std::vector<Buffer*> buffers;
+  std::vector<std::string> bytes;
+  Size grid;
+  Size threadgroup;
+  size_t chunk_size = 0;
+};
+
+// The most bytes that setBytes() accepts
+constexpr size_t kMaxInlineBytes = 4096;
+
+// Like MTL::DispatchType: dispatches in a serial command buffer behave as if
+// they run one after the other; dispatches in a concurrent command buffer may
+// overlap unless they are separated by a barrier().
+enum class DispatchType { Serial, Concurrent };
+
+class CommandBuffer : public Object {
+ public:
+  // Encoded objects are retained by the command buffer until it is released
+  virtual bool encode(const Dispatch& dispatch, std::string* error) = 0;
+
+  // Ensures that buffer writes from dispatches encoded before the barrier are
+  // visible to dispatches encoded after it
+  virtual void barrier() = 0;
+
+  // Commits the encoded work for execution and returns immediately
+  virtual void commit() = 0;
+  virtual void wait_until_completed() = 0;
+  virtual bool is_completed() = 0;
+
+  // Empty unless the command buffer completed with an error
+  virtual std::string error() = 0;
+};
+
+class CommandQueue : public Object {
+ public:
+  virtual CommandBuffer* new_command_buffer(DispatchType dispatch_type) = 0;
+};
+
+class Device : public Object {
+ public:
+  Device() : command_queue_(nullptr) {}
+
+  ~Device() {
+    if (command_queue_ != nullptr) {
+      command_queue_->release();
+    }
+  }
+
+  // The queue used when a queue is not specified explicitly. It is created on
+  // first use and lives as long as the device, so queues must not retain the
+  // device that created them.
+  CommandQueue* command_queue() {
+    if (command_queue_ == nullptr) {
+      command_queue_ = new_command_queue();
+    }
+
+    return command_queue_;
+  }
+
+  virtual std::string backend_name() const = 0;
+  virtual std::string name() const = 0;
+  virtual std::string description() const = 0;
+
+  // Like new_buffer() but the memory is recycled by size class through the
+  // device's buffer pool (see buffer-pool.h)
+  Buffer* new_pooled_buffer(size_t size);
+  BufferPool* buffer_pool();
+
+  // Like wrap_compiled_library(compile_library(...)) but reuses the result of
+  // compiling the same code with the same options on this device
+  Library* new_library(const std::string& code, const CompileOptions& options,
+                       std::string* error);
+  LibraryCache* library_cache();
+
+  virtual CompiledLibrary* compile_library(const std::string& code,
+                                           const CompileOptions& options,
+                                           std::string* error) = 0;
+
+  // Returns nullptr if data wasn't created by CompiledLibrary::serialize() on an
+  // equivalent device
+  virtual CompiledLibrary* load_compiled_library(const std::string& data) {
+    return nullptr;
+  }
+
+  virtual Library* wrap_compiled_library(CompiledLibrary* compiled) = 0;
+  virtual Buffer* new_buffer(size_t size) = 0;
+
+  // Returns a buffer whose contents are the size bytes at ptr without copying
+  // them, or nullptr if this device cannot use that memory directly (e.g., it is
+  // not page-aligned). ptr must stay valid until deallocator is called when the
+  // buffer is destroyed, which may happen on any thread.
+  virtual Buffer* new_buffer_no_copy(void* ptr, size_t size,
+                                     std::function<void()> deallocator) = 0;
+  virtual CommandQueue* new_command_queue() = 0;
+
+  // Like compile_compute_pipeline() but reuses the pipeline created for the
+  // same function by this device (see pipeline-cache.h)
+  ComputePipeline* new_compute_pipeline(Function* function, std::string* error);
+  PipelineCache* pipeline_cache();
+
+  // The threadgroups that were tuned for the pipelines of this device
+  TuningCache* tuning_cache();
+
+  virtual ComputePipeline* compile_compute_pipeline(Function* function,
+                                                    std::string* error) = 0;
+
+ private:
+  CommandQueue* command_queue_;
+
+  // Shared with the buffers from new_pooled_buffer(), which may outlive the
+  // device
+  std::shared_ptr<BufferPool> buffer_pool_;
+  std::shared_ptr<LibraryCache> library_cache_;
+  std::shared_ptr<PipelineCache> pipeline_cache_;
+
+  // Shared with the pipelines from new_compute_pipeline()
+  std::shared_ptr<TuningCache> tuning_cache_;
+};
+
+// Returns nullptr if there is no Metal device (e.g., not on macOS)
+Device* create_system_default_device();
+
+// n_threads <= 0 uses one thread per hardware core
+Device* create_cpu_device(int n_threads);
+
+}  // namespace backend
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <cstring>
+
+#include "buffer-pool.h"
+
+namespace backend {
+
+static constexpr size_t kPageSize = 4096;
+
+size_t BufferPool::size_class(size_t size) {
+  if (size <= kPageSize) {
+    return kPageSize;
+  }
+
+  // The largest power of two <= size, split into four classes of at least a
+  // page each
+  size_t power = kPageSize;
+  while (power <= size / 2) {
+    power *= 2;
+  }
+
+  size_t step = std::max(power / 4, kPageSize);
+  return ((size + step - 1) / step) * step;
+}
+
+Buffer* BufferPool::take(size_t size_class) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto item = size_classes_.find(size_class);
+  if (item == size_classes_.end() || item->second.empty()) {
+    misses_++;
+    return nullptr;
+  }
+
+  // Reuse the most recently released buffer, whose memory is most likely to
+  // still be resident
+  auto retained_item = item->second.back();
+  item->second.pop_back();
+  Buffer* buffer = *retained_item;
+  retained_.erase(retained_item);
+  retained_bytes_ -= size_class;
+  hits_++;
+  return buffer;
+}
+
+void BufferPool::put(Buffer* buffer) {
+  size_t size_class = buffer->length();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (size_class > capacity_) {
+    buffer->release();
+    return;
+  }
+
+  trim_locked(capacity_ - size_class);
+  retained_.push_back(buffer);
+  size_classes_[size_class].push_back(std::prev(retained_.end()));
+  retained_bytes_ += size_class;
+}
+
+void BufferPool::trim(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  trim_locked(bytes);
+}
+
+void BufferPool::set_capacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = capacity;
+  trim_locked(capacity_);
+}
+
+BufferPoolStats BufferPool::stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return BufferPoolStats{hits_, misses_, retained_.size(), retained_bytes_, capacity_};
+}
+
+void BufferPool::trim_locked(size_t bytes) {
+  while (retained_bytes_ > bytes) {
+    Buffer* buffer = retained_.front();
+    size_t size_class = buffer->length();
+    size_classes_[size_class].pop_front();
+    retained_.pop_front();
+    retained_bytes_ -= size_class;
+    buffer->release();
+  }
+}
+
+BufferPool* Device::buffer_pool() {
+  if (!buffer_pool_) {
+    buffer_pool_ = std::make_shared<BufferPool>(BufferPool::kDefaultCapacity);
+  }
+
+  return buffer_pool_.get();
+}
+
+Buffer* Device::new_pooled_buffer(size_t size) {
+  buffer_pool();
+  size_t size_class = BufferPool::size_class(size);
+  Buffer* buffer = buffer_pool_->take(size_class);
+
+  if (buffer != nullptr) {
+    // New buffers are zero-filled, so recycled ones are too
+    std::memset(buffer->contents(), 0, size);
+  } else {
+    buffer = new_buffer(size_class);
+    if (buffer == nullptr) {
+      // Memory pressure: give back everything the pool is holding and retry
+      buffer_pool_->trim(0);
+      buffer = new_buffer(size_class);
+    }
+  }
+
+  if (buffer == nullptr) {
+    return nullptr;
+  }
+
+  return new PooledBuffer(buffer_pool_, buffer, size);
+}
+
+}  // namespace backend
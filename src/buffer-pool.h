@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "backend.h"
+
+// Recycles the buffers of a device by size class. Buffers returned by
+// Device::new_pooled_buffer() wrap a buffer whose length is a size class; when
+// the wrapper is destroyed, that buffer is returned here instead of being
+// released so that the next request for the same size class can reuse it.
+// Released buffers are kept until the total size of retained buffers exceeds
+// the capacity, at which point the least recently released buffers are
+// released. All methods are thread-safe because buffers may be destroyed on a
+// backend thread.
+namespace backend {
+
+struct BufferPoolStats {
+  size_t hits;
+  size_t misses;
+  size_t retained_count;
+  size_t retained_bytes;
+  size_t capacity;
+};
+
+class BufferPool {
+ public:
+  explicit BufferPool(size_t capacity)
+      : capacity_(capacity), retained_bytes_(0), hits_(0), misses_(0) {}
+
+  ~BufferPool() { trim(0); }
+
+  // Sizes are rounded up to a whole number of pages with (at most) four size
+  // classes between powers of two, so that larger buffers waste at most 25%
+  static size_t size_class(size_t size);
+
+  // Returns a buffer with length() == size_class that was previously released,
+  // or nullptr (i.e., a miss) if there isn't one
+  Buffer* take(size_t size_class);
+
+  // Takes ownership of a buffer allocated with a length of a size class
+  void put(Buffer* buffer);
+
+  // Releases the least recently released buffers until the retained buffers
+  // use at most bytes
+  void trim(size_t bytes);
+
+  void set_capacity(size_t capacity);
+  BufferPoolStats stats();
+
+  static constexpr size_t kDefaultCapacity = 256 * 1024 * 1024;
+
+ private:
+  std::mutex mutex_;
+  size_t capacity_;
+  size_t retained_bytes_;
+  size_t hits_;
+  size_t misses_;
+
+  // Oldest first, with an index of the same buffers by size class (also oldest
+  // first, so that the front of a size class is always the first to be trimmed)
+  std::list<Buffer*> retained_;
+  std::unordered_map<size_t, std::deque<std::list<Buffer*>::iterator>> size_classes_;
+
+  void trim_locked(size_t bytes);
+};
+
+// A buffer of the requested size backed by a buffer from a pool
+class PooledBuffer : public Buffer {
+ public:
+  PooledBuffer(std::shared_ptr<BufferPool> pool, Buffer* buffer, size_t size)
+      : pool_(pool), buffer_(buffer), size_(size) {}
+
+  ~PooledBuffer() { pool_->put(buffer_); }
+
+  void* contents() override { return buffer_->contents(); }
+  size_t length() const override { return size_; }
+  Buffer* storage() override { return buffer_->storage(); }
+
+ private:
+  std::shared_ptr<BufferPool> pool_;
+  Buffer* buffer_;
+  size_t size_;
+};
+
+}  // namespace backend
@@ -0,0 +1,214 @@
+#include <cstring>
+
+#include <cpp11.hpp>
+#include <cpp11/altrep.hpp>
+using namespace cpp11;
+
+#include "owner-xptr.h"
+
+// Defined in metal.cpp
+sexp cpp_buffer_copy_into(sexp buffer_sexp, sexp ptype, double buffer_offset,
+                          double length);
+bool is_16_bit_floats(sexp x);
+
+static size_t buffer_view_element_size(SEXPTYPE type) {
+  switch (type) {
+    case INTSXP:
+    case LGLSXP:
+      return sizeof(int);
+    case REALSXP:
+      return sizeof(double);
+    case RAWSXP:
+      return sizeof(Rbyte);
+    default:
+      return 0;
+  }
+}
+
+#if defined(HAS_ALTREP)
+
+// A view is an R vector whose data pointer is the (shared) memory of a buffer.
+// It keeps the buffer alive and reads its contents directly until R asks for a
+// writable pointer, at which point the contents are copied into a regular
+// vector and the buffer is no longer referenced. Until then, the view reflects
+// writes to the buffer.
+//
+// data1: list(buffer, c(buffer_offset, length)); data2: the copy or NULL
+static R_altrep_class_t buffer_view_integer;
+static R_altrep_class_t buffer_view_logical;
+static R_altrep_class_t buffer_view_real;
+static R_altrep_class_t buffer_view_raw;
+
+static R_xlen_t buffer_view_length(SEXP x) {
+  return REAL(VECTOR_ELT(R_altrep_data1(x), 1))[1];
+}
+
+// Element access goes through here, so this skips the class check that
+// constructing a BufferXptr would do
+static const void* buffer_view_contents(SEXP x) {
+  SEXP data2 = R_altrep_data2(x);
+  if (data2 != R_NilValue) {
+    return DATAPTR_RO(data2);
+  }
+
+  SEXP data1 = R_altrep_data1(x);
+  auto owner = reinterpret_cast<Owner<backend::Buffer>*>(
+      R_ExternalPtrAddr(VECTOR_ELT(data1, 0)));
+  auto contents = reinterpret_cast<const uint8_t*>(owner->get()->contents());
+  int64_t buffer_offset = REAL(VECTOR_ELT(data1, 1))[0];
+  return contents + buffer_offset;
+}
+
+static SEXP buffer_view_copy(SEXP x) {
+  R_xlen_t length = buffer_view_length(x);
+  SEXP copy = PROTECT(Rf_allocVector(TYPEOF(x), length));
+  memcpy(DATAPTR(copy), buffer_view_contents(x),
+         length * buffer_view_element_size(TYPEOF(x)));
+  UNPROTECT(1);
+  return copy;
+}
+
+static void* buffer_view_dataptr(SEXP x, Rboolean writable) {
+  if (writable && R_altrep_data2(x) == R_NilValue) {
+    R_set_altrep_data2(x, buffer_view_copy(x));
+    SET_VECTOR_ELT(R_altrep_data1(x), 0, R_NilValue);
+  }
+
+  return const_cast<void*>(buffer_view_contents(x));
+}
+
+static const void* buffer_view_dataptr_or_null(SEXP x) {
+  return buffer_view_contents(x);
+}
+
+static SEXP buffer_view_duplicate(SEXP x, Rboolean deep) { return buffer_view_copy(x); }
+
+static Rboolean buffer_view_inspect(SEXP x, int pre, int deep, int pvec,
+                                    void (*inspect_subtree)(SEXP, int, int, int)) {
+  Rprintf("mtl_buffer view (len=%ld, materialized=%s)\n",
+          static_cast<long>(buffer_view_length(x)),
+          R_altrep_data2(x) == R_NilValue ? "F" : "T");
+  return TRUE;
+}
+
+static int buffer_view_integer_elt(SEXP x, R_xlen_t i) {
+  return reinterpret_cast<const int*>(buffer_view_contents(x))[i];
+}
+
+static int buffer_view_logical_elt(SEXP x, R_xlen_t i) {
+  return reinterpret_cast<const int*>(buffer_view_contents(x))[i];
+}
+
+static double buffer_view_real_elt(SEXP x, R_xlen_t i) {
+  return reinterpret_cast<const double*>(buffer_view_contents(x))[i];
+}
+
+static Rbyte buffer_view_raw_elt(SEXP x, R_xlen_t i) {
+  return reinterpret_cast<const Rbyte*>(buffer_view_contents(x))[i];
+}
+
+template <typename T>
+static R_xlen_t buffer_view_get_region(SEXP x, R_xlen_t i, R_xlen_t n, T* buf) {
+  R_xlen_t length = buffer_view_length(x);
+  if (i >= length) {
+    return 0;
+  }
+
+  if ((i + n) > length) {
+    n = length - i;
+  }
+
+  memcpy(buf, reinterpret_cast<const T*>(buffer_view_contents(x)) + i, n * sizeof(T));
+  return n;
+}
+
+static void buffer_view_init_methods(R_altrep_class_t cls) {
+  R_set_altrep_Length_method(cls, &buffer_view_length);
+  R_set_altrep_Inspect_method(cls, &buffer_view_inspect);
+  R_set_altrep_Duplicate_method(cls, &buffer_view_duplicate);
+  R_set_altvec_Dataptr_method(cls, &buffer_view_dataptr);
+  R_set_altvec_Dataptr_or_null_method(cls, &buffer_view_dataptr_or_null);
+}
+
+[[cpp11::init]] void init_buffer_view(DllInfo* dll) {
+  buffer_view_integer = R_make_altinteger_class("mtl_buffer_view_integer", "metal", dll);
+  buffer_view_init_methods(buffer_view_integer);
+  R_set_altinteger_Elt_method(buffer_view_integer, &buffer_view_integer_elt);
+  R_set_altinteger_Get_region_method(buffer_view_integer,
+                                     &buffer_view_get_region<int>);
+
+  buffer_view_logical = R_make_altlogical_class("mtl_buffer_view_logical", "metal", dll);
+  buffer_view_init_methods(buffer_view_logical);
+  R_set_altlogical_Elt_method(buffer_view_logical, &buffer_view_logical_elt);
+
+  buffer_view_real = R_make_altreal_class("mtl_buffer_view_real", "metal", dll);
+  buffer_view_init_methods(buffer_view_real);
+  R_set_altreal_Elt_method(buffer_view_real, &buffer_view_real_elt);
+  R_set_altreal_Get_region_method(buffer_view_real, &buffer_view_get_region<double>);
+
+  buffer_view_raw = R_make_altraw_class("mtl_buffer_view_raw", "metal", dll);
+  buffer_view_init_methods(buffer_view_raw);
+  R_set_altraw_Elt_method(buffer_view_raw, &buffer_view_raw_elt);
+}
+
+#endif
+
+// Like cpp_buffer_copy_into() but returns a view of the buffer contents. A copy
+// is returned when a view isn't possible (e.g., the offset is not aligned to the
+// element size).
+[[cpp11::register]] sexp cpp_buffer_view(sexp buffer_sexp, sexp ptype,
+                                         double buffer_offset, double length) {
+  BufferXptr buffer_xptr(buffer_sexp);
+  if (buffer_offset < 0) {
+    stop("Invalid buffer offset argument");
+  }
+
+  if ((buffer_offset + length) > buffer_xptr->get()->length()) {
+    stop("Buffer not long enough for specified arguments");
+  }
+
+  // The elements of 16-bit float vectors are wider than in the buffer, so these
+  // can't be views
+  if (is_16_bit_floats(ptype)) {
+    return cpp_buffer_copy_into(buffer_sexp, ptype, buffer_offset, length);
+  }
+
+  size_t element_size = buffer_view_element_size(TYPEOF(ptype));
+  if (element_size == 0) {
+    stop("Vector type not supported for ptype");
+  }
+
+  int64_t length_int = length;
+  if ((length_int % element_size) != 0) {
+    stop("Length must be a multiple of vector element size");
+  }
+
+  int64_t buffer_offset_int = buffer_offset;
+  if ((buffer_offset_int % element_size) != 0) {
+    return cpp_buffer_copy_into(buffer_sexp, ptype, buffer_offset, length);
+  }
+
+#if defined(HAS_ALTREP)
+  R_altrep_class_t cls;
+  switch (TYPEOF(ptype)) {
+    case INTSXP:
+      cls = buffer_view_integer;
+      break;
+    case LGLSXP:
+      cls = buffer_view_logical;
+      break;
+    case REALSXP:
+      cls = buffer_view_real;
+      break;
+    default:
+      cls = buffer_view_raw;
+      break;
+  }
+
+  writable::doubles offset_length = {buffer_offset, (double)(length_int / element_size)};
+  writable::list data1 = {buffer_sexp, offset_length};
+  return safe[R_new_altrep](cls, data1, R_NilValue);
+#else
+  return cpp_buffer_copy_into(buffer_sexp, ptype, buffer_offset, length);
+#endif
+}
@@ -0,0 +1,40 @@
+#include "builtin-kernels.h"
+
+namespace backend {
+
+ComputePipeline* builtin_pipeline(Device* device, const std::string& source,
+                                  const std::string& name,
+                                  const FunctionConstants& constants,
+                                  std::string* error) {
+  CompileOptions options;
+  options.fast_math = false;
+  ObjectPtr<Library> library(device->new_library(source, options, error));
+  if (!library) {
+    return nullptr;
+  }
+
+  ObjectPtr<Function> function(
+      library->new_specialized_function(name, constants, error));
+  if (!function) {
+    return nullptr;
+  }
+
+  return device->new_compute_pipeline(function.get(), error);
+}
+
+bool DispatchSequence::run(CommandQueue* queue, std::string* error) {
+  ObjectPtr<CommandBuffer> command_buffer(
+      queue->new_command_buffer(DispatchType::Serial));
+  for (const Dispatch& dispatch : dispatches_) {
+    if (dispatch.grid.count() > 0 && !command_buffer->encode(dispatch, error)) {
+      return false;
+    }
+  }
+
+  command_buffer->commit();
+  command_buffer->wait_until_completed();
+  *error = command_buffer->error();
+  return error->empty();
+}
+
+}  // namespace backend
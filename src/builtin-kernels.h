@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+
+// Helpers for the kernels that ship with the package (e.g., the reductions in
+// reduce.cpp). Their Metal source is compiled like any other library (through
+// the device's library and pipeline caches), and the CPU backend registers C++
+// kernels with the same names, so they run on every device. These never touch
+// the R API.
+namespace backend {
+
+// Releases a backend object when it goes out of scope (like Owner<T> in the R
+// bindings, which can't be used without the R API)
+struct ObjectReleaser {
+  void operator()(Object* object) const { object->release(); }
+};
+
+template <typename T>
+using ObjectPtr = std::unique_ptr<T, ObjectReleaser>;
+
+// The pipeline for the function called name in source, specialized with
+// constants. Built-in kernels are compiled without fast math so that they can
+// rely on NaN comparisons.
+ComputePipeline* builtin_pipeline(Device* device, const std::string& source,
+                                  const std::string& name,
+                                  const FunctionConstants& constants,
+                                  std::string* error);
+
+// The bytes of a value passed to a kernel by value (Dispatch::bytes)
+template <typename T>
+std::string dispatch_bytes(const T& value) {
+  std::string out(sizeof(T), '\0');
+  std::memcpy(&out[0], &value, sizeof(T));
+  return out;
+}
+
+// Dispatches that run one after the other in one serial command buffer, along
+// with the pipelines and temporary buffers that they use, so that a built-in
+// operation of several steps (e.g., the passes of a sort) is committed once
+// and never waits on the host between steps
+class DispatchSequence {
+ public:
+  // Keeps object alive until the sequence is destroyed and returns it
+  template <typename T>
+  T* keep(T* object) {
+    objects_.emplace_back(object);
+    return object;
+  }
+
+  void add(const Dispatch& dispatch) { dispatches_.push_back(dispatch); }
+
+  // Commits the dispatches to queue and waits for them to complete
+  bool run(CommandQueue* queue, std::string* error);
+
+ private:
+  std::vector<ObjectPtr<Object>> objects_;
+  std::vector<Dispatch> dispatches_;
+};
+
+}  // namespace backend
@@ -5,6 +5,13 @@
 #include "cpp11/declarations.hpp"
 #include <R_ext/Visibility.h>
 
+// buffer-view.cpp
+sexp cpp_buffer_view(sexp buffer_sexp, sexp ptype, double buffer_offset, double length);
+extern "C" SEXP _metal_cpp_buffer_view(SEXP buffer_sexp, SEXP ptype, SEXP buffer_offset, SEXP length) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_buffer_view(cpp11::as_cpp<cpp11::decay_t<sexp>>(buffer_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(ptype), cpp11::as_cpp<cpp11::decay_t<double>>(buffer_offset), cpp11::as_cpp<cpp11::decay_t<double>>(length)));
+  END_CPP11
+}
 // floats.cpp
 sexp cpp_floats(double size, double fill);
 extern "C" SEXP _metal_cpp_floats(SEXP size, SEXP fill) {
@@ -13,33 +20,103 @@ extern "C" SEXP _metal_cpp_floats(SEXP size, SEXP fill) {
   END_CPP11
 }
 // floats.cpp
-sexp cpp_as_floats(sexp x);
-extern "C" SEXP _metal_cpp_as_floats(SEXP x) {
+sexp cpp_as_floats(sexp x, bool lazy);
+extern "C" SEXP _metal_cpp_as_floats(SEXP x, SEXP lazy) {
   BEGIN_CPP11
-    return cpp11::as_sexp(cpp_as_floats(cpp11::as_cpp<cpp11::decay_t<sexp>>(x)));
+    return cpp11::as_sexp(cpp_as_floats(cpp11::as_cpp<cpp11::decay_t<sexp>>(x), cpp11::as_cpp<cpp11::decay_t<bool>>(lazy)));
   END_CPP11
 }
 // floats.cpp
-logicals cpp_from_floats_lgl(sexp floats_sexp);
+sexp cpp_from_floats_lgl(sexp floats_sexp);
 extern "C" SEXP _metal_cpp_from_floats_lgl(SEXP floats_sexp) {
   BEGIN_CPP11
     return cpp11::as_sexp(cpp_from_floats_lgl(cpp11::as_cpp<cpp11::decay_t<sexp>>(floats_sexp)));
   END_CPP11
 }
 // floats.cpp
-integers cpp_from_floats_int(sexp floats_sexp);
+sexp cpp_from_floats_int(sexp floats_sexp);
 extern "C" SEXP _metal_cpp_from_floats_int(SEXP floats_sexp) {
   BEGIN_CPP11
     return cpp11::as_sexp(cpp_from_floats_int(cpp11::as_cpp<cpp11::decay_t<sexp>>(floats_sexp)));
   END_CPP11
 }
 // floats.cpp
-doubles cpp_from_floats_dbl(sexp floats_sexp);
+sexp cpp_from_floats_dbl(sexp floats_sexp);
 extern "C" SEXP _metal_cpp_from_floats_dbl(SEXP floats_sexp) {
   BEGIN_CPP11
     return cpp11::as_sexp(cpp_from_floats_dbl(cpp11::as_cpp<cpp11::decay_t<sexp>>(floats_sexp)));
   END_CPP11
 }
+// floats.cpp
+std::string cpp_floats_simd_level();
+extern "C" SEXP _metal_cpp_floats_simd_level() {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_floats_simd_level());
+  END_CPP11
+}
+// floats.cpp
+list cpp_floats_set_threading(int n_threads, double threshold);
+extern "C" SEXP _metal_cpp_floats_set_threading(SEXP n_threads, SEXP threshold) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_floats_set_threading(cpp11::as_cpp<cpp11::decay_t<int>>(n_threads), cpp11::as_cpp<cpp11::decay_t<double>>(threshold)));
+  END_CPP11
+}
+// floats.cpp
+sexp cpp_floats_arith(std::string op, sexp e1, sexp e2);
+extern "C" SEXP _metal_cpp_floats_arith(SEXP op, SEXP e1, SEXP e2) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_floats_arith(cpp11::as_cpp<cpp11::decay_t<std::string>>(op), cpp11::as_cpp<cpp11::decay_t<sexp>>(e1), cpp11::as_cpp<cpp11::decay_t<sexp>>(e2)));
+  END_CPP11
+}
+// floats.cpp
+sexp cpp_floats_compare(std::string op, sexp e1, sexp e2);
+extern "C" SEXP _metal_cpp_floats_compare(SEXP op, SEXP e1, SEXP e2) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_floats_compare(cpp11::as_cpp<cpp11::decay_t<std::string>>(op), cpp11::as_cpp<cpp11::decay_t<sexp>>(e1), cpp11::as_cpp<cpp11::decay_t<sexp>>(e2)));
+  END_CPP11
+}
+// floats.cpp
+sexp cpp_floats_math(std::string fun, sexp x);
+extern "C" SEXP _metal_cpp_floats_math(SEXP fun, SEXP x) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_floats_math(cpp11::as_cpp<cpp11::decay_t<std::string>>(fun), cpp11::as_cpp<cpp11::decay_t<sexp>>(x)));
+  END_CPP11
+}
+// floats.cpp
+sexp cpp_floats_summary(std::string fun, sexp x, bool na_rm, std::string method);
+extern "C" SEXP _metal_cpp_floats_summary(SEXP fun, SEXP x, SEXP na_rm, SEXP method) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_floats_summary(cpp11::as_cpp<cpp11::decay_t<std::string>>(fun), cpp11::as_cpp<cpp11::decay_t<sexp>>(x), cpp11::as_cpp<cpp11::decay_t<bool>>(na_rm), cpp11::as_cpp<cpp11::decay_t<std::string>>(method)));
+  END_CPP11
+}
+// floats.cpp
+double cpp_floats_mean(sexp x, bool na_rm, std::string method);
+extern "C" SEXP _metal_cpp_floats_mean(SEXP x, SEXP na_rm, SEXP method) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_floats_mean(cpp11::as_cpp<cpp11::decay_t<sexp>>(x), cpp11::as_cpp<cpp11::decay_t<bool>>(na_rm), cpp11::as_cpp<cpp11::decay_t<std::string>>(method)));
+  END_CPP11
+}
+// halfs.cpp
+sexp cpp_halfs(double size, double fill, std::string type);
+extern "C" SEXP _metal_cpp_halfs(SEXP size, SEXP fill, SEXP type) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_halfs(cpp11::as_cpp<cpp11::decay_t<double>>(size), cpp11::as_cpp<cpp11::decay_t<double>>(fill), cpp11::as_cpp<cpp11::decay_t<std::string>>(type)));
+  END_CPP11
+}
+// halfs.cpp
+sexp cpp_as_halfs(sexp x, std::string type);
+extern "C" SEXP _metal_cpp_as_halfs(SEXP x, SEXP type) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_as_halfs(cpp11::as_cpp<cpp11::decay_t<sexp>>(x), cpp11::as_cpp<cpp11::decay_t<std::string>>(type)));
+  END_CPP11
+}
+// halfs.cpp
+sexp cpp_from_halfs_dbl(sexp halfs_sexp, std::string type);
+extern "C" SEXP _metal_cpp_from_halfs_dbl(SEXP halfs_sexp, SEXP type) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_from_halfs_dbl(cpp11::as_cpp<cpp11::decay_t<sexp>>(halfs_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(type)));
+  END_CPP11
+}
 // metal.cpp
 sexp cpp_default_device();
 extern "C" SEXP _metal_cpp_default_device() {
@@ -48,6 +125,13 @@ extern "C" SEXP _metal_cpp_default_device() {
   END_CPP11
 }
 // metal.cpp
+sexp cpp_cpu_device(int n_threads);
+extern "C" SEXP _metal_cpp_cpu_device(SEXP n_threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_cpu_device(cpp11::as_cpp<cpp11::decay_t<int>>(n_threads)));
+  END_CPP11
+}
+// metal.cpp
 list cpp_device_info(sexp device_sexp);
 extern "C" SEXP _metal_cpp_device_info(SEXP device_sexp) {
   BEGIN_CPP11
@@ -55,10 +139,25 @@ extern "C" SEXP _metal_cpp_device_info(SEXP device_sexp) {
   END_CPP11
 }
 // metal.cpp
-sexp cpp_make_library(sexp device_sexp, std::string code);
-extern "C" SEXP _metal_cpp_make_library(SEXP device_sexp, SEXP code) {
+sexp cpp_make_library(sexp device_sexp, std::string code, bool fast_math, bool cache, std::string cache_dir);
+extern "C" SEXP _metal_cpp_make_library(SEXP device_sexp, SEXP code, SEXP fast_math, SEXP cache, SEXP cache_dir) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_make_library(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(code), cpp11::as_cpp<cpp11::decay_t<bool>>(fast_math), cpp11::as_cpp<cpp11::decay_t<bool>>(cache), cpp11::as_cpp<cpp11::decay_t<std::string>>(cache_dir)));
+  END_CPP11
+}
+// metal.cpp
+list cpp_library_cache_info(sexp device_sexp);
+extern "C" SEXP _metal_cpp_library_cache_info(SEXP device_sexp) {
   BEGIN_CPP11
-    return cpp11::as_sexp(cpp_make_library(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(code)));
+    return cpp11::as_sexp(cpp_library_cache_info(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp)));
+  END_CPP11
+}
+// metal.cpp
+void cpp_library_cache_clear(sexp device_sexp);
+extern "C" SEXP _metal_cpp_library_cache_clear(SEXP device_sexp) {
+  BEGIN_CPP11
+    cpp_library_cache_clear(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp));
+    return R_NilValue;
   END_CPP11
 }
 // metal.cpp
@@ -76,6 +175,13 @@ extern "C" SEXP _metal_cpp_library_function(SEXP library_sexp, SEXP name) {
   END_CPP11
 }
 // metal.cpp
+sexp cpp_library_specialized_function(sexp library_sexp, std::string name, list constants);
+extern "C" SEXP _metal_cpp_library_specialized_function(SEXP library_sexp, SEXP name, SEXP constants) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_library_specialized_function(cpp11::as_cpp<cpp11::decay_t<sexp>>(library_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(name), cpp11::as_cpp<cpp11::decay_t<list>>(constants)));
+  END_CPP11
+}
+// metal.cpp
 list cpp_function_info(sexp function_sexp);
 extern "C" SEXP _metal_cpp_function_info(SEXP function_sexp) {
   BEGIN_CPP11
@@ -90,6 +196,36 @@ extern "C" SEXP _metal_cpp_buffer(SEXP device_sexp, SEXP size_dbl) {
   END_CPP11
 }
 // metal.cpp
+list cpp_buffer_pool_info(sexp device_sexp);
+extern "C" SEXP _metal_cpp_buffer_pool_info(SEXP device_sexp) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_buffer_pool_info(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp)));
+  END_CPP11
+}
+// metal.cpp
+void cpp_buffer_pool_set_capacity(sexp device_sexp, double capacity);
+extern "C" SEXP _metal_cpp_buffer_pool_set_capacity(SEXP device_sexp, SEXP capacity) {
+  BEGIN_CPP11
+    cpp_buffer_pool_set_capacity(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<double>>(capacity));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+void cpp_buffer_pool_trim(sexp device_sexp, double bytes);
+extern "C" SEXP _metal_cpp_buffer_pool_trim(SEXP device_sexp, SEXP bytes) {
+  BEGIN_CPP11
+    cpp_buffer_pool_trim(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<double>>(bytes));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+sexp cpp_buffer_wrap(sexp device_sexp, sexp x);
+extern "C" SEXP _metal_cpp_buffer_wrap(SEXP device_sexp, SEXP x) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_buffer_wrap(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(x)));
+  END_CPP11
+}
+// metal.cpp
 double cpp_buffer_size(sexp buffer_sexp);
 extern "C" SEXP _metal_cpp_buffer_size(SEXP buffer_sexp) {
   BEGIN_CPP11
@@ -105,6 +241,21 @@ extern "C" SEXP _metal_cpp_buffer_copy_from(SEXP src_sexp, SEXP buffer_sexp, SEX
   END_CPP11
 }
 // metal.cpp
+void cpp_buffer_convert_from(sexp src_sexp, sexp buffer_sexp, std::string buffer_type, double src_offset, double buffer_offset, double length);
+extern "C" SEXP _metal_cpp_buffer_convert_from(SEXP src_sexp, SEXP buffer_sexp, SEXP buffer_type, SEXP src_offset, SEXP buffer_offset, SEXP length) {
+  BEGIN_CPP11
+    cpp_buffer_convert_from(cpp11::as_cpp<cpp11::decay_t<sexp>>(src_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(buffer_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(buffer_type), cpp11::as_cpp<cpp11::decay_t<double>>(src_offset), cpp11::as_cpp<cpp11::decay_t<double>>(buffer_offset), cpp11::as_cpp<cpp11::decay_t<double>>(length));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+sexp cpp_buffer_convert_into(sexp buffer_sexp, std::string buffer_type, double buffer_offset, double length);
+extern "C" SEXP _metal_cpp_buffer_convert_into(SEXP buffer_sexp, SEXP buffer_type, SEXP buffer_offset, SEXP length) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_buffer_convert_into(cpp11::as_cpp<cpp11::decay_t<sexp>>(buffer_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(buffer_type), cpp11::as_cpp<cpp11::decay_t<double>>(buffer_offset), cpp11::as_cpp<cpp11::decay_t<double>>(length)));
+  END_CPP11
+}
+// metal.cpp
 sexp cpp_buffer_copy_into(sexp buffer_sexp, sexp ptype, double buffer_offset, double length);
 extern "C" SEXP _metal_cpp_buffer_copy_into(SEXP buffer_sexp, SEXP ptype, SEXP buffer_offset, SEXP length) {
   BEGIN_CPP11
@@ -126,48 +277,235 @@ extern "C" SEXP _metal_cpp_command_queue(SEXP device_sexp) {
   END_CPP11
 }
 // metal.cpp
-sexp cpp_compute_pipeline(sexp function_sexp);
-extern "C" SEXP _metal_cpp_compute_pipeline(SEXP function_sexp) {
+sexp cpp_device_command_queue(sexp device_sexp);
+extern "C" SEXP _metal_cpp_device_command_queue(SEXP device_sexp) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_device_command_queue(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp)));
+  END_CPP11
+}
+// metal.cpp
+sexp cpp_compute_pipeline(sexp function_sexp, std::string tuning_cache_dir);
+extern "C" SEXP _metal_cpp_compute_pipeline(SEXP function_sexp, SEXP tuning_cache_dir) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_compute_pipeline(cpp11::as_cpp<cpp11::decay_t<sexp>>(function_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(tuning_cache_dir)));
+  END_CPP11
+}
+// metal.cpp
+list cpp_compute_pipeline_info(sexp pipeline_sexp);
+extern "C" SEXP _metal_cpp_compute_pipeline_info(SEXP pipeline_sexp) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_compute_pipeline_info(cpp11::as_cpp<cpp11::decay_t<sexp>>(pipeline_sexp)));
+  END_CPP11
+}
+// metal.cpp
+list cpp_pipeline_cache_info(sexp device_sexp);
+extern "C" SEXP _metal_cpp_pipeline_cache_info(SEXP device_sexp) {
   BEGIN_CPP11
-    return cpp11::as_sexp(cpp_compute_pipeline(cpp11::as_cpp<cpp11::decay_t<sexp>>(function_sexp)));
+    return cpp11::as_sexp(cpp_pipeline_cache_info(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp)));
   END_CPP11
 }
 // metal.cpp
-void cpp_compute_pipeline_execute(sexp pipeline_sexp, sexp commmand_queue_sexp, list args, double array_length_dbl);
-extern "C" SEXP _metal_cpp_compute_pipeline_execute(SEXP pipeline_sexp, SEXP commmand_queue_sexp, SEXP args, SEXP array_length_dbl) {
+void cpp_pipeline_cache_set_capacity(sexp device_sexp, double capacity);
+extern "C" SEXP _metal_cpp_pipeline_cache_set_capacity(SEXP device_sexp, SEXP capacity) {
   BEGIN_CPP11
-    cpp_compute_pipeline_execute(cpp11::as_cpp<cpp11::decay_t<sexp>>(pipeline_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp), cpp11::as_cpp<cpp11::decay_t<list>>(args), cpp11::as_cpp<cpp11::decay_t<double>>(array_length_dbl));
+    cpp_pipeline_cache_set_capacity(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<double>>(capacity));
     return R_NilValue;
   END_CPP11
 }
+// metal.cpp
+void cpp_pipeline_cache_clear(sexp device_sexp);
+extern "C" SEXP _metal_cpp_pipeline_cache_clear(SEXP device_sexp) {
+  BEGIN_CPP11
+    cpp_pipeline_cache_clear(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+void cpp_compute_pipeline_execute(sexp pipeline_sexp, sexp commmand_queue_sexp, list args, doubles grid, doubles threadgroup);
+extern "C" SEXP _metal_cpp_compute_pipeline_execute(SEXP pipeline_sexp, SEXP commmand_queue_sexp, SEXP args, SEXP grid, SEXP threadgroup) {
+  BEGIN_CPP11
+    cpp_compute_pipeline_execute(cpp11::as_cpp<cpp11::decay_t<sexp>>(pipeline_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp), cpp11::as_cpp<cpp11::decay_t<list>>(args), cpp11::as_cpp<cpp11::decay_t<doubles>>(grid), cpp11::as_cpp<cpp11::decay_t<doubles>>(threadgroup));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+sexp cpp_compute_pipeline_execute_async(sexp pipeline_sexp, sexp commmand_queue_sexp, list args, doubles grid, doubles threadgroup);
+extern "C" SEXP _metal_cpp_compute_pipeline_execute_async(SEXP pipeline_sexp, SEXP commmand_queue_sexp, SEXP args, SEXP grid, SEXP threadgroup) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_compute_pipeline_execute_async(cpp11::as_cpp<cpp11::decay_t<sexp>>(pipeline_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp), cpp11::as_cpp<cpp11::decay_t<list>>(args), cpp11::as_cpp<cpp11::decay_t<doubles>>(grid), cpp11::as_cpp<cpp11::decay_t<doubles>>(threadgroup)));
+  END_CPP11
+}
+// metal.cpp
+list cpp_compute_pipeline_tune(sexp pipeline_sexp, sexp commmand_queue_sexp, list args, doubles grid, int reps);
+extern "C" SEXP _metal_cpp_compute_pipeline_tune(SEXP pipeline_sexp, SEXP commmand_queue_sexp, SEXP args, SEXP grid, SEXP reps) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_compute_pipeline_tune(cpp11::as_cpp<cpp11::decay_t<sexp>>(pipeline_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp), cpp11::as_cpp<cpp11::decay_t<list>>(args), cpp11::as_cpp<cpp11::decay_t<doubles>>(grid), cpp11::as_cpp<cpp11::decay_t<int>>(reps)));
+  END_CPP11
+}
+// metal.cpp
+list cpp_tuning_cache_info(sexp device_sexp);
+extern "C" SEXP _metal_cpp_tuning_cache_info(SEXP device_sexp) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_tuning_cache_info(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp)));
+  END_CPP11
+}
+// metal.cpp
+void cpp_tuning_cache_clear(sexp device_sexp);
+extern "C" SEXP _metal_cpp_tuning_cache_clear(SEXP device_sexp) {
+  BEGIN_CPP11
+    cpp_tuning_cache_clear(cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+list cpp_buffer_reduce(sexp buffer_sexp, std::string buffer_type, std::string op, sexp device_sexp, sexp commmand_queue_sexp);
+extern "C" SEXP _metal_cpp_buffer_reduce(SEXP buffer_sexp, SEXP buffer_type, SEXP op, SEXP device_sexp, SEXP commmand_queue_sexp) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_buffer_reduce(cpp11::as_cpp<cpp11::decay_t<sexp>>(buffer_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(buffer_type), cpp11::as_cpp<cpp11::decay_t<std::string>>(op), cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp)));
+  END_CPP11
+}
+// metal.cpp
+void cpp_buffer_scan(sexp buffer_sexp, std::string buffer_type, bool exclusive, sexp device_sexp, sexp commmand_queue_sexp);
+extern "C" SEXP _metal_cpp_buffer_scan(SEXP buffer_sexp, SEXP buffer_type, SEXP exclusive, SEXP device_sexp, SEXP commmand_queue_sexp) {
+  BEGIN_CPP11
+    cpp_buffer_scan(cpp11::as_cpp<cpp11::decay_t<sexp>>(buffer_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(buffer_type), cpp11::as_cpp<cpp11::decay_t<bool>>(exclusive), cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+void cpp_buffer_matmul(sexp a_sexp, sexp b_sexp, std::string buffer_type, double m, double k, double n, sexp out_sexp, sexp device_sexp, sexp commmand_queue_sexp);
+extern "C" SEXP _metal_cpp_buffer_matmul(SEXP a_sexp, SEXP b_sexp, SEXP buffer_type, SEXP m, SEXP k, SEXP n, SEXP out_sexp, SEXP device_sexp, SEXP commmand_queue_sexp) {
+  BEGIN_CPP11
+    cpp_buffer_matmul(cpp11::as_cpp<cpp11::decay_t<sexp>>(a_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(b_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(buffer_type), cpp11::as_cpp<cpp11::decay_t<double>>(m), cpp11::as_cpp<cpp11::decay_t<double>>(k), cpp11::as_cpp<cpp11::decay_t<double>>(n), cpp11::as_cpp<cpp11::decay_t<sexp>>(out_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+void cpp_buffer_sort(sexp buffer_sexp, std::string buffer_type, sexp payload_sexp, int payload_size, sexp device_sexp, sexp commmand_queue_sexp);
+extern "C" SEXP _metal_cpp_buffer_sort(SEXP buffer_sexp, SEXP buffer_type, SEXP payload_sexp, SEXP payload_size, SEXP device_sexp, SEXP commmand_queue_sexp) {
+  BEGIN_CPP11
+    cpp_buffer_sort(cpp11::as_cpp<cpp11::decay_t<sexp>>(buffer_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(buffer_type), cpp11::as_cpp<cpp11::decay_t<sexp>>(payload_sexp), cpp11::as_cpp<cpp11::decay_t<int>>(payload_size), cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+void cpp_buffer_order(sexp buffer_sexp, std::string buffer_type, sexp out_sexp, sexp device_sexp, sexp commmand_queue_sexp);
+extern "C" SEXP _metal_cpp_buffer_order(SEXP buffer_sexp, SEXP buffer_type, SEXP out_sexp, SEXP device_sexp, SEXP commmand_queue_sexp) {
+  BEGIN_CPP11
+    cpp_buffer_order(cpp11::as_cpp<cpp11::decay_t<sexp>>(buffer_sexp), cpp11::as_cpp<cpp11::decay_t<std::string>>(buffer_type), cpp11::as_cpp<cpp11::decay_t<sexp>>(out_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+void cpp_buffer_eval(strings ops, doubles operands, list inputs, doubles scalars, double n, sexp out_sexp, sexp device_sexp, sexp commmand_queue_sexp);
+extern "C" SEXP _metal_cpp_buffer_eval(SEXP ops, SEXP operands, SEXP inputs, SEXP scalars, SEXP n, SEXP out_sexp, SEXP device_sexp, SEXP commmand_queue_sexp) {
+  BEGIN_CPP11
+    cpp_buffer_eval(cpp11::as_cpp<cpp11::decay_t<strings>>(ops), cpp11::as_cpp<cpp11::decay_t<doubles>>(operands), cpp11::as_cpp<cpp11::decay_t<list>>(inputs), cpp11::as_cpp<cpp11::decay_t<doubles>>(scalars), cpp11::as_cpp<cpp11::decay_t<double>>(n), cpp11::as_cpp<cpp11::decay_t<sexp>>(out_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(device_sexp), cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+void cpp_pending_wait(sexp pending_sexp);
+extern "C" SEXP _metal_cpp_pending_wait(SEXP pending_sexp) {
+  BEGIN_CPP11
+    cpp_pending_wait(cpp11::as_cpp<cpp11::decay_t<sexp>>(pending_sexp));
+    return R_NilValue;
+  END_CPP11
+}
+// metal.cpp
+bool cpp_pending_is_done(sexp pending_sexp);
+extern "C" SEXP _metal_cpp_pending_is_done(SEXP pending_sexp) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_pending_is_done(cpp11::as_cpp<cpp11::decay_t<sexp>>(pending_sexp)));
+  END_CPP11
+}
+// metal.cpp
+sexp cpp_pending_error(sexp pending_sexp);
+extern "C" SEXP _metal_cpp_pending_error(SEXP pending_sexp) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_pending_error(cpp11::as_cpp<cpp11::decay_t<sexp>>(pending_sexp)));
+  END_CPP11
+}
+// metal.cpp
+sexp cpp_command_batch_commit(sexp commmand_queue_sexp, list steps, bool concurrent, bool wait);
+extern "C" SEXP _metal_cpp_command_batch_commit(SEXP commmand_queue_sexp, SEXP steps, SEXP concurrent, SEXP wait) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cpp_command_batch_commit(cpp11::as_cpp<cpp11::decay_t<sexp>>(commmand_queue_sexp), cpp11::as_cpp<cpp11::decay_t<list>>(steps), cpp11::as_cpp<cpp11::decay_t<bool>>(concurrent), cpp11::as_cpp<cpp11::decay_t<bool>>(wait)));
+  END_CPP11
+}
 
 extern "C" {
 static const R_CallMethodDef CallEntries[] = {
-    {"_metal_cpp_as_floats",                (DL_FUNC) &_metal_cpp_as_floats,                1},
-    {"_metal_cpp_buffer",                   (DL_FUNC) &_metal_cpp_buffer,                   2},
-    {"_metal_cpp_buffer_copy_from",         (DL_FUNC) &_metal_cpp_buffer_copy_from,         5},
-    {"_metal_cpp_buffer_copy_into",         (DL_FUNC) &_metal_cpp_buffer_copy_into,         4},
-    {"_metal_cpp_buffer_pointer",           (DL_FUNC) &_metal_cpp_buffer_pointer,           1},
-    {"_metal_cpp_buffer_size",              (DL_FUNC) &_metal_cpp_buffer_size,              1},
-    {"_metal_cpp_command_queue",            (DL_FUNC) &_metal_cpp_command_queue,            1},
-    {"_metal_cpp_compute_pipeline",         (DL_FUNC) &_metal_cpp_compute_pipeline,         1},
-    {"_metal_cpp_compute_pipeline_execute", (DL_FUNC) &_metal_cpp_compute_pipeline_execute, 4},
-    {"_metal_cpp_default_device",           (DL_FUNC) &_metal_cpp_default_device,           0},
-    {"_metal_cpp_device_info",              (DL_FUNC) &_metal_cpp_device_info,              1},
-    {"_metal_cpp_floats",                   (DL_FUNC) &_metal_cpp_floats,                   2},
-    {"_metal_cpp_from_floats_dbl",          (DL_FUNC) &_metal_cpp_from_floats_dbl,          1},
-    {"_metal_cpp_from_floats_int",          (DL_FUNC) &_metal_cpp_from_floats_int,          1},
-    {"_metal_cpp_from_floats_lgl",          (DL_FUNC) &_metal_cpp_from_floats_lgl,          1},
-    {"_metal_cpp_function_info",            (DL_FUNC) &_metal_cpp_function_info,            1},
-    {"_metal_cpp_library_function",         (DL_FUNC) &_metal_cpp_library_function,         2},
-    {"_metal_cpp_library_function_names",   (DL_FUNC) &_metal_cpp_library_function_names,   1},
-    {"_metal_cpp_make_library",             (DL_FUNC) &_metal_cpp_make_library,             2},
+    {"_metal_cpp_as_floats",                      (DL_FUNC) &_metal_cpp_as_floats,                      2},
+    {"_metal_cpp_as_halfs",                       (DL_FUNC) &_metal_cpp_as_halfs,                       2},
+    {"_metal_cpp_buffer",                         (DL_FUNC) &_metal_cpp_buffer,                         2},
+    {"_metal_cpp_buffer_convert_from",            (DL_FUNC) &_metal_cpp_buffer_convert_from,            6},
+    {"_metal_cpp_buffer_convert_into",            (DL_FUNC) &_metal_cpp_buffer_convert_into,            4},
+    {"_metal_cpp_buffer_copy_from",               (DL_FUNC) &_metal_cpp_buffer_copy_from,               5},
+    {"_metal_cpp_buffer_copy_into",               (DL_FUNC) &_metal_cpp_buffer_copy_into,               4},
+    {"_metal_cpp_buffer_eval",                    (DL_FUNC) &_metal_cpp_buffer_eval,                    8},
+    {"_metal_cpp_buffer_matmul",                  (DL_FUNC) &_metal_cpp_buffer_matmul,                  9},
+    {"_metal_cpp_buffer_order",                   (DL_FUNC) &_metal_cpp_buffer_order,                   5},
+    {"_metal_cpp_buffer_pointer",                 (DL_FUNC) &_metal_cpp_buffer_pointer,                 1},
+    {"_metal_cpp_buffer_pool_info",               (DL_FUNC) &_metal_cpp_buffer_pool_info,               1},
+    {"_metal_cpp_buffer_pool_set_capacity",       (DL_FUNC) &_metal_cpp_buffer_pool_set_capacity,       2},
+    {"_metal_cpp_buffer_pool_trim",               (DL_FUNC) &_metal_cpp_buffer_pool_trim,               2},
+    {"_metal_cpp_buffer_reduce",                  (DL_FUNC) &_metal_cpp_buffer_reduce,                  5},
+    {"_metal_cpp_buffer_scan",                    (DL_FUNC) &_metal_cpp_buffer_scan,                    5},
+    {"_metal_cpp_buffer_size",                    (DL_FUNC) &_metal_cpp_buffer_size,                    1},
+    {"_metal_cpp_buffer_sort",                    (DL_FUNC) &_metal_cpp_buffer_sort,                    6},
+    {"_metal_cpp_buffer_view",                    (DL_FUNC) &_metal_cpp_buffer_view,                    4},
+    {"_metal_cpp_buffer_wrap",                    (DL_FUNC) &_metal_cpp_buffer_wrap,                    2},
+    {"_metal_cpp_command_batch_commit",           (DL_FUNC) &_metal_cpp_command_batch_commit,           4},
+    {"_metal_cpp_command_queue",                  (DL_FUNC) &_metal_cpp_command_queue,                  1},
+    {"_metal_cpp_compute_pipeline",               (DL_FUNC) &_metal_cpp_compute_pipeline,               2},
+    {"_metal_cpp_compute_pipeline_execute",       (DL_FUNC) &_metal_cpp_compute_pipeline_execute,       5},
+    {"_metal_cpp_compute_pipeline_execute_async", (DL_FUNC) &_metal_cpp_compute_pipeline_execute_async, 5},
+    {"_metal_cpp_compute_pipeline_info",          (DL_FUNC) &_metal_cpp_compute_pipeline_info,          1},
+    {"_metal_cpp_compute_pipeline_tune",          (DL_FUNC) &_metal_cpp_compute_pipeline_tune,          5},
+    {"_metal_cpp_cpu_device",                     (DL_FUNC) &_metal_cpp_cpu_device,                     1},
+    {"_metal_cpp_default_device",                 (DL_FUNC) &_metal_cpp_default_device,                 0},
+    {"_metal_cpp_device_command_queue",           (DL_FUNC) &_metal_cpp_device_command_queue,           1},
+    {"_metal_cpp_device_info",                    (DL_FUNC) &_metal_cpp_device_info,                    1},
+    {"_metal_cpp_floats",                         (DL_FUNC) &_metal_cpp_floats,                         2},
+    {"_metal_cpp_floats_arith",                   (DL_FUNC) &_metal_cpp_floats_arith,                   3},
+    {"_metal_cpp_floats_compare",                 (DL_FUNC) &_metal_cpp_floats_compare,                 3},
+    {"_metal_cpp_floats_math",                    (DL_FUNC) &_metal_cpp_floats_math,                    2},
+    {"_metal_cpp_floats_mean",                    (DL_FUNC) &_metal_cpp_floats_mean,                    3},
+    {"_metal_cpp_floats_set_threading",           (DL_FUNC) &_metal_cpp_floats_set_threading,           2},
+    {"_metal_cpp_floats_simd_level",              (DL_FUNC) &_metal_cpp_floats_simd_level,              0},
+    {"_metal_cpp_floats_summary",                 (DL_FUNC) &_metal_cpp_floats_summary,                 4},
+    {"_metal_cpp_from_floats_dbl",                (DL_FUNC) &_metal_cpp_from_floats_dbl,                1},
+    {"_metal_cpp_from_floats_int",                (DL_FUNC) &_metal_cpp_from_floats_int,                1},
+    {"_metal_cpp_from_floats_lgl",                (DL_FUNC) &_metal_cpp_from_floats_lgl,                1},
+    {"_metal_cpp_from_halfs_dbl",                 (DL_FUNC) &_metal_cpp_from_halfs_dbl,                 2},
+    {"_metal_cpp_function_info",                  (DL_FUNC) &_metal_cpp_function_info,                  1},
+    {"_metal_cpp_halfs",                          (DL_FUNC) &_metal_cpp_halfs,                          3},
+    {"_metal_cpp_library_cache_clear",            (DL_FUNC) &_metal_cpp_library_cache_clear,            1},
+    {"_metal_cpp_library_cache_info",             (DL_FUNC) &_metal_cpp_library_cache_info,             1},
+    {"_metal_cpp_library_function",               (DL_FUNC) &_metal_cpp_library_function,               2},
+    {"_metal_cpp_library_function_names",         (DL_FUNC) &_metal_cpp_library_function_names,         1},
+    {"_metal_cpp_library_specialized_function",   (DL_FUNC) &_metal_cpp_library_specialized_function,   3},
+    {"_metal_cpp_make_library",                   (DL_FUNC) &_metal_cpp_make_library,                   5},
+    {"_metal_cpp_pending_error",                  (DL_FUNC) &_metal_cpp_pending_error,                  1},
+    {"_metal_cpp_pending_is_done",                (DL_FUNC) &_metal_cpp_pending_is_done,                1},
+    {"_metal_cpp_pending_wait",                   (DL_FUNC) &_metal_cpp_pending_wait,                   1},
+    {"_metal_cpp_pipeline_cache_clear",           (DL_FUNC) &_metal_cpp_pipeline_cache_clear,           1},
+    {"_metal_cpp_pipeline_cache_info",            (DL_FUNC) &_metal_cpp_pipeline_cache_info,            1},
+    {"_metal_cpp_pipeline_cache_set_capacity",    (DL_FUNC) &_metal_cpp_pipeline_cache_set_capacity,    2},
+    {"_metal_cpp_tuning_cache_clear",             (DL_FUNC) &_metal_cpp_tuning_cache_clear,             1},
+    {"_metal_cpp_tuning_cache_info",              (DL_FUNC) &_metal_cpp_tuning_cache_info,              1},
     {NULL, NULL, 0}
 };
 }
 
+void init_buffer_view(DllInfo* dll);
+void init_lazy_floats(DllInfo* dll);
+
 extern "C" attribute_visible void R_init_metal(DllInfo* dll){
   R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
   R_useDynamicSymbols(dll, FALSE);
+  init_buffer_view(dll);
+  init_lazy_floats(dll);
   R_forceSymbols(dll, TRUE);
 }
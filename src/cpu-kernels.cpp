@@ -0,0 +1,110 @@
+#include <array>
+#include <cstdint>
+#include <string>
+
+#include "backend-cpu.h"
+
+// C++ implementations of kernels for the CPU backend. A kernel declared in
+// Metal source as `kernel void name(...)` runs the kernel registered here under
+// the same name when its library is compiled for a CPU device. Kernels that
+// only exist for the package's tests and examples are named mtl_test_*, a
+// prefix that's reserved so that they can't stand in for a user's kernel with
+// the same name and different arguments. Kernels check that each buffer is
+// long enough for the elements that they read or write, so that a buffer that
+// is shorter than the grid is an error instead of a crash.
+namespace backend {
+namespace cpu {
+
+// kernel void mtl_test_add_arrays(device const float* inA,
+//                                 device const float* inB,
+//                                 device float* result,
+//                                 uint index [[thread_position_in_grid]])
+static KernelRegistration add_arrays(
+    "mtl_test_add_arrays",
+    per_thread([](const KernelArguments& args, const Size& index) {
+      size_t n = index.width + 1;
+      const float* in_a = args.buffer<float>(0, n);
+      const float* in_b = args.buffer<float>(1, n);
+      float* result = args.buffer<float>(2, n);
+      result[index.width] = in_a[index.width] + in_b[index.width];
+    }));
+
+// kernel void mtl_test_saxpy(device const float* x, device float* y,
+//                            constant float& alpha,
+//                            uint index [[thread_position_in_grid]])
+static KernelRegistration saxpy(
+    "mtl_test_saxpy", per_thread([](const KernelArguments& args, const Size& index) {
+      size_t n = index.width + 1;
+      const float* x = args.buffer<float>(0, n);
+      float* y = args.buffer<float>(1, n);
+      float alpha = args.value<float>(2);
+      y[index.width] = alpha * x[index.width] + y[index.width];
+    }));
+
+// kernel void mtl_test_transpose(device const float* in, device float* out,
+//                                constant uint2& dims,
+//                                uint2 index [[thread_position_in_grid]])
+//
+// dims is (columns, rows) of in and the grid is one thread per element of in
+static KernelRegistration transpose(
+    "mtl_test_transpose", per_thread([](const KernelArguments& args, const Size& index) {
+      auto dims = args.value<std::array<uint32_t, 2>>(2);
+      size_t column = index.width;
+      size_t row = index.height;
+      size_t in_index = row * dims[0] + column;
+      size_t out_index = column * dims[1] + row;
+      const float* in = args.buffer<float>(0, in_index + 1);
+      float* out = args.buffer<float>(1, out_index + 1);
+      out[out_index] = in[in_index];
+    }));
+
+// constant uint exponent [[function_constant(0)]];
+//
+// kernel void mtl_test_ipow(device const float* x, device float* out,
+//                           uint index [[thread_position_in_grid]])
+//
+// Exponents up to 8 are template parameters so that the loop is unrolled, like
+// the Metal compiler would for a function constant
+template <uint32_t Exponent>
+static void ipow_fixed(const KernelArguments& args, const Size& index) {
+  size_t n = index.width + 1;
+  float value = args.buffer<float>(0, n)[index.width];
+  float result = 1;
+  for (uint32_t i = 0; i < Exponent; i++) {
+    result *= value;
+  }
+
+  args.buffer<float>(1, n)[index.width] = result;
+}
+
+static KernelRegistration ipow(
+    "mtl_test_ipow",
+    [](const FunctionConstants& constants, Kernel* kernel, std::string* error) {
+      uint32_t exponent;
+      if (!constants.value("exponent", ConstantType::UInt, &exponent)) {
+        *error = "Function constant 'exponent' of type uint was not set";
+        return false;
+      }
+
+      bool unrolled = with_constant<uint32_t, 0, 1, 2, 3, 4, 5, 6, 7, 8>(
+          exponent, [&](auto value) {
+            *kernel = per_thread(ipow_fixed<decltype(value)::value>);
+          });
+      if (!unrolled) {
+        *kernel = per_thread([exponent](const KernelArguments& args, const Size& index) {
+          size_t n = index.width + 1;
+          float value = args.buffer<float>(0, n)[index.width];
+          float result = 1;
+          for (uint32_t i = 0; i < exponent; i++) {
+            result *= value;
+          }
+
+          args.buffer<float>(1, n)[index.width] = result;
+        });
+      }
+
+      return true;
+    });
+
+}  // namespace cpu
+}  // namespace backend
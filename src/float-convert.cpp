@@ -0,0 +1,831 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+
+#include "float-convert.h"
+#include "thread-pool.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FLOATS_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define FLOATS_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace floats {
+
+// NA_INTEGER and NA_LOGICAL
+static constexpr int kNA = std::numeric_limits<int>::min();
+
+// The scalar loops are also used for the remainder of each vectorized loop,
+// which makes the results identical regardless of the instruction set
+static void from_dbl_scalar(const double* x, float* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = x[i];
+  }
+}
+
+static void from_int_scalar(const int* x, float* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (x[i] == kNA) {
+      out[i] = NAN;
+    } else {
+      out[i] = x[i];
+    }
+  }
+}
+
+static void to_dbl_scalar(const float* x, double* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = x[i];
+  }
+}
+
+static void to_int_scalar(const float* x, int* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (std::isnan(x[i])) {
+      out[i] = kNA;
+    } else {
+      out[i] = static_cast<int>(x[i]);
+    }
+  }
+}
+
+// Half precision conversions of single elements (from "Half to float done
+// quick" by F. Giesen). NaN payloads are truncated like F16C and NEON do so that
+// the result doesn't depend on the instruction set.
+static uint16_t half_from_float(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint32_t sign = (bits >> 16) & 0x8000;
+  bits &= 0x7fffffff;
+
+  uint32_t result;
+  if (bits >= 0x47800000) {
+    // Inf, NaN, or too big for a half (>= 65536)
+    result = bits > 0x7f800000 ? 0x7e00 | ((bits >> 13) & 0x3ff) : 0x7c00;
+  } else if (bits < 0x38800000) {
+    // Subnormal or zero: aligns the mantissa bits so that the (round to nearest
+    // even) float addition does the rounding
+    float magic = 0.5f;
+    float value_abs;
+    std::memcpy(&value_abs, &bits, sizeof(bits));
+    value_abs += magic;
+    std::memcpy(&result, &value_abs, sizeof(result));
+    result -= 0x3f000000;
+  } else {
+    // Normal: rebias the exponent and round to nearest even
+    uint32_t mantissa_odd = (bits >> 13) & 1;
+    bits += 0xc8000fff + mantissa_odd;
+    result = bits >> 13;
+  }
+
+  return result | sign;
+}
+
+static float half_to_float(uint16_t value) {
+  uint32_t bits = (value & 0x7fff) << 13;
+  uint32_t exponent = bits & 0x0f800000;
+  bits += 0x38000000;
+
+  if (exponent == 0x0f800000) {
+    // Inf or NaN
+    bits += 0x38000000;
+  } else if (exponent == 0) {
+    // Subnormal or zero
+    bits += 0x00800000;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    result -= 6.103515625e-05f;
+    std::memcpy(&bits, &result, sizeof(bits));
+  }
+
+  bits |= static_cast<uint32_t>(value & 0x8000) << 16;
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+// bfloat16 is the upper half of a float
+static uint16_t bfloat16_from_float(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  if (std::isnan(value)) {
+    return (bits >> 16) | 0x40;
+  }
+
+  return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+}
+
+static float bfloat16_to_float(uint16_t value) {
+  uint32_t bits = static_cast<uint32_t>(value) << 16;
+  float result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+static void half_from_dbl_scalar(const double* x, int* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = half_from_float(static_cast<float>(x[i]));
+  }
+}
+
+static void half_to_dbl_scalar(const int* x, double* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = half_to_float(static_cast<uint16_t>(x[i]));
+  }
+}
+
+static void bfloat16_from_dbl_scalar(const double* x, int* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = bfloat16_from_float(static_cast<float>(x[i]));
+  }
+}
+
+static void bfloat16_to_dbl_scalar(const int* x, double* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = bfloat16_to_float(static_cast<uint16_t>(x[i]));
+  }
+}
+
+static void half_from_float_scalar(const float* x, uint16_t* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = half_from_float(x[i]);
+  }
+}
+
+static void half_to_float_scalar(const uint16_t* x, float* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = half_to_float(x[i]);
+  }
+}
+
+static void bfloat16_from_float_scalar(const float* x, uint16_t* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = bfloat16_from_float(x[i]);
+  }
+}
+
+static void bfloat16_to_float_scalar(const uint16_t* x, float* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = bfloat16_to_float(x[i]);
+  }
+}
+
+static void narrow_16_scalar(const int* x, uint16_t* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = static_cast<uint16_t>(x[i]);
+  }
+}
+
+static void widen_16_scalar(const uint16_t* x, int* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = x[i];
+  }
+}
+
+#if defined(FLOATS_X86)
+
+__attribute__((target("avx2"))) static void from_dbl_avx2(const double* x, float* out,
+                                                          size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(out + i, _mm256_cvtpd_ps(_mm256_loadu_pd(x + i)));
+  }
+
+  from_dbl_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void from_int_avx2(const int* x, float* out,
+                                                          size_t n) {
+  const __m256i na = _mm256_set1_epi32(kNA);
+  const __m256 nan = _mm256_set1_ps(NAN);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i));
+    __m256 is_na = _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, na));
+    _mm256_storeu_ps(out + i, _mm256_blendv_ps(_mm256_cvtepi32_ps(v), nan, is_na));
+  }
+
+  from_int_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void to_dbl_avx2(const float* x, double* out,
+                                                        size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm_loadu_ps(x + i)));
+  }
+
+  to_dbl_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void to_int_avx2(const float* x, int* out,
+                                                        size_t n) {
+  const __m256 na = _mm256_castsi256_ps(_mm256_set1_epi32(kNA));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(x + i);
+    __m256 is_nan = _mm256_cmp_ps(v, v, _CMP_UNORD_Q);
+    __m256 result = _mm256_castsi256_ps(_mm256_cvttps_epi32(v));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_castps_si256(_mm256_blendv_ps(result, na, is_nan)));
+  }
+
+  to_int_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void from_dbl_avx512(const double* x,
+                                                               float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm512_cvtpd_ps(_mm512_loadu_pd(x + i)));
+  }
+
+  from_dbl_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void from_int_avx512(const int* x, float* out,
+                                                               size_t n) {
+  const __m512i na = _mm512_set1_epi32(kNA);
+  const __m512 nan = _mm512_set1_ps(NAN);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i v = _mm512_loadu_si512(x + i);
+    __mmask16 is_na = _mm512_cmpeq_epi32_mask(v, na);
+    _mm512_storeu_ps(out + i, _mm512_mask_blend_ps(is_na, _mm512_cvtepi32_ps(v), nan));
+  }
+
+  from_int_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void to_dbl_avx512(const float* x,
+                                                             double* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm512_storeu_pd(out + i, _mm512_cvtps_pd(_mm256_loadu_ps(x + i)));
+  }
+
+  to_dbl_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void to_int_avx512(const float* x, int* out,
+                                                             size_t n) {
+  const __m512i na = _mm512_set1_epi32(kNA);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 v = _mm512_loadu_ps(x + i);
+    __mmask16 is_nan = _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q);
+    __m512i result = _mm512_cvttps_epi32(v);
+    _mm512_storeu_si512(out + i, _mm512_mask_blend_epi32(is_nan, result, na));
+  }
+
+  to_int_scalar(x + i, out + i, n - i);
+}
+
+// F16C instructions only exist alongside AVX, and every CPU with AVX2 has them
+__attribute__((target("avx2,f16c"))) static void half_from_dbl_f16c(const double* x,
+                                                                   int* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128 low = _mm256_cvtpd_ps(_mm256_loadu_pd(x + i));
+    __m128 high = _mm256_cvtpd_ps(_mm256_loadu_pd(x + i + 4));
+    __m256 v = _mm256_set_m128(high, low);
+    __m256i result = _mm256_cvtepu16_epi32(_mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), result);
+  }
+
+  half_from_dbl_scalar(x + i, out + i, n - i);
+}
+
+// Packs eight 32-bit lanes that are each at most 0xffff into one 128-bit register
+__attribute__((target("avx2"))) static inline __m128i pack_16_avx2(__m256i v) {
+  v = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+  return _mm256_castsi256_si128(v);
+}
+
+// Packs the low 16 bits of eight payloads into one 128-bit register
+__attribute__((target("avx2"))) static inline __m128i load_payloads_avx2(const int* x) {
+  __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x));
+  return pack_16_avx2(_mm256_and_si256(v, _mm256_set1_epi32(0xffff)));
+}
+
+__attribute__((target("avx2"))) static inline void store_dbl_avx2(double* out,
+                                                                  __m256 v) {
+  _mm256_storeu_pd(out, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+  _mm256_storeu_pd(out + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx2,f16c"))) static void half_to_dbl_f16c(const int* x,
+                                                                 double* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    store_dbl_avx2(out + i, _mm256_cvtph_ps(load_payloads_avx2(x + i)));
+  }
+
+  half_to_dbl_scalar(x + i, out + i, n - i);
+}
+
+// Rounds eight floats to bfloat16 payloads in 32-bit lanes
+__attribute__((target("avx2"))) static inline __m256i bfloat16_round_avx2(__m256 v) {
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i rounding = _mm256_set1_epi32(0x7fff);
+  const __m256i quiet = _mm256_set1_epi32(0x40);
+  __m256i bits = _mm256_castps_si256(v);
+  __m256i upper = _mm256_srli_epi32(bits, 16);
+  __m256i bias = _mm256_add_epi32(rounding, _mm256_and_si256(upper, one));
+  __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, bias), 16);
+  __m256i nan = _mm256_or_si256(upper, quiet);
+  __m256 is_nan = _mm256_cmp_ps(v, v, _CMP_UNORD_Q);
+  __m256 result =
+      _mm256_blendv_ps(_mm256_castsi256_ps(rounded), _mm256_castsi256_ps(nan), is_nan);
+  return _mm256_castps_si256(result);
+}
+
+__attribute__((target("avx2"))) static void bfloat16_from_dbl_avx2(const double* x,
+                                                                   int* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128 low = _mm256_cvtpd_ps(_mm256_loadu_pd(x + i));
+    __m128 high = _mm256_cvtpd_ps(_mm256_loadu_pd(x + i + 4));
+    __m256i result = bfloat16_round_avx2(_mm256_set_m128(high, low));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), result);
+  }
+
+  bfloat16_from_dbl_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void bfloat16_to_dbl_avx2(const int* x,
+                                                                 double* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i));
+    store_dbl_avx2(out + i, _mm256_castsi256_ps(_mm256_slli_epi32(v, 16)));
+  }
+
+  bfloat16_to_dbl_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,f16c"))) static void half_from_float_f16c(const float* x,
+                                                                     uint16_t* out,
+                                                                     size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i result = _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), result);
+  }
+
+  half_from_float_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,f16c"))) static void half_to_float_f16c(const uint16_t* x,
+                                                                   float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(v));
+  }
+
+  half_to_float_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void bfloat16_from_float_avx2(const float* x,
+                                                                     uint16_t* out,
+                                                                     size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i result = pack_16_avx2(bfloat16_round_avx2(_mm256_loadu_ps(x + i)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), result);
+  }
+
+  bfloat16_from_float_scalar(x + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void bfloat16_to_float_avx2(const uint16_t* x,
+                                                                   float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+    __m256i bits = _mm256_slli_epi32(_mm256_cvtepu16_epi32(v), 16);
+    _mm256_storeu_ps(out + i, _mm256_castsi256_ps(bits));
+  }
+
+  bfloat16_to_float_scalar(x + i, out + i, n - i);
+}
+
+static bool has_f16c() {
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_F16C) != 0;
+}
+
+#elif defined(FLOATS_NEON)
+
+static void from_dbl_neon(const double* x, float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x2_t low = vcvt_f32_f64(vld1q_f64(x + i));
+    vst1q_f32(out + i, vcvt_high_f32_f64(low, vld1q_f64(x + i + 2)));
+  }
+
+  from_dbl_scalar(x + i, out + i, n - i);
+}
+
+static void from_int_neon(const int* x, float* out, size_t n) {
+  const int32x4_t na = vdupq_n_s32(kNA);
+  const float32x4_t nan = vdupq_n_f32(NAN);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32x4_t v = vld1q_s32(x + i);
+    uint32x4_t is_na = vceqq_s32(v, na);
+    vst1q_f32(out + i, vbslq_f32(is_na, nan, vcvtq_f32_s32(v)));
+  }
+
+  from_int_scalar(x + i, out + i, n - i);
+}
+
+static void to_dbl_neon(const float* x, double* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t v = vld1q_f32(x + i);
+    vst1q_f64(out + i, vcvt_f64_f32(vget_low_f32(v)));
+    vst1q_f64(out + i + 2, vcvt_high_f64_f32(v));
+  }
+
+  to_dbl_scalar(x + i, out + i, n - i);
+}
+
+static void to_int_neon(const float* x, int* out, size_t n) {
+  const int32x4_t na = vdupq_n_s32(kNA);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t v = vld1q_f32(x + i);
+    uint32x4_t is_number = vceqq_f32(v, v);
+    vst1q_s32(out + i, vbslq_s32(is_number, vcvtq_s32_f32(v), na));
+  }
+
+  to_int_scalar(x + i, out + i, n - i);
+}
+
+static void half_from_dbl_neon(const double* x, int* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x2_t low = vcvt_f32_f64(vld1q_f64(x + i));
+    float32x4_t v = vcvt_high_f32_f64(low, vld1q_f64(x + i + 2));
+    uint16x4_t halfs = vreinterpret_u16_f16(vcvt_f16_f32(v));
+    vst1q_s32(out + i, vreinterpretq_s32_u32(vmovl_u16(halfs)));
+  }
+
+  half_from_dbl_scalar(x + i, out + i, n - i);
+}
+
+static void store_dbl_neon(double* out, float32x4_t v) {
+  vst1q_f64(out, vcvt_f64_f32(vget_low_f32(v)));
+  vst1q_f64(out + 2, vcvt_high_f64_f32(v));
+}
+
+static void half_to_dbl_neon(const int* x, double* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint16x4_t halfs = vmovn_u32(vreinterpretq_u32_s32(vld1q_s32(x + i)));
+    store_dbl_neon(out + i, vcvt_f32_f16(vreinterpret_f16_u16(halfs)));
+  }
+
+  half_to_dbl_scalar(x + i, out + i, n - i);
+}
+
+// Rounds four floats to bfloat16 payloads in 32-bit lanes
+static uint32x4_t bfloat16_round_neon(float32x4_t v) {
+  const uint32x4_t one = vdupq_n_u32(1);
+  const uint32x4_t rounding = vdupq_n_u32(0x7fff);
+  const uint32x4_t quiet = vdupq_n_u32(0x40);
+  uint32x4_t bits = vreinterpretq_u32_f32(v);
+  uint32x4_t upper = vshrq_n_u32(bits, 16);
+  uint32x4_t bias = vaddq_u32(rounding, vandq_u32(upper, one));
+  uint32x4_t rounded = vshrq_n_u32(vaddq_u32(bits, bias), 16);
+  uint32x4_t is_number = vceqq_f32(v, v);
+  return vbslq_u32(is_number, rounded, vorrq_u32(upper, quiet));
+}
+
+static void bfloat16_from_dbl_neon(const double* x, int* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x2_t low = vcvt_f32_f64(vld1q_f64(x + i));
+    float32x4_t v = vcvt_high_f32_f64(low, vld1q_f64(x + i + 2));
+    vst1q_s32(out + i, vreinterpretq_s32_u32(bfloat16_round_neon(v)));
+  }
+
+  bfloat16_from_dbl_scalar(x + i, out + i, n - i);
+}
+
+static void bfloat16_to_dbl_neon(const int* x, double* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t bits = vshlq_n_u32(vreinterpretq_u32_s32(vld1q_s32(x + i)), 16);
+    store_dbl_neon(out + i, vreinterpretq_f32_u32(bits));
+  }
+
+  bfloat16_to_dbl_scalar(x + i, out + i, n - i);
+}
+
+static void half_from_float_neon(const float* x, uint16_t* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1_u16(out + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(x + i))));
+  }
+
+  half_from_float_scalar(x + i, out + i, n - i);
+}
+
+static void half_to_float_neon(const uint16_t* x, float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(out + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(x + i))));
+  }
+
+  half_to_float_scalar(x + i, out + i, n - i);
+}
+
+static void bfloat16_from_float_neon(const float* x, uint16_t* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1_u16(out + i, vmovn_u32(bfloat16_round_neon(vld1q_f32(x + i))));
+  }
+
+  bfloat16_from_float_scalar(x + i, out + i, n - i);
+}
+
+static void bfloat16_to_float_neon(const uint16_t* x, float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t bits = vshlq_n_u32(vmovl_u16(vld1_u16(x + i)), 16);
+    vst1q_f32(out + i, vreinterpretq_f32_u32(bits));
+  }
+
+  bfloat16_to_float_scalar(x + i, out + i, n - i);
+}
+
+#endif
+
+struct Kernels {
+  const char* name;
+  void (*from_dbl)(const double*, float*, size_t);
+  void (*from_int)(const int*, float*, size_t);
+  void (*to_dbl)(const float*, double*, size_t);
+  void (*to_int)(const float*, int*, size_t);
+};
+
+static Kernels select_kernels() {
+#if defined(FLOATS_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return Kernels{"avx512", &from_dbl_avx512, &from_int_avx512, &to_dbl_avx512,
+                   &to_int_avx512};
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    return Kernels{"avx2", &from_dbl_avx2, &from_int_avx2, &to_dbl_avx2, &to_int_avx2};
+  }
+#elif defined(FLOATS_NEON)
+  return Kernels{"neon", &from_dbl_neon, &from_int_neon, &to_dbl_neon, &to_int_neon};
+#endif
+
+  return Kernels{"scalar", &from_dbl_scalar, &from_int_scalar, &to_dbl_scalar,
+                 &to_int_scalar};
+}
+
+static const Kernels& kernels() {
+  static const Kernels selected = select_kernels();
+  return selected;
+}
+
+struct HalfKernels {
+  void (*half_from_dbl)(const double*, int*, size_t);
+  void (*half_to_dbl)(const int*, double*, size_t);
+  void (*bfloat16_from_dbl)(const double*, int*, size_t);
+  void (*bfloat16_to_dbl)(const int*, double*, size_t);
+  void (*half_from_float)(const float*, uint16_t*, size_t);
+  void (*half_to_float)(const uint16_t*, float*, size_t);
+  void (*bfloat16_from_float)(const float*, uint16_t*, size_t);
+  void (*bfloat16_to_float)(const uint16_t*, float*, size_t);
+};
+
+static HalfKernels select_half_kernels() {
+#if defined(FLOATS_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && has_f16c()) {
+    return HalfKernels{&half_from_dbl_f16c,       &half_to_dbl_f16c,
+                       &bfloat16_from_dbl_avx2,   &bfloat16_to_dbl_avx2,
+                       &half_from_float_f16c,     &half_to_float_f16c,
+                       &bfloat16_from_float_avx2, &bfloat16_to_float_avx2};
+  }
+#elif defined(FLOATS_NEON)
+  return HalfKernels{&half_from_dbl_neon,       &half_to_dbl_neon,
+                     &bfloat16_from_dbl_neon,   &bfloat16_to_dbl_neon,
+                     &half_from_float_neon,     &half_to_float_neon,
+                     &bfloat16_from_float_neon, &bfloat16_to_float_neon};
+#endif
+
+  return HalfKernels{&half_from_dbl_scalar,       &half_to_dbl_scalar,
+                     &bfloat16_from_dbl_scalar,   &bfloat16_to_dbl_scalar,
+                     &half_from_float_scalar,     &half_to_float_scalar,
+                     &bfloat16_from_float_scalar, &bfloat16_to_float_scalar};
+}
+
+static const HalfKernels& half_kernels() {
+  static const HalfKernels selected = select_half_kernels();
+  return selected;
+}
+
+static int n_threads_requested = 0;
+static size_t n_parallel_threshold = kDefaultParallelThreshold;
+static std::unique_ptr<ThreadPool> thread_pool;
+
+void set_num_threads(int n_threads) {
+  if (n_threads != n_threads_requested) {
+    n_threads_requested = n_threads;
+    thread_pool.reset();
+  }
+}
+
+int num_threads() {
+  return n_threads_requested > 0 ? n_threads_requested : ThreadPool::hardware_threads();
+}
+
+void set_parallel_threshold(size_t n) { n_parallel_threshold = n; }
+size_t parallel_threshold() { return n_parallel_threshold; }
+
+// Chunks start on a cache line boundary (relative to the start of the vector)
+// and there are a few per thread so that a slow thread doesn't hold up the
+// others
+static constexpr size_t kChunkAlign = 64;
+static constexpr size_t kMinChunk = 1 << 14;
+
+static bool is_parallel(size_t n) {
+  return n >= n_parallel_threshold && num_threads() > 1;
+}
+
+static size_t chunk_size(size_t n) {
+  if (!is_parallel(n)) {
+    return std::max<size_t>(n, 1);
+  }
+
+  size_t n_tasks = num_threads() * 4;
+  size_t chunk = std::max(kMinChunk, (n + n_tasks - 1) / n_tasks);
+  return ((chunk + kChunkAlign - 1) / kChunkAlign) * kChunkAlign;
+}
+
+size_t num_chunks(size_t n) {
+  size_t chunk = chunk_size(n);
+  return (n + chunk - 1) / chunk;
+}
+
+void for_each_chunk(size_t n, const std::function<void(size_t, size_t, size_t)>& fn) {
+  if (!is_parallel(n)) {
+    if (n > 0) {
+      fn(0, 0, n);
+    }
+    return;
+  }
+
+  if (!thread_pool) {
+    thread_pool.reset(new ThreadPool(n_threads_requested));
+  }
+
+  size_t chunk = chunk_size(n);
+  thread_pool->parallel_for(num_chunks(n), [&](size_t i) {
+    size_t begin = i * chunk;
+    fn(i, begin, std::min(begin + chunk, n));
+  });
+}
+
+template <typename In, typename Out>
+static void convert(void (*kernel)(const In*, Out*, size_t), const In* x, Out* out,
+                    size_t n) {
+  if (!is_parallel(n)) {
+    kernel(x, out, n);
+    return;
+  }
+
+  for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    kernel(x + begin, out + begin, end - begin);
+  });
+}
+
+void from_dbl(const double* x, float* out, size_t n) {
+  convert(kernels().from_dbl, x, out, n);
+}
+
+void from_int(const int* x, float* out, size_t n) {
+  convert(kernels().from_int, x, out, n);
+}
+
+// Logical vectors use the same representation as integer vectors
+void from_lgl(const int* x, float* out, size_t n) {
+  convert(kernels().from_int, x, out, n);
+}
+
+void to_dbl(const float* x, double* out, size_t n) {
+  convert(kernels().to_dbl, x, out, n);
+}
+
+void to_int(const float* x, int* out, size_t n) {
+  convert(kernels().to_int, x, out, n);
+}
+
+void to_lgl(const float* x, int* out, size_t n) {
+  convert(kernels().to_int, x, out, n);
+}
+
+const char* simd_level() { return kernels().name; }
+
+void half_from_dbl(const double* x, int* out, size_t n) {
+  convert(half_kernels().half_from_dbl, x, out, n);
+}
+
+void half_to_dbl(const int* x, double* out, size_t n) {
+  convert(half_kernels().half_to_dbl, x, out, n);
+}
+
+void bfloat16_from_dbl(const double* x, int* out, size_t n) {
+  convert(half_kernels().bfloat16_from_dbl, x, out, n);
+}
+
+void bfloat16_to_dbl(const int* x, double* out, size_t n) {
+  convert(half_kernels().bfloat16_to_dbl, x, out, n);
+}
+
+void narrow_16(const int* x, uint16_t* out, size_t n) {
+  convert(&narrow_16_scalar, x, out, n);
+}
+
+void widen_16(const uint16_t* x, int* out, size_t n) {
+  convert(&widen_16_scalar, x, out, n);
+}
+
+void half_to_float(const uint16_t* x, float* out, size_t n) {
+  half_kernels().half_to_float(x, out, n);
+}
+
+// 16-bit elements are converted through a block of floats that stays in the L1
+// cache, so the vector and the buffer are each only read or written once
+static constexpr size_t kStorageBlock = 1024;
+
+template <typename In>
+static void store(void (*to_float)(const In*, float*, size_t), const In* x,
+                  Storage type, void* out, size_t n) {
+  if (type == Storage::kFloat) {
+    convert(to_float, x, static_cast<float*>(out), n);
+    return;
+  }
+
+  auto from_float = type == Storage::kHalf ? half_kernels().half_from_float
+                                           : half_kernels().bfloat16_from_float;
+  auto out_16 = static_cast<uint16_t*>(out);
+  for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    float block[kStorageBlock];
+    for (size_t i = begin; i < end; i += kStorageBlock) {
+      size_t block_size = std::min(kStorageBlock, end - i);
+      to_float(x + i, block, block_size);
+      from_float(block, out_16 + i, block_size);
+    }
+  });
+}
+
+void store_dbl(const double* x, Storage type, void* out, size_t n) {
+  store(kernels().from_dbl, x, type, out, n);
+}
+
+void store_int(const int* x, Storage type, void* out, size_t n) {
+  store(kernels().from_int, x, type, out, n);
+}
+
+void store_lgl(const int* x, Storage type, void* out, size_t n) {
+  store(kernels().from_int, x, type, out, n);
+}
+
+void load_dbl(const void* x, Storage type, double* out, size_t n) {
+  if (type == Storage::kFloat) {
+    convert(kernels().to_dbl, static_cast<const float*>(x), out, n);
+    return;
+  }
+
+  auto to_float = type == Storage::kHalf ? half_kernels().half_to_float
+                                         : half_kernels().bfloat16_to_float;
+  auto to_dbl = kernels().to_dbl;
+  auto x_16 = static_cast<const uint16_t*>(x);
+  for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    float block[kStorageBlock];
+    for (size_t i = begin; i < end; i += kStorageBlock) {
+      size_t block_size = std::min(kStorageBlock, end - i);
+      to_float(x_16 + i, block, block_size);
+      to_dbl(block, out + i, block_size);
+    }
+  });
+}
+
+}  // namespace floats
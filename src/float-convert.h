@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Conversions between R vectors and 32-bit floats for the mtl_floats type.
+// These work on raw pointers and never touch the R API. The NA semantics are
+// the same as the scalar loops they replace: NA_INTEGER/NA_LOGICAL become NaN,
+// NaN becomes NA_INTEGER/NA_LOGICAL, and doubles and floats are converted with
+// an ordinary cast (i.e., NA_real_ becomes NaN).
+//
+// Each conversion is vectorized with the best instruction set available at
+// runtime (AVX-512 or AVX2 on x86_64, NEON on arm64) and falls back to a
+// scalar loop. Conversions of at least parallel_threshold() elements are split
+// into chunks that are converted on a thread pool.
+namespace floats {
+
+void from_dbl(const double* x, float* out, size_t n);
+void from_int(const int* x, float* out, size_t n);
+void from_lgl(const int* x, float* out, size_t n);
+
+void to_dbl(const float* x, double* out, size_t n);
+void to_int(const float* x, int* out, size_t n);
+void to_lgl(const float* x, int* out, size_t n);
+
+// "avx512", "avx2", "neon", or "scalar"
+const char* simd_level();
+
+// Conversions between R doubles and the 16-bit payloads of the mtl_halfs (IEEE
+// half precision) and mtl_bfloat16s types, which store one payload per element
+// of an integer vector. Doubles are rounded to float first (like the hardware
+// conversions) and then to the nearest 16-bit value, ties to even. NaN
+// (including NA) becomes a quiet NaN. These use F16C (with AVX2) or NEON when
+// available.
+void half_from_dbl(const double* x, int* out, size_t n);
+void half_to_dbl(const int* x, double* out, size_t n);
+void bfloat16_from_dbl(const double* x, int* out, size_t n);
+void bfloat16_to_dbl(const int* x, double* out, size_t n);
+
+// Packs the payloads of an mtl_halfs or mtl_bfloat16s into 16-bit storage
+// (e.g., a buffer) and unpacks them
+void narrow_16(const int* x, uint16_t* out, size_t n);
+void widen_16(const uint16_t* x, int* out, size_t n);
+
+// Converts the contents of a half buffer to floats on the calling thread (e.g.,
+// in a kernel that is already running on a worker thread)
+void half_to_float(const uint16_t* x, float* out, size_t n);
+
+// The element types of float buffers
+enum class Storage { kFloat, kHalf, kBfloat16 };
+
+// Conversions between R vectors and the contents of float, half, and bfloat16
+// buffers in a single pass. The results are identical to converting to an
+// mtl_floats, mtl_halfs, or mtl_bfloat16s and copying that into the buffer (or
+// the reverse) but without the intermediate vector.
+void store_dbl(const double* x, Storage type, void* out, size_t n);
+void store_int(const int* x, Storage type, void* out, size_t n);
+void store_lgl(const int* x, Storage type, void* out, size_t n);
+void load_dbl(const void* x, Storage type, double* out, size_t n);
+
+// n_threads <= 0 uses one thread per hardware core. These must be called from
+// the thread that runs conversions.
+void set_num_threads(int n_threads);
+int num_threads();
+void set_parallel_threshold(size_t n);
+size_t parallel_threshold();
+
+constexpr size_t kDefaultParallelThreshold = 1 << 20;
+
+// Splits [0, n) into num_chunks(n) chunks and calls fn(chunk, begin, end) for
+// each of them, on the thread pool if n is at least parallel_threshold(). fn
+// must not call into the R API.
+size_t num_chunks(size_t n);
+void for_each_chunk(size_t n, const std::function<void(size_t, size_t, size_t)>& fn);
+
+}  // namespace floats
@@ -0,0 +1,642 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "float-convert.h"
+#include "float-ops.h"
+
+namespace floats {
+
+// NA_INTEGER and NA_LOGICAL
+static constexpr int kNA = std::numeric_limits<int>::min();
+
+// Blocks of four elements are processed using GCC/clang vector extensions,
+// which compile to the baseline SIMD instructions of the target (SSE2 or NEON)
+// without a separate implementation for each
+static constexpr size_t kLanes = 4;
+typedef float vfloat __attribute__((vector_size(16)));
+typedef int32_t vint __attribute__((vector_size(16)));
+typedef double vdouble __attribute__((vector_size(32)));
+
+static inline vfloat load(const float* x) {
+  vfloat v;
+  std::memcpy(&v, x, sizeof(v));
+  return v;
+}
+
+static inline void store(float* out, vfloat v) { std::memcpy(out, &v, sizeof(v)); }
+static inline void store(int* out, vint v) { std::memcpy(out, &v, sizeof(v)); }
+
+static inline vfloat broadcast(float value) {
+  vfloat v;
+  for (size_t j = 0; j < kLanes; j++) {
+    v[j] = value;
+  }
+  return v;
+}
+
+// Selects a where mask is set and b elsewhere
+static inline vfloat select(vint mask, vfloat a, vfloat b) {
+  return (vfloat)(((vint)a & mask) | ((vint)b & ~mask));
+}
+
+// For operations without a vector instruction
+template <typename Op>
+static inline vfloat apply_lanes(vfloat x, vfloat y) {
+  vfloat result;
+  for (size_t j = 0; j < kLanes; j++) {
+    result[j] = Op::apply(x[j], y[j]);
+  }
+  return result;
+}
+
+template <typename Op>
+static inline vfloat apply_lanes(vfloat x) {
+  vfloat result;
+  for (size_t j = 0; j < kLanes; j++) {
+    result[j] = Op::apply(x[j]);
+  }
+  return result;
+}
+
+struct Add {
+  static float apply(float x, float y) { return x + y; }
+  static vfloat apply(vfloat x, vfloat y) { return x + y; }
+};
+
+struct Subtract {
+  static float apply(float x, float y) { return x - y; }
+  static vfloat apply(vfloat x, vfloat y) { return x - y; }
+};
+
+struct Multiply {
+  static float apply(float x, float y) { return x * y; }
+  static vfloat apply(vfloat x, vfloat y) { return x * y; }
+};
+
+struct Divide {
+  static float apply(float x, float y) { return x / y; }
+  static vfloat apply(vfloat x, vfloat y) { return x / y; }
+};
+
+struct Power {
+  static float apply(float x, float y) { return std::pow(x, y); }
+  static vfloat apply(vfloat x, vfloat y) { return apply_lanes<Power>(x, y); }
+};
+
+// %% and %/% use the same definitions as R's (in double precision) so that the
+// sign of the result follows the divisor
+struct Modulo {
+  static float apply(float x, float y) {
+    if (y == 0) {
+      return NAN;
+    }
+
+    double q = static_cast<double>(x) / y;
+    double tmp = x - std::floor(q) * y;
+    return tmp - std::floor(tmp / y) * y;
+  }
+
+  static vfloat apply(vfloat x, vfloat y) { return apply_lanes<Modulo>(x, y); }
+};
+
+struct IntDivide {
+  static float apply(float x, float y) {
+    double q = static_cast<double>(x) / y;
+    if (y == 0 || !std::isfinite(q)) {
+      return q;
+    }
+
+    double tmp = x - std::floor(q) * y;
+    return std::floor(q) + std::floor(tmp / y);
+  }
+
+  static vfloat apply(vfloat x, vfloat y) { return apply_lanes<IntDivide>(x, y); }
+};
+
+// Comparisons involving NaN are NA
+static inline int compare_result(bool is_true, bool is_nan) {
+  return is_nan ? kNA : is_true;
+}
+
+static inline vint compare_result(vint is_true, vint is_nan) {
+  return (is_true & 1 & ~is_nan) | (is_nan & kNA);
+}
+
+#define FLOATS_COMPARE_OP(name, op)                                     \
+  struct name {                                                         \
+    static int apply(float x, float y) {                                \
+      return compare_result(x op y, std::isnan(x) || std::isnan(y));    \
+    }                                                                   \
+    static vint apply(vfloat x, vfloat y) {                             \
+      return compare_result(x op y, (x != x) | (y != y));               \
+    }                                                                   \
+  };
+
+FLOATS_COMPARE_OP(Equal, ==)
+FLOATS_COMPARE_OP(NotEqual, !=)
+FLOATS_COMPARE_OP(Less, <)
+FLOATS_COMPARE_OP(LessEqual, <=)
+FLOATS_COMPARE_OP(Greater, >)
+FLOATS_COMPARE_OP(GreaterEqual, >=)
+
+#undef FLOATS_COMPARE_OP
+
+template <typename Op, typename Out>
+static void binary_chunk(const float* x, size_t n_x, const float* y, size_t n_y,
+                         Out* out, size_t begin, size_t end) {
+  size_t i = begin;
+
+  if (n_x == n_y) {
+    for (; i + kLanes <= end; i += kLanes) {
+      store(out + i, Op::apply(load(x + i), load(y + i)));
+    }
+    for (; i < end; i++) {
+      out[i] = Op::apply(x[i], y[i]);
+    }
+  } else if (n_y == 1) {
+    vfloat y_lanes = broadcast(y[0]);
+    for (; i + kLanes <= end; i += kLanes) {
+      store(out + i, Op::apply(load(x + i), y_lanes));
+    }
+    for (; i < end; i++) {
+      out[i] = Op::apply(x[i], y[0]);
+    }
+  } else if (n_x == 1) {
+    vfloat x_lanes = broadcast(x[0]);
+    for (; i + kLanes <= end; i += kLanes) {
+      store(out + i, Op::apply(x_lanes, load(y + i)));
+    }
+    for (; i < end; i++) {
+      out[i] = Op::apply(x[0], y[i]);
+    }
+  } else {
+    size_t i_x = begin % n_x;
+    size_t i_y = begin % n_y;
+    for (; i < end; i++) {
+      out[i] = Op::apply(x[i_x], y[i_y]);
+      if (++i_x == n_x) i_x = 0;
+      if (++i_y == n_y) i_y = 0;
+    }
+  }
+}
+
+template <typename Op, typename Out>
+static void binary_loop(const float* x, size_t n_x, const float* y, size_t n_y,
+                        Out* out, size_t n) {
+  for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    binary_chunk<Op>(x, n_x, y, n_y, out, begin, end);
+  });
+}
+
+void binary(BinaryOp op, const float* x, size_t n_x, const float* y, size_t n_y,
+            float* out, size_t n) {
+  switch (op) {
+    case BinaryOp::kAdd:
+      return binary_loop<Add>(x, n_x, y, n_y, out, n);
+    case BinaryOp::kSubtract:
+      return binary_loop<Subtract>(x, n_x, y, n_y, out, n);
+    case BinaryOp::kMultiply:
+      return binary_loop<Multiply>(x, n_x, y, n_y, out, n);
+    case BinaryOp::kDivide:
+      return binary_loop<Divide>(x, n_x, y, n_y, out, n);
+    case BinaryOp::kPower:
+      return binary_loop<Power>(x, n_x, y, n_y, out, n);
+    case BinaryOp::kModulo:
+      return binary_loop<Modulo>(x, n_x, y, n_y, out, n);
+    case BinaryOp::kIntDivide:
+      return binary_loop<IntDivide>(x, n_x, y, n_y, out, n);
+  }
+}
+
+void compare(CompareOp op, const float* x, size_t n_x, const float* y, size_t n_y,
+             int* out, size_t n) {
+  switch (op) {
+    case CompareOp::kEqual:
+      return binary_loop<Equal>(x, n_x, y, n_y, out, n);
+    case CompareOp::kNotEqual:
+      return binary_loop<NotEqual>(x, n_x, y, n_y, out, n);
+    case CompareOp::kLess:
+      return binary_loop<Less>(x, n_x, y, n_y, out, n);
+    case CompareOp::kLessEqual:
+      return binary_loop<LessEqual>(x, n_x, y, n_y, out, n);
+    case CompareOp::kGreater:
+      return binary_loop<Greater>(x, n_x, y, n_y, out, n);
+    case CompareOp::kGreaterEqual:
+      return binary_loop<GreaterEqual>(x, n_x, y, n_y, out, n);
+  }
+}
+
+struct Negate {
+  static float apply(float x) { return -x; }
+  static vfloat apply(vfloat x) { return -x; }
+};
+
+struct Abs {
+  static float apply(float x) { return std::fabs(x); }
+  static vfloat apply(vfloat x) { return (vfloat)((vint)x & 0x7fffffff); }
+};
+
+struct Sign {
+  static float apply(float x) { return x > 0 ? 1.0f : (x < 0 ? -1.0f : x); }
+  static vfloat apply(vfloat x) {
+    return select(x > 0, broadcast(1), select(x < 0, broadcast(-1), x));
+  }
+};
+
+#define FLOATS_UNARY_OP(name, fun)                                           \
+  struct name {                                                              \
+    static float apply(float x) { return fun(x); }                           \
+    static vfloat apply(vfloat x) { return apply_lanes<name>(x); }           \
+  };
+
+// round() with the default digits = 0 rounds half to even, like nearbyint()
+// in the default rounding mode
+FLOATS_UNARY_OP(Sqrt, std::sqrt)
+FLOATS_UNARY_OP(Floor, std::floor)
+FLOATS_UNARY_OP(Ceiling, std::ceil)
+FLOATS_UNARY_OP(Trunc, std::trunc)
+FLOATS_UNARY_OP(Round, std::nearbyint)
+FLOATS_UNARY_OP(Exp, std::exp)
+FLOATS_UNARY_OP(Expm1, std::expm1)
+FLOATS_UNARY_OP(Log, std::log)
+FLOATS_UNARY_OP(Log1p, std::log1p)
+FLOATS_UNARY_OP(Cos, std::cos)
+FLOATS_UNARY_OP(Sin, std::sin)
+FLOATS_UNARY_OP(Tan, std::tan)
+FLOATS_UNARY_OP(Acos, std::acos)
+FLOATS_UNARY_OP(Asin, std::asin)
+FLOATS_UNARY_OP(Atan, std::atan)
+FLOATS_UNARY_OP(Cosh, std::cosh)
+FLOATS_UNARY_OP(Sinh, std::sinh)
+FLOATS_UNARY_OP(Tanh, std::tanh)
+
+#undef FLOATS_UNARY_OP
+
+template <typename Op>
+static void unary_loop(const float* x, float* out, size_t n) {
+  for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    size_t i = begin;
+    for (; i + kLanes <= end; i += kLanes) {
+      store(out + i, Op::apply(load(x + i)));
+    }
+    for (; i < end; i++) {
+      out[i] = Op::apply(x[i]);
+    }
+  });
+}
+
+void unary(UnaryOp op, const float* x, float* out, size_t n) {
+  switch (op) {
+    case UnaryOp::kNegate:
+      return unary_loop<Negate>(x, out, n);
+    case UnaryOp::kAbs:
+      return unary_loop<Abs>(x, out, n);
+    case UnaryOp::kSign:
+      return unary_loop<Sign>(x, out, n);
+    case UnaryOp::kSqrt:
+      return unary_loop<Sqrt>(x, out, n);
+    case UnaryOp::kFloor:
+      return unary_loop<Floor>(x, out, n);
+    case UnaryOp::kCeiling:
+      return unary_loop<Ceiling>(x, out, n);
+    case UnaryOp::kTrunc:
+      return unary_loop<Trunc>(x, out, n);
+    case UnaryOp::kRound:
+      return unary_loop<Round>(x, out, n);
+    case UnaryOp::kExp:
+      return unary_loop<Exp>(x, out, n);
+    case UnaryOp::kExpm1:
+      return unary_loop<Expm1>(x, out, n);
+    case UnaryOp::kLog:
+      return unary_loop<Log>(x, out, n);
+    case UnaryOp::kLog1p:
+      return unary_loop<Log1p>(x, out, n);
+    case UnaryOp::kCos:
+      return unary_loop<Cos>(x, out, n);
+    case UnaryOp::kSin:
+      return unary_loop<Sin>(x, out, n);
+    case UnaryOp::kTan:
+      return unary_loop<Tan>(x, out, n);
+    case UnaryOp::kAcos:
+      return unary_loop<Acos>(x, out, n);
+    case UnaryOp::kAsin:
+      return unary_loop<Asin>(x, out, n);
+    case UnaryOp::kAtan:
+      return unary_loop<Atan>(x, out, n);
+    case UnaryOp::kCosh:
+      return unary_loop<Cosh>(x, out, n);
+    case UnaryOp::kSinh:
+      return unary_loop<Sinh>(x, out, n);
+    case UnaryOp::kTanh:
+      return unary_loop<Tanh>(x, out, n);
+  }
+}
+
+// Zeroes NaN lanes
+static inline vfloat drop_nan(vfloat v) { return (vfloat)((vint)v & (v == v)); }
+
+// Neumaier's variant of Kahan summation: sum is the ordinary sum (which has the
+// right semantics for Inf and NaN) and compensation accumulates the low-order
+// bits that it loses
+struct CompensatedSum {
+  double sum;
+  double compensation;
+
+  void add(double value) {
+    double total = sum + value;
+    if (std::fabs(sum) >= std::fabs(value)) {
+      compensation += (sum - total) + value;
+    } else {
+      compensation += (value - total) + sum;
+    }
+    sum = total;
+  }
+
+  double result() const { return std::isfinite(sum) ? sum + compensation : sum; }
+};
+
+// Counts are flushed from int32 lanes after every block so that they can't
+// overflow
+static constexpr size_t kSumBlock = 256;
+
+static inline size_t count_lanes(vint lanes) {
+  size_t count = 0;
+  for (size_t j = 0; j < kLanes; j++) {
+    count += lanes[j];
+  }
+  return count;
+}
+
+template <typename Accumulator>
+static SumResult sum_chunk(const float* x, size_t begin, size_t end, bool na_rm) {
+  Accumulator accumulator;
+  size_t n_nan = 0;
+  size_t i = begin;
+
+  while (i + kLanes <= end) {
+    size_t block_end = std::min(end, i + kSumBlock);
+    vint nan_lanes = {};
+    for (; i + kLanes <= block_end; i += kLanes) {
+      vfloat v = load(x + i);
+      if (na_rm) {
+        nan_lanes -= v != v;
+        v = drop_nan(v);
+      }
+      accumulator.add(v);
+    }
+
+    accumulator.end_block();
+    n_nan += count_lanes(nan_lanes);
+  }
+
+  for (; i < end; i++) {
+    if (na_rm && std::isnan(x[i])) {
+      n_nan++;
+    } else {
+      accumulator.add_scalar(x[i]);
+    }
+  }
+
+  return SumResult{accumulator.result(), end - begin - n_nan};
+}
+
+// Double lanes that are added to a compensated sum after every block. Adding
+// a block of floats in double precision loses at most a few bits of a double
+// and only the much larger number of blocks needs compensation, which keeps
+// this about as fast as an uncompensated sum.
+struct CompensatedLanes {
+  vdouble block = {};
+  CompensatedSum sum = {0, 0};
+
+  void add(vfloat v) { block += __builtin_convertvector(v, vdouble); }
+
+  void end_block() {
+    for (size_t j = 0; j < kLanes; j++) {
+      sum.add(block[j]);
+    }
+    block = vdouble{};
+  }
+
+  void add_scalar(float value) { sum.add(value); }
+
+  double result() const { return sum.result(); }
+};
+
+// Float lanes whose block sums are combined pairwise: levels[k] holds the sum
+// of 2^k blocks (if that bit of the number of blocks is set), so each block sum
+// is only added to sums of as many blocks as itself, like a binary counter,
+// and the rounding error grows with the log of the number of blocks
+struct PairwiseLanes {
+  static constexpr size_t kMaxLevels = 64;
+
+  vfloat block = {};
+  float levels[kMaxLevels];
+  size_t n_blocks = 0;
+  float tail = 0;
+
+  void add(vfloat v) { block += v; }
+
+  void end_block() {
+    float carry = (block[0] + block[1]) + (block[2] + block[3]);
+    size_t level = 0;
+    for (size_t bits = n_blocks; bits & 1; bits >>= 1) {
+      carry = levels[level++] + carry;
+    }
+
+    levels[level] = carry;
+    n_blocks++;
+    block = vfloat{};
+  }
+
+  void add_scalar(float value) { tail += value; }
+
+  double result() const {
+    float sum = 0;
+    size_t level = 0;
+    for (size_t bits = n_blocks; bits != 0; bits >>= 1, level++) {
+      if (bits & 1) {
+        sum += levels[level];
+      }
+    }
+
+    return static_cast<double>(sum) + tail;
+  }
+};
+
+struct NaiveLanes {
+  vfloat sum = {};
+  float tail = 0;
+
+  void add(vfloat v) { sum += v; }
+  void end_block() {}
+  void add_scalar(float value) { tail += value; }
+  double result() const { return (sum[0] + sum[1]) + (sum[2] + sum[3]) + tail; }
+};
+
+SumResult sum(const float* x, size_t n, bool na_rm, SumMethod method) {
+  std::vector<SumResult> partial(num_chunks(n), SumResult{0, 0});
+
+  for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    switch (method) {
+      case SumMethod::kCompensated:
+        partial[chunk] = sum_chunk<CompensatedLanes>(x, begin, end, na_rm);
+        break;
+      case SumMethod::kPairwise:
+        partial[chunk] = sum_chunk<PairwiseLanes>(x, begin, end, na_rm);
+        break;
+      case SumMethod::kNaive:
+        partial[chunk] = sum_chunk<NaiveLanes>(x, begin, end, na_rm);
+        break;
+    }
+  });
+
+  CompensatedSum total{0, 0};
+  size_t count = 0;
+  for (const SumResult& value : partial) {
+    total.add(value.sum);
+    count += value.count;
+  }
+
+  return SumResult{total.result(), count};
+}
+
+double prod(const float* x, size_t n, bool na_rm) {
+  std::vector<double> partial(num_chunks(n), 1);
+
+  for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    double total = 1;
+    for (size_t i = begin; i < end; i++) {
+      if (!na_rm || !std::isnan(x[i])) {
+        total *= x[i];
+      }
+    }
+
+    partial[chunk] = total;
+  });
+
+  double total = 1;
+  for (double value : partial) {
+    total *= value;
+  }
+  return total;
+}
+
+struct Range {
+  float min;
+  float max;
+  bool has_nan;
+};
+
+bool range(const float* x, size_t n, bool na_rm, float* min, float* max) {
+  const float inf = std::numeric_limits<float>::infinity();
+  std::vector<Range> partial(num_chunks(n), Range{inf, -inf, false});
+
+  // NaN lanes never compare less or greater and so are never selected
+  for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    vfloat lo = broadcast(inf);
+    vfloat hi = broadcast(-inf);
+    vint is_nan = {};
+    size_t i = begin;
+    for (; i + kLanes <= end; i += kLanes) {
+      vfloat v = load(x + i);
+      is_nan |= v != v;
+      lo = select(v < lo, v, lo);
+      hi = select(v > hi, v, hi);
+    }
+
+    Range result{inf, -inf, false};
+    for (size_t j = 0; j < kLanes; j++) {
+      result.min = std::fmin(result.min, lo[j]);
+      result.max = std::fmax(result.max, hi[j]);
+      result.has_nan = result.has_nan || is_nan[j];
+    }
+
+    for (; i < end; i++) {
+      if (std::isnan(x[i])) {
+        result.has_nan = true;
+      } else {
+        result.min = std::fmin(result.min, x[i]);
+        result.max = std::fmax(result.max, x[i]);
+      }
+    }
+
+    partial[chunk] = result;
+  });
+
+  Range result{inf, -inf, false};
+  for (const Range& value : partial) {
+    result.min = std::fmin(result.min, value.min);
+    result.max = std::fmax(result.max, value.max);
+    result.has_nan = result.has_nan || value.has_nan;
+  }
+
+  if (result.has_nan && !na_rm) {
+    *min = NAN;
+    *max = NAN;
+    return true;
+  }
+
+  // min <= max unless no elements were seen (infinite elements included)
+  *min = result.min;
+  *max = result.max;
+  return result.min <= result.max;
+}
+
+// any() is all() of the negation, so both count the elements that decide the
+// result early (TRUE for any(), FALSE for all()) and NaNs
+struct LogicalCounts {
+  size_t n_decisive;
+  size_t n_nan;
+};
+
+static LogicalCounts count_logical(const float* x, size_t n, bool decisive) {
+  std::vector<LogicalCounts> partial(num_chunks(n), LogicalCounts{0, 0});
+
+  for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    LogicalCounts counts{0, 0};
+    for (size_t i = begin; i < end; i++) {
+      if (std::isnan(x[i])) {
+        counts.n_nan++;
+      } else if ((x[i] != 0) == decisive) {
+        counts.n_decisive++;
+      }
+    }
+
+    partial[chunk] = counts;
+  });
+
+  LogicalCounts counts{0, 0};
+  for (const LogicalCounts& value : partial) {
+    counts.n_decisive += value.n_decisive;
+    counts.n_nan += value.n_nan;
+  }
+  return counts;
+}
+
+int any(const float* x, size_t n, bool na_rm) {
+  LogicalCounts counts = count_logical(x, n, true);
+  if (counts.n_decisive > 0) {
+    return 1;
+  } else if (counts.n_nan > 0 && !na_rm) {
+    return kNA;
+  } else {
+    return 0;
+  }
+}
+
+int all(const float* x, size_t n, bool na_rm) {
+  LogicalCounts counts = count_logical(x, n, false);
+  if (counts.n_decisive > 0) {
+    return 0;
+  } else if (counts.n_nan > 0 && !na_rm) {
+    return kNA;
+  } else {
+    return 1;
+  }
+}
+
+}  // namespace floats
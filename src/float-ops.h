@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+
+// Arithmetic, comparison, math, and summary kernels for the mtl_floats type
+// that operate on 32-bit floats directly instead of on a double copy. Like the
+// conversions in float-convert.h, these work on raw pointers, never touch the
+// R API, and split large vectors across the thread pool. NA and NaN are both
+// represented by NaN.
+namespace floats {
+
+enum class BinaryOp { kAdd, kSubtract, kMultiply, kDivide, kPower, kModulo, kIntDivide };
+
+enum class CompareOp { kEqual, kNotEqual, kLess, kLessEqual, kGreater, kGreaterEqual };
+
+enum class UnaryOp {
+  kNegate,
+  kAbs,
+  kSign,
+  kSqrt,
+  kFloor,
+  kCeiling,
+  kTrunc,
+  kRound,
+  kExp,
+  kExpm1,
+  kLog,
+  kLog1p,
+  kCos,
+  kSin,
+  kTan,
+  kAcos,
+  kAsin,
+  kAtan,
+  kCosh,
+  kSinh,
+  kTanh
+};
+
+// x and y are recycled to n elements, which must be a multiple of n_x and n_y
+// (neither of which may be zero)
+void binary(BinaryOp op, const float* x, size_t n_x, const float* y, size_t n_y,
+            float* out, size_t n);
+
+// Writes 1, 0, or NA_LOGICAL (if either element is NaN) with the same recycling
+// rules as binary()
+void compare(CompareOp op, const float* x, size_t n_x, const float* y, size_t n_y,
+             int* out, size_t n);
+
+void unary(UnaryOp op, const float* x, float* out, size_t n);
+
+// kCompensated sums blocks of 256 elements in double precision and adds the
+// block sums with Neumaier's variant of Kahan summation, which is accurate to
+// about the last bit of a double for any realistic number of floats. kPairwise
+// is pairwise summation in single precision: it sums blocks of 256 elements
+// and adds the block sums pairwise (two blocks, then two pairs of blocks, and
+// so on), so its error grows with the log of n rather than with n. kNaive
+// accumulates in single precision and is only useful as a baseline. All of
+// them are vectorized and add up chunks in parallel, so the last bits of the
+// result can depend on the number of threads.
+enum class SumMethod { kCompensated, kPairwise, kNaive };
+
+struct SumResult {
+  double sum;
+  // The number of elements that were added (i.e., not removed with na_rm)
+  size_t count;
+};
+
+// Without na_rm, any NaN makes the result NaN
+SumResult sum(const float* x, size_t n, bool na_rm,
+              SumMethod method = SumMethod::kCompensated);
+
+// Products are accumulated in double
+double prod(const float* x, size_t n, bool na_rm);
+
+// Returns false if there are no elements to summarize (i.e., n is zero or all
+// elements were removed with na_rm); otherwise min and max are NaN if
+// there was a NaN and !na_rm
+bool range(const float* x, size_t n, bool na_rm, float* min, float* max);
+
+// Return 1, 0, or NA_LOGICAL, treating non-zero elements as TRUE
+int any(const float* x, size_t n, bool na_rm);
+int all(const float* x, size_t n, bool na_rm);
+
+}  // namespace floats
@@ -1,49 +1,167 @@
 
+#include <algorithm>
+#include <cstring>
+#include <string>
+
 #include <cpp11.hpp>
+#include <cpp11/altrep.hpp>
 using namespace cpp11;
 
+#include "float-convert.h"
+#include "float-ops.h"
+
 sexp cpp_floats_from_lgl(logicals x) {
   sexp result_sexp = safe[Rf_allocVector](INTSXP, x.size());
   float* result = reinterpret_cast<float*>(INTEGER(result_sexp));
-
-  R_xlen_t i = 0;
-  for (auto el : x) {
-    if (el == NA_LOGICAL) {
-      result[i++] = NAN;
-    } else {
-      result[i++] = static_cast<float>(static_cast<int>(el));
-    }
-  }
-
+  floats::from_lgl(LOGICAL_RO(x), result, x.size());
   return result_sexp;
 }
 
 sexp cpp_floats_from_int(integers x) {
   sexp result_sexp = safe[Rf_allocVector](INTSXP, x.size());
   float* result = reinterpret_cast<float*>(INTEGER(result_sexp));
-
-  R_xlen_t i = 0;
-  for (auto el : x) {
-    if (el == NA_INTEGER) {
-      result[i++] = NAN;
-    } else {
-      result[i++] = el;
-    }
-  }
-
+  floats::from_int(INTEGER_RO(x), result, x.size());
   return result_sexp;
 }
 
 sexp cpp_floats_from_dbl(doubles x) {
   sexp result_sexp = safe[Rf_allocVector](INTSXP, x.size());
   float* result = reinterpret_cast<float*>(INTEGER(result_sexp));
+  floats::from_dbl(REAL_RO(x), result, x.size());
+  return result_sexp;
+}
 
-  R_xlen_t i = 0;
-  for (auto el : x) {
-    result[i++] = el;
+// Converts n elements of a logical, integer, or double vector starting at
+// offset into floats
+static void floats_from_source(SEXP source, R_xlen_t offset, R_xlen_t n, float* out) {
+  switch (TYPEOF(source)) {
+    case LGLSXP:
+      floats::from_lgl(LOGICAL_RO(source) + offset, out, n);
+      break;
+    case INTSXP:
+      floats::from_int(INTEGER_RO(source) + offset, out, n);
+      break;
+    default:
+      floats::from_dbl(REAL_RO(source) + offset, out, n);
+      break;
   }
+}
 
-  return result_sexp;
+#if defined(HAS_ALTREP)
+
+// A lazy mtl_floats records the logical, integer, or double vector it was
+// created from and converts it only when R asks for a data pointer (e.g., for
+// arithmetic or printing). Individual elements and regions are converted on
+// the fly, and cpp_buffer_copy_from() converts the source directly into the
+// buffer, so as_mtl_buffer(as_mtl_floats(x)) never allocates the intermediate
+// vector. The source is marked as not mutable so that R copies it before
+// modifying it.
+//
+// data1: the source or NULL once materialized; data2: the floats or NULL
+static R_altrep_class_t lazy_floats;
+
+static bool lazy_floats_materialized(SEXP x) { return R_altrep_data2(x) != R_NilValue; }
+
+static R_xlen_t lazy_floats_length(SEXP x) {
+  if (lazy_floats_materialized(x)) {
+    return Rf_xlength(R_altrep_data2(x));
+  } else {
+    return Rf_xlength(R_altrep_data1(x));
+  }
+}
+
+static void* lazy_floats_dataptr(SEXP x, Rboolean writable) {
+  if (!lazy_floats_materialized(x)) {
+    SEXP source = R_altrep_data1(x);
+    R_xlen_t size = Rf_xlength(source);
+    SEXP result = PROTECT(Rf_allocVector(INTSXP, size));
+    floats_from_source(source, 0, size, reinterpret_cast<float*>(INTEGER(result)));
+    R_set_altrep_data2(x, result);
+    R_set_altrep_data1(x, R_NilValue);
+    UNPROTECT(1);
+  }
+
+  return DATAPTR(R_altrep_data2(x));
+}
+
+static const void* lazy_floats_dataptr_or_null(SEXP x) {
+  if (lazy_floats_materialized(x)) {
+    return DATAPTR_RO(R_altrep_data2(x));
+  } else {
+    return nullptr;
+  }
+}
+
+// Duplicates share the (immutable) source; materialized vectors use the
+// default copy
+static SEXP lazy_floats_duplicate(SEXP x, Rboolean deep) {
+  if (lazy_floats_materialized(x)) {
+    return nullptr;
+  }
+
+  return R_new_altrep(lazy_floats, R_altrep_data1(x), R_NilValue);
+}
+
+static Rboolean lazy_floats_inspect(SEXP x, int pre, int deep, int pvec,
+                                    void (*inspect_subtree)(SEXP, int, int, int)) {
+  Rprintf("lazy mtl_floats (len=%ld, materialized=%s)\n",
+          static_cast<long>(lazy_floats_length(x)),
+          lazy_floats_materialized(x) ? "T" : "F");
+  return TRUE;
+}
+
+static R_xlen_t lazy_floats_get_region(SEXP x, R_xlen_t i, R_xlen_t n, int* buf) {
+  R_xlen_t length = lazy_floats_length(x);
+  if (i >= length) {
+    return 0;
+  }
+
+  if ((i + n) > length) {
+    n = length - i;
+  }
+
+  if (lazy_floats_materialized(x)) {
+    memcpy(buf, INTEGER_RO(R_altrep_data2(x)) + i, n * sizeof(int));
+  } else {
+    floats_from_source(R_altrep_data1(x), i, n, reinterpret_cast<float*>(buf));
+  }
+
+  return n;
+}
+
+static int lazy_floats_elt(SEXP x, R_xlen_t i) {
+  int value;
+  lazy_floats_get_region(x, i, 1, &value);
+  return value;
+}
+
+[[cpp11::init]] void init_lazy_floats(DllInfo* dll) {
+  lazy_floats = R_make_altinteger_class("mtl_floats_lazy", "metal", dll);
+  R_set_altrep_Length_method(lazy_floats, &lazy_floats_length);
+  R_set_altrep_Inspect_method(lazy_floats, &lazy_floats_inspect);
+  R_set_altrep_Duplicate_method(lazy_floats, &lazy_floats_duplicate);
+  R_set_altvec_Dataptr_method(lazy_floats, &lazy_floats_dataptr);
+  R_set_altvec_Dataptr_or_null_method(lazy_floats, &lazy_floats_dataptr_or_null);
+  R_set_altinteger_Elt_method(lazy_floats, &lazy_floats_elt);
+  R_set_altinteger_Get_region_method(lazy_floats, &lazy_floats_get_region);
+}
+
+#endif
+
+// Converts n elements of x starting at offset directly into out if x is a lazy
+// mtl_floats that hasn't been materialized. Returns false otherwise, in which
+// case the caller should copy the contents of x.
+bool lazy_floats_copy(sexp x, R_xlen_t offset, R_xlen_t n, float* out) {
+#if defined(HAS_ALTREP)
+  if (!R_altrep_inherits(x, lazy_floats) || lazy_floats_materialized(x)) {
+    return false;
+  }
+
+  floats_from_source(R_altrep_data1(x), offset, n, out);
+  return true;
+#else
+  return false;
+#endif
 }
 
 [[cpp11::register]] sexp cpp_floats(double size, double fill) {
@@ -60,11 +178,23 @@ sexp cpp_floats_from_dbl(doubles x) {
   return result_sexp;
 }
 
-[[cpp11::register]] sexp cpp_as_floats(sexp x) {
+// Returns NULL for anything other than a bare logical, integer, or double
+// vector so that the caller can cast it to one first. With lazy = TRUE the
+// result is a lazy mtl_floats (if ALTREP is available).
+[[cpp11::register]] sexp cpp_as_floats(sexp x, bool lazy) {
   if (Rf_isObject(x)) {
     return R_NilValue;
   }
 
+#if defined(HAS_ALTREP)
+  if (lazy && (TYPEOF(x) == LGLSXP || TYPEOF(x) == INTSXP || TYPEOF(x) == REALSXP)) {
+    MARK_NOT_MUTABLE(x);
+    sexp result = safe[R_new_altrep](lazy_floats, x, R_NilValue);
+    result.attr("class") = {"mtl_floats", "vctrs_vctr"};
+    return result;
+  }
+#endif
+
   sexp result;
   switch (TYPEOF(x)) {
     case LGLSXP:
@@ -84,37 +214,198 @@ sexp cpp_floats_from_dbl(doubles x) {
   return result;
 }
 
-[[cpp11::register]] logicals cpp_from_floats_lgl(sexp floats_sexp) {
-  float* floats = reinterpret_cast<float*>(INTEGER(floats_sexp));
-  writable::logicals result(Rf_xlength(floats_sexp));
-  for (R_xlen_t i = 0; i < result.size(); i++) {
-    if (std::isnan(floats[i])) {
-      result[i] = NA_LOGICAL;
-    } else {
-      result[i] = static_cast<int>(floats[i]);
-    }
+[[cpp11::register]] sexp cpp_from_floats_lgl(sexp floats_sexp) {
+  const float* values = reinterpret_cast<const float*>(INTEGER_RO(floats_sexp));
+  R_xlen_t size = Rf_xlength(floats_sexp);
+  sexp result_sexp = safe[Rf_allocVector](LGLSXP, size);
+  floats::to_lgl(values, LOGICAL(result_sexp), size);
+  return result_sexp;
+}
+
+[[cpp11::register]] sexp cpp_from_floats_int(sexp floats_sexp) {
+  const float* values = reinterpret_cast<const float*>(INTEGER_RO(floats_sexp));
+  R_xlen_t size = Rf_xlength(floats_sexp);
+  sexp result_sexp = safe[Rf_allocVector](INTSXP, size);
+  floats::to_int(values, INTEGER(result_sexp), size);
+  return result_sexp;
+}
+
+[[cpp11::register]] sexp cpp_from_floats_dbl(sexp floats_sexp) {
+  const float* values = reinterpret_cast<const float*>(INTEGER_RO(floats_sexp));
+  R_xlen_t size = Rf_xlength(floats_sexp);
+  sexp result_sexp = safe[Rf_allocVector](REALSXP, size);
+  floats::to_dbl(values, REAL(result_sexp), size);
+  return result_sexp;
+}
+
+[[cpp11::register]] std::string cpp_floats_simd_level() { return floats::simd_level(); }
+
+// Sets the number of threads used for large conversions and the number of
+// elements at which conversions start using them, returning the previous values
+[[cpp11::register]] list cpp_floats_set_threading(int n_threads, double threshold) {
+  int previous_threads = floats::num_threads();
+  double previous_threshold = floats::parallel_threshold();
+
+  floats::set_num_threads(n_threads);
+  floats::set_parallel_threshold(threshold);
+
+  writable::list out = {as_sexp(previous_threads), as_sexp(previous_threshold)};
+  out.names() = {"threads", "threshold"};
+  return out;
+}
+
+static floats::BinaryOp binary_op(const std::string& op) {
+  if (op == "+") return floats::BinaryOp::kAdd;
+  if (op == "-") return floats::BinaryOp::kSubtract;
+  if (op == "*") return floats::BinaryOp::kMultiply;
+  if (op == "/") return floats::BinaryOp::kDivide;
+  if (op == "^") return floats::BinaryOp::kPower;
+  if (op == "%%") return floats::BinaryOp::kModulo;
+  if (op == "%/%") return floats::BinaryOp::kIntDivide;
+  stop("Unsupported arithmetic operator for mtl_floats: '%s'", op.c_str());
+}
+
+static floats::CompareOp compare_op(const std::string& op) {
+  if (op == "==") return floats::CompareOp::kEqual;
+  if (op == "!=") return floats::CompareOp::kNotEqual;
+  if (op == "<") return floats::CompareOp::kLess;
+  if (op == "<=") return floats::CompareOp::kLessEqual;
+  if (op == ">") return floats::CompareOp::kGreater;
+  if (op == ">=") return floats::CompareOp::kGreaterEqual;
+  stop("Unsupported comparison operator for mtl_floats: '%s'", op.c_str());
+}
+
+static floats::UnaryOp unary_op(const std::string& fun) {
+  if (fun == "-") return floats::UnaryOp::kNegate;
+  if (fun == "abs") return floats::UnaryOp::kAbs;
+  if (fun == "sign") return floats::UnaryOp::kSign;
+  if (fun == "sqrt") return floats::UnaryOp::kSqrt;
+  if (fun == "floor") return floats::UnaryOp::kFloor;
+  if (fun == "ceiling") return floats::UnaryOp::kCeiling;
+  if (fun == "trunc") return floats::UnaryOp::kTrunc;
+  if (fun == "round") return floats::UnaryOp::kRound;
+  if (fun == "exp") return floats::UnaryOp::kExp;
+  if (fun == "expm1") return floats::UnaryOp::kExpm1;
+  if (fun == "log") return floats::UnaryOp::kLog;
+  if (fun == "log1p") return floats::UnaryOp::kLog1p;
+  if (fun == "cos") return floats::UnaryOp::kCos;
+  if (fun == "sin") return floats::UnaryOp::kSin;
+  if (fun == "tan") return floats::UnaryOp::kTan;
+  if (fun == "acos") return floats::UnaryOp::kAcos;
+  if (fun == "asin") return floats::UnaryOp::kAsin;
+  if (fun == "atan") return floats::UnaryOp::kAtan;
+  if (fun == "cosh") return floats::UnaryOp::kCosh;
+  if (fun == "sinh") return floats::UnaryOp::kSinh;
+  if (fun == "tanh") return floats::UnaryOp::kTanh;
+  stop("Unsupported math function for mtl_floats: '%s'", fun.c_str());
+}
+
+// The length of the result of a binary operation, with the same recycling rules
+// (and warning) as R's arithmetic
+static R_xlen_t recycled_size(R_xlen_t n_x, R_xlen_t n_y) {
+  if (n_x == 0 || n_y == 0) {
+    return 0;
   }
-  return result;
+
+  R_xlen_t size = std::max(n_x, n_y);
+  if (size % n_x != 0 || size % n_y != 0) {
+    warning("longer object length is not a multiple of shorter object length");
+  }
+
+  return size;
 }
 
-[[cpp11::register]] integers cpp_from_floats_int(sexp floats_sexp) {
-  float* floats = reinterpret_cast<float*>(INTEGER(floats_sexp));
-  writable::integers result(Rf_xlength(floats_sexp));
-  for (R_xlen_t i = 0; i < result.size(); i++) {
-    if (std::isnan(floats[i])) {
-      result[i] = NA_INTEGER;
-    } else {
-      result[i] = static_cast<int>(floats[i]);
-    }
+[[cpp11::register]] sexp cpp_floats_arith(std::string op, sexp e1, sexp e2) {
+  floats::BinaryOp binary = binary_op(op);
+  R_xlen_t n_x = Rf_xlength(e1);
+  R_xlen_t n_y = Rf_xlength(e2);
+  R_xlen_t size = recycled_size(n_x, n_y);
+
+  sexp result_sexp = safe[Rf_allocVector](INTSXP, size);
+  if (size > 0) {
+    const float* x = reinterpret_cast<const float*>(INTEGER_RO(e1));
+    const float* y = reinterpret_cast<const float*>(INTEGER_RO(e2));
+    float* result = reinterpret_cast<float*>(INTEGER(result_sexp));
+    floats::binary(binary, x, n_x, y, n_y, result, size);
   }
-  return result;
+
+  result_sexp.attr("class") = {"mtl_floats", "vctrs_vctr"};
+  return result_sexp;
 }
 
-[[cpp11::register]] doubles cpp_from_floats_dbl(sexp floats_sexp) {
-  float* floats = reinterpret_cast<float*>(INTEGER(floats_sexp));
-  writable::doubles result(Rf_xlength(floats_sexp));
-  for (R_xlen_t i = 0; i < result.size(); i++) {
-    result[i] = floats[i];
+[[cpp11::register]] sexp cpp_floats_compare(std::string op, sexp e1, sexp e2) {
+  floats::CompareOp compare = compare_op(op);
+  R_xlen_t n_x = Rf_xlength(e1);
+  R_xlen_t n_y = Rf_xlength(e2);
+  R_xlen_t size = recycled_size(n_x, n_y);
+
+  sexp result_sexp = safe[Rf_allocVector](LGLSXP, size);
+  if (size > 0) {
+    const float* x = reinterpret_cast<const float*>(INTEGER_RO(e1));
+    const float* y = reinterpret_cast<const float*>(INTEGER_RO(e2));
+    floats::compare(compare, x, n_x, y, n_y, LOGICAL(result_sexp), size);
   }
-  return result;
+
+  return result_sexp;
+}
+
+[[cpp11::register]] sexp cpp_floats_math(std::string fun, sexp x) {
+  floats::UnaryOp unary = unary_op(fun);
+  const float* values = reinterpret_cast<const float*>(INTEGER_RO(x));
+  R_xlen_t size = Rf_xlength(x);
+
+  sexp result_sexp = safe[Rf_allocVector](INTSXP, size);
+  float* result = reinterpret_cast<float*>(INTEGER(result_sexp));
+  floats::unary(unary, values, result, size);
+
+  result_sexp.attr("class") = {"mtl_floats", "vctrs_vctr"};
+  return result_sexp;
+}
+
+static floats::SumMethod sum_method(const std::string& method) {
+  if (method == "compensated") return floats::SumMethod::kCompensated;
+  if (method == "pairwise") return floats::SumMethod::kPairwise;
+  if (method == "naive") return floats::SumMethod::kNaive;
+  stop("Unsupported summation method for mtl_floats: '%s'", method.c_str());
+}
+
+// Returns NULL for min(), max(), and range() when there are no elements so that
+// the caller can defer to R for the result and its warning
+[[cpp11::register]] sexp cpp_floats_summary(std::string fun, sexp x, bool na_rm,
+                                            std::string method) {
+  const float* values = reinterpret_cast<const float*>(INTEGER_RO(x));
+  R_xlen_t size = Rf_xlength(x);
+
+  if (fun == "sum") {
+    return as_sexp(floats::sum(values, size, na_rm, sum_method(method)).sum);
+  } else if (fun == "prod") {
+    return as_sexp(floats::prod(values, size, na_rm));
+  } else if (fun == "any") {
+    return Rf_ScalarLogical(floats::any(values, size, na_rm));
+  } else if (fun == "all") {
+    return Rf_ScalarLogical(floats::all(values, size, na_rm));
+  }
+
+  float min, max;
+  if (!floats::range(values, size, na_rm, &min, &max)) {
+    return R_NilValue;
+  }
+
+  if (fun == "min") {
+    return as_sexp(static_cast<double>(min));
+  } else if (fun == "max") {
+    return as_sexp(static_cast<double>(max));
+  } else if (fun == "range") {
+    writable::doubles result = {static_cast<double>(min), static_cast<double>(max)};
+    return result;
+  }
+
+  stop("Unsupported summary function for mtl_floats: '%s'", fun.c_str());
+}
+
+[[cpp11::register]] double cpp_floats_mean(sexp x, bool na_rm, std::string method) {
+  const float* values = reinterpret_cast<const float*>(INTEGER_RO(x));
+  floats::SumResult result =
+      floats::sum(values, Rf_xlength(x), na_rm, sum_method(method));
+  return result.sum / result.count;
 }
@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+#include "backend-cpu.h"
+#include "builtin-kernels.h"
+#include "fusion.h"
+
+namespace backend {
+
+// Arguments of the kernel: the result, the number of elements, the program
+// (a header of the number of inputs and scalars followed by pairs of op and
+// operand), then one buffer for each input and one float for each scalar
+static constexpr size_t kOutArgument = 0;
+static constexpr size_t kLengthArgument = 1;
+static constexpr size_t kProgramArgument = 2;
+static constexpr size_t kFirstInputArgument = 3;
+
+// Metal has 31 buffer argument slots
+static constexpr size_t kMaxArguments = 31;
+
+static constexpr size_t kThreads = 256;
+
+struct EvalOpInfo {
+  const char* name;
+  int arity;
+};
+
+static EvalOpInfo eval_op_info(EvalOp op) {
+  switch (op) {
+    case EvalOp::Input:
+      return {"input", 0};
+    case EvalOp::Scalar:
+      return {"scalar", 0};
+    case EvalOp::Constant:
+      return {"constant", 0};
+    case EvalOp::Negate:
+      return {"neg", 1};
+    case EvalOp::Add:
+      return {"+", 2};
+    case EvalOp::Subtract:
+      return {"-", 2};
+    case EvalOp::Multiply:
+      return {"*", 2};
+    case EvalOp::Divide:
+      return {"/", 2};
+    case EvalOp::Power:
+      return {"^", 2};
+    case EvalOp::Min:
+      return {"pmin", 2};
+    case EvalOp::Max:
+      return {"pmax", 2};
+    case EvalOp::Sqrt:
+      return {"sqrt", 1};
+    case EvalOp::Exp:
+      return {"exp", 1};
+    case EvalOp::Log:
+      return {"log", 1};
+    case EvalOp::Abs:
+      return {"abs", 1};
+    case EvalOp::Sin:
+      return {"sin", 1};
+    case EvalOp::Cos:
+      return {"cos", 1};
+    case EvalOp::Tan:
+      return {"tan", 1};
+    case EvalOp::Tanh:
+      return {"tanh", 1};
+    case EvalOp::Floor:
+      return {"floor", 1};
+    case EvalOp::Ceiling:
+      return {"ceiling", 1};
+  }
+
+  return {"", -1};
+}
+
+static constexpr uint32_t kLastOp = static_cast<uint32_t>(EvalOp::Ceiling);
+
+bool eval_op_from_name(const std::string& name, EvalOp* op) {
+  for (uint32_t i = 0; i <= kLastOp; i++) {
+    if (name == eval_op_info(static_cast<EvalOp>(i)).name) {
+      *op = static_cast<EvalOp>(i);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Returns the most values that program keeps on the stack at once or zero with
+// an error if it's invalid
+static size_t check_program(const std::vector<EvalInstruction>& program,
+                            size_t n_inputs, size_t n_scalars, std::string* error) {
+  size_t depth = 0;
+  size_t max_depth = 0;
+  for (const EvalInstruction& instruction : program) {
+    if (static_cast<uint32_t>(instruction.op) > kLastOp) {
+      *error = "Unknown operator in program";
+      return 0;
+    } else if (instruction.op == EvalOp::Input && instruction.operand >= n_inputs) {
+      *error = "Program uses input " + std::to_string(instruction.operand) + " of " +
+               std::to_string(n_inputs);
+      return 0;
+    } else if (instruction.op == EvalOp::Scalar && instruction.operand >= n_scalars) {
+      *error = "Program uses scalar " + std::to_string(instruction.operand) + " of " +
+               std::to_string(n_scalars);
+      return 0;
+    }
+
+    size_t arity = eval_op_info(instruction.op).arity;
+    if (depth < arity) {
+      *error = std::string("Not enough operands for '") +
+               eval_op_info(instruction.op).name + "'";
+      return 0;
+    }
+
+    depth = depth - arity + 1;
+    max_depth = std::max(max_depth, depth);
+  }
+
+  if (depth != 1) {
+    *error = "Program must leave exactly one value on the stack";
+    return 0;
+  }
+
+  return max_depth;
+}
+
+static std::string metal_expression(const EvalInstruction& instruction,
+                                    const std::string& a, const std::string& b) {
+  char constant[32];
+  switch (instruction.op) {
+    case EvalOp::Input:
+      return "x" + std::to_string(instruction.operand) + "[index]";
+    case EvalOp::Scalar:
+      return "s" + std::to_string(instruction.operand);
+    case EvalOp::Constant:
+      // The bits of the constant, so that it's exactly the value in the program
+      std::snprintf(constant, sizeof(constant), "as_type<float>(0x%08xu)",
+                    instruction.operand);
+      return constant;
+    case EvalOp::Negate:
+      return "-" + a;
+    case EvalOp::Add:
+      return a + " + " + b;
+    case EvalOp::Subtract:
+      return a + " - " + b;
+    case EvalOp::Multiply:
+      return a + " * " + b;
+    case EvalOp::Divide:
+      return a + " / " + b;
+    case EvalOp::Power:
+      return "pow(" + a + ", " + b + ")";
+    // Like pmin() and pmax(), NaN wins
+    case EvalOp::Min:
+      return "(" + a + " < " + b + " || isnan(" + a + ")) ? " + a + " : " + b;
+    case EvalOp::Max:
+      return "(" + a + " > " + b + " || isnan(" + a + ")) ? " + a + " : " + b;
+    case EvalOp::Sqrt:
+      return "sqrt(" + a + ")";
+    case EvalOp::Exp:
+      return "exp(" + a + ")";
+    case EvalOp::Log:
+      return "log(" + a + ")";
+    case EvalOp::Abs:
+      return "abs(" + a + ")";
+    case EvalOp::Sin:
+      return "sin(" + a + ")";
+    case EvalOp::Cos:
+      return "cos(" + a + ")";
+    case EvalOp::Tan:
+      return "tan(" + a + ")";
+    case EvalOp::Tanh:
+      return "tanh(" + a + ")";
+    case EvalOp::Floor:
+      return "floor(" + a + ")";
+    case EvalOp::Ceiling:
+      return "ceil(" + a + ")";
+  }
+
+  return "";
+}
+
+std::string eval_source(const std::vector<EvalInstruction>& program, size_t n_inputs,
+                        size_t n_scalars) {
+  std::string out =
+      "#include <metal_stdlib>\n"
+      "using namespace metal;\n"
+      "\n"
+      "// program is only read by the CPU backend\n"
+      "kernel void mtl_eval(device float* out [[buffer(0)]],\n"
+      "                     constant uint& n [[buffer(1)]],\n"
+      "                     constant uint* program [[buffer(2)]],\n";
+  size_t argument = kFirstInputArgument;
+  for (size_t i = 0; i < n_inputs; i++) {
+    out += "                     device const float* x" + std::to_string(i) +
+           " [[buffer(" + std::to_string(argument++) + ")]],\n";
+  }
+
+  for (size_t i = 0; i < n_scalars; i++) {
+    out += "                     constant float& s" + std::to_string(i) + " [[buffer(" +
+           std::to_string(argument++) + ")]],\n";
+  }
+
+  out +=
+      "                     uint index [[thread_position_in_grid]]) {\n"
+      "  if (index >= n) {\n"
+      "    return;\n"
+      "  }\n"
+      "\n";
+
+  // Every instruction assigns a new temporary, which the compiler is free to
+  // keep in registers
+  std::vector<std::string> stack;
+  size_t n_temporaries = 0;
+  for (const EvalInstruction& instruction : program) {
+    std::string a;
+    std::string b;
+    int arity = eval_op_info(instruction.op).arity;
+    if (arity == 2) {
+      b = stack.back();
+      stack.pop_back();
+    }
+    if (arity >= 1) {
+      a = stack.back();
+      stack.pop_back();
+    }
+
+    std::string temporary = "t" + std::to_string(n_temporaries++);
+    out += "  float " + temporary + " = " + metal_expression(instruction, a, b) + ";\n";
+    stack.push_back(temporary);
+  }
+
+  out += "  out[index] = " + stack.back() + ";\n}\n";
+  return out;
+}
+
+namespace cpu {
+
+// The CPU kernel evaluates each instruction for a block of this many elements
+// before moving on to the next one, so the stack of blocks stays in cache and
+// the loops over each block can be vectorized
+static constexpr size_t kBlock = 256;
+
+template <typename F>
+static void apply_unary(float* x, size_t n, F f) {
+  for (size_t i = 0; i < n; i++) {
+    x[i] = f(x[i]);
+  }
+}
+
+template <typename F>
+static void apply_binary(float* x, const float* y, size_t n, F f) {
+  for (size_t i = 0; i < n; i++) {
+    x[i] = f(x[i], y[i]);
+  }
+}
+
+// Instructions that push a value write it into first. Operators replace first
+// (their first operand) with their result; second is the second operand.
+static void eval_instruction(const KernelArguments& args, size_t n_inputs,
+                             const EvalInstruction& instruction, size_t begin,
+                             size_t count, float* first, const float* second) {
+  switch (instruction.op) {
+    case EvalOp::Input: {
+      const float* input = args.buffer<float>(kFirstInputArgument + instruction.operand);
+      std::memcpy(first, input + begin, count * sizeof(float));
+      break;
+    }
+    case EvalOp::Scalar:
+      std::fill(first, first + count,
+                args.value<float>(kFirstInputArgument + n_inputs + instruction.operand));
+      break;
+    case EvalOp::Constant: {
+      float value;
+      std::memcpy(&value, &instruction.operand, sizeof(float));
+      std::fill(first, first + count, value);
+      break;
+    }
+    case EvalOp::Negate:
+      apply_unary(first, count, [](float value) { return -value; });
+      break;
+    case EvalOp::Add:
+      apply_binary(first, second, count, [](float x, float y) { return x + y; });
+      break;
+    case EvalOp::Subtract:
+      apply_binary(first, second, count, [](float x, float y) { return x - y; });
+      break;
+    case EvalOp::Multiply:
+      apply_binary(first, second, count, [](float x, float y) { return x * y; });
+      break;
+    case EvalOp::Divide:
+      apply_binary(first, second, count, [](float x, float y) { return x / y; });
+      break;
+    case EvalOp::Power:
+      apply_binary(first, second, count, [](float x, float y) { return std::pow(x, y); });
+      break;
+    case EvalOp::Min:
+      apply_binary(first, second, count,
+                   [](float x, float y) { return (x < y || std::isnan(x)) ? x : y; });
+      break;
+    case EvalOp::Max:
+      apply_binary(first, second, count,
+                   [](float x, float y) { return (x > y || std::isnan(x)) ? x : y; });
+      break;
+    case EvalOp::Sqrt:
+      apply_unary(first, count, [](float x) { return std::sqrt(x); });
+      break;
+    case EvalOp::Exp:
+      apply_unary(first, count, [](float x) { return std::exp(x); });
+      break;
+    case EvalOp::Log:
+      apply_unary(first, count, [](float x) { return std::log(x); });
+      break;
+    case EvalOp::Abs:
+      apply_unary(first, count, [](float x) { return std::fabs(x); });
+      break;
+    case EvalOp::Sin:
+      apply_unary(first, count, [](float x) { return std::sin(x); });
+      break;
+    case EvalOp::Cos:
+      apply_unary(first, count, [](float x) { return std::cos(x); });
+      break;
+    case EvalOp::Tan:
+      apply_unary(first, count, [](float x) { return std::tan(x); });
+      break;
+    case EvalOp::Tanh:
+      apply_unary(first, count, [](float x) { return std::tanh(x); });
+      break;
+    case EvalOp::Floor:
+      apply_unary(first, count, [](float x) { return std::floor(x); });
+      break;
+    case EvalOp::Ceiling:
+      apply_unary(first, count, [](float x) { return std::ceil(x); });
+      break;
+  }
+}
+
+// kernel void mtl_eval(device float* out, constant uint& n,
+//                      constant uint* program, device const float* x0, ...,
+//                      constant float& s0, ...)
+static void eval_kernel(const KernelArguments& args, const ThreadgroupContext& ctx) {
+  const std::string& program_bytes = args.bytes(kProgramArgument);
+  auto words = reinterpret_cast<const uint32_t*>(program_bytes.data());
+  size_t n_inputs = words[0];
+  size_t n_instructions = program_bytes.size() / sizeof(uint32_t) / 2 - 1;
+  auto program = reinterpret_cast<const EvalInstruction*>(words + 2);
+
+  size_t n = args.value<uint32_t>(kLengthArgument);
+  size_t threads = ctx.threads_per_threadgroup.width;
+  size_t group_begin = std::min(ctx.threadgroup_position_in_grid.width * threads, n);
+  size_t group_end = std::min(group_begin + threads, n);
+
+  // Block i of the stack is stack[i * kBlock]. The program was checked when it
+  // was dispatched, so it never needs more blocks than it has instructions.
+  thread_local std::vector<float> stack;
+  stack.resize(n_instructions * kBlock);
+  float* out = args.buffer<float>(kOutArgument);
+  for (size_t begin = group_begin; begin < group_end; begin += kBlock) {
+    size_t count = std::min(kBlock, group_end - begin);
+    size_t depth = 0;
+    for (size_t i = 0; i < n_instructions; i++) {
+      const EvalInstruction& instruction = program[i];
+      size_t arity = eval_op_info(instruction.op).arity;
+      float* x = stack.data() + (depth - arity) * kBlock;
+      eval_instruction(args, n_inputs, instruction, begin, count, x, x + kBlock);
+      depth = depth - arity + 1;
+    }
+
+    std::memcpy(out + begin, stack.data(), count * sizeof(float));
+  }
+}
+
+static KernelRegistration eval("mtl_eval", eval_kernel);
+
+}  // namespace cpu
+
+bool eval_buffers(Device* device, CommandQueue* queue,
+                  const std::vector<EvalInstruction>& program,
+                  const std::vector<Buffer*>& inputs, const std::vector<float>& scalars,
+                  size_t n, Buffer* out, std::string* error) {
+  if (n > std::numeric_limits<uint32_t>::max()) {
+    *error = "Can't evaluate more than 2^32 - 1 elements";
+    return false;
+  } else if (kFirstInputArgument + inputs.size() + scalars.size() > kMaxArguments) {
+    size_t max_inputs = kMaxArguments - kFirstInputArgument;
+    *error = "Can't fuse more than " + std::to_string(max_inputs) + " inputs and scalars";
+    return false;
+  } else if (check_program(program, inputs.size(), scalars.size(), error) == 0) {
+    return false;
+  }
+
+  std::vector<uint32_t> words = {static_cast<uint32_t>(inputs.size()),
+                                 static_cast<uint32_t>(scalars.size())};
+  for (const EvalInstruction& instruction : program) {
+    words.push_back(static_cast<uint32_t>(instruction.op));
+    words.push_back(instruction.operand);
+  }
+
+  std::string program_bytes(words.size() * sizeof(uint32_t), '\0');
+  std::memcpy(&program_bytes[0], words.data(), program_bytes.size());
+  if (program_bytes.size() > kMaxInlineBytes) {
+    *error = "Expression has too many operators to fuse";
+    return false;
+  } else if (n == 0) {
+    return true;
+  }
+
+  DispatchSequence sequence;
+  ComputePipeline* pipeline = sequence.keep(
+      builtin_pipeline(device, eval_source(program, inputs.size(), scalars.size()),
+                       "mtl_eval", FunctionConstants(), error));
+  if (!pipeline) {
+    return false;
+  }
+
+  Dispatch dispatch;
+  dispatch.pipeline = pipeline;
+  dispatch.buffers = {out, nullptr, nullptr};
+  dispatch.bytes = {"", dispatch_bytes(static_cast<uint32_t>(n)), program_bytes};
+  for (Buffer* input : inputs) {
+    dispatch.buffers.push_back(input);
+    dispatch.bytes.push_back("");
+  }
+
+  for (float scalar : scalars) {
+    dispatch.buffers.push_back(nullptr);
+    dispatch.bytes.push_back(dispatch_bytes(scalar));
+  }
+
+  dispatch.grid = Size::Make(n);
+  dispatch.threadgroup =
+      Size::Make(std::min(kThreads, pipeline->max_total_threads_per_threadgroup()));
+  sequence.add(dispatch);
+  return sequence.run(queue, error);
+}
+
+}  // namespace backend
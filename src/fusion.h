@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+
+// Fused elementwise expressions of float buffers. An expression is a postfix
+// program of instructions that push inputs (elements of buffers), scalars, and
+// constants or apply an operator to the values on top of the stack. For Metal,
+// the program is generated into the source of one kernel that evaluates the
+// whole expression for one element per thread, so each input is read once and
+// the result is written once, however many operators the expression has. The
+// source only depends on the operators, the constants, and the number of
+// inputs and scalars, so it is compiled once (through the device's library and
+// pipeline caches) for any inputs of any length. The CPU backend can't compile
+// the generated source, so the program is also passed to the kernel and the
+// CPU kernel interprets it over blocks of elements that stay in cache between
+// instructions.
+namespace backend {
+
+enum class EvalOp : uint32_t {
+  Input,
+  Scalar,
+  Constant,
+  Negate,
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Power,
+  Min,
+  Max,
+  Sqrt,
+  Exp,
+  Log,
+  Abs,
+  Sin,
+  Cos,
+  Tan,
+  Tanh,
+  Floor,
+  Ceiling
+};
+
+// The operand is the index of an input or scalar or the bits of a constant
+struct EvalInstruction {
+  EvalOp op;
+  uint32_t operand;
+};
+
+// The operator called name in R (e.g., "+", "sqrt", or "pmin"), or "input",
+// "scalar", or "constant"; returns false if there isn't one
+bool eval_op_from_name(const std::string& name, EvalOp* op);
+
+// The source of the Metal kernel for program, which must be valid for
+// n_inputs inputs and n_scalars scalars (see eval_buffers())
+std::string eval_source(const std::vector<EvalInstruction>& program, size_t n_inputs,
+                        size_t n_scalars);
+
+// Writes the result of program for the first n elements of inputs into out.
+// Returns false with an error if the program doesn't leave exactly one value
+// on the stack or refers to inputs or scalars that don't exist.
+bool eval_buffers(Device* device, CommandQueue* queue,
+                  const std::vector<EvalInstruction>& program,
+                  const std::vector<Buffer*>& inputs, const std::vector<float>& scalars,
+                  size_t n, Buffer* out, std::string* error);
+
+}  // namespace backend
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <string>
+
+#include <cpp11.hpp>
+using namespace cpp11;
+
+#include "float-convert.h"
+
+// mtl_halfs and mtl_bfloat16s share an implementation: both store one 16-bit
+// payload per element of an integer vector and differ only in the conversions
+static bool is_bfloat16(const std::string& type) {
+  if (type == "half") {
+    return false;
+  } else if (type == "bfloat16") {
+    return true;
+  } else {
+    stop("Unsupported 16-bit float type: '%s'", type.c_str());
+  }
+}
+
+static void set_halfs_class(sexp& x, bool bfloat16) {
+  if (bfloat16) {
+    x.attr("class") = {"mtl_bfloat16s", "vctrs_vctr"};
+  } else {
+    x.attr("class") = {"mtl_halfs", "vctrs_vctr"};
+  }
+}
+
+static void halfs_from_dbl(const double* x, int* out, R_xlen_t size, bool bfloat16) {
+  if (bfloat16) {
+    floats::bfloat16_from_dbl(x, out, size);
+  } else {
+    floats::half_from_dbl(x, out, size);
+  }
+}
+
+[[cpp11::register]] sexp cpp_halfs(double size, double fill, std::string type) {
+  bool bfloat16 = is_bfloat16(type);
+  sexp result_sexp = safe[Rf_allocVector](INTSXP, size);
+
+  int fill_payload;
+  halfs_from_dbl(&fill, &fill_payload, 1, bfloat16);
+  int* result = INTEGER(result_sexp);
+  std::fill(result, result + Rf_xlength(result_sexp), fill_payload);
+
+  set_halfs_class(result_sexp, bfloat16);
+  return result_sexp;
+}
+
+// Returns NULL for anything other than a bare double vector so that the caller
+// can cast it to one first
+[[cpp11::register]] sexp cpp_as_halfs(sexp x, std::string type) {
+  bool bfloat16 = is_bfloat16(type);
+  if (Rf_isObject(x) || TYPEOF(x) != REALSXP) {
+    return R_NilValue;
+  }
+
+  R_xlen_t size = Rf_xlength(x);
+  sexp result_sexp = safe[Rf_allocVector](INTSXP, size);
+  halfs_from_dbl(REAL_RO(x), INTEGER(result_sexp), size, bfloat16);
+
+  set_halfs_class(result_sexp, bfloat16);
+  return result_sexp;
+}
+
+[[cpp11::register]] sexp cpp_from_halfs_dbl(sexp halfs_sexp, std::string type) {
+  bool bfloat16 = is_bfloat16(type);
+  const int* values = INTEGER_RO(halfs_sexp);
+  R_xlen_t size = Rf_xlength(halfs_sexp);
+  sexp result_sexp = safe[Rf_allocVector](REALSXP, size);
+
+  if (bfloat16) {
+    floats::bfloat16_to_dbl(values, REAL(result_sexp), size);
+  } else {
+    floats::half_to_dbl(values, REAL(result_sexp), size);
+  }
+
+  return result_sexp;
+}
@@ -0,0 +1,166 @@
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "library-cache.h"
+
+namespace backend {
+
+void LibraryCache::set_directory(const std::string& directory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  directory_ = directory;
+}
+
+std::string LibraryCache::directory() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return directory_;
+}
+
+CompiledLibrary* LibraryCache::get(Device* device, const std::string& code,
+                                   const CompileOptions& options, std::string* error) {
+  std::string key = LibraryCache::key(device, code, options);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto item = libraries_.find(key);
+  if (item != libraries_.end()) {
+    hits_++;
+    item->second->retain();
+    return item->second;
+  }
+
+  uint64_t key_hash = hash(key);
+  CompiledLibrary* compiled = nullptr;
+  std::string path;
+  if (!directory_.empty()) {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "%016" PRIx64 ".lib", key_hash);
+    path = directory_ + "/" + filename;
+    compiled = load(device, path, key);
+  }
+
+  if (compiled != nullptr) {
+    disk_hits_++;
+  } else {
+    misses_++;
+    compiled = device->compile_library(code, options, error);
+    if (compiled == nullptr) {
+      return nullptr;
+    }
+
+    if (!path.empty()) {
+      save(compiled, path, key);
+    }
+  }
+
+  compiled->set_source_hash(key_hash);
+
+  libraries_[key] = compiled;
+  compiled->retain();
+  return compiled;
+}
+
+void LibraryCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& item : libraries_) {
+    item.second->release();
+  }
+
+  libraries_.clear();
+}
+
+LibraryCacheStats LibraryCache::stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return LibraryCacheStats{hits_, disk_hits_, misses_, libraries_.size()};
+}
+
+std::string LibraryCache::key(Device* device, const std::string& code,
+                              const CompileOptions& options) {
+  return device->backend_name() + '\0' + device->name() + '\0' + options.key() + '\0' +
+         code;
+}
+
+uint64_t LibraryCache::hash(const std::string& value) {
+  uint64_t out = 14695981039346656037ULL;
+  for (unsigned char c : value) {
+    out ^= c;
+    out *= 1099511628211ULL;
+  }
+
+  return out;
+}
+
+// Files start with the length of the key on its own line and the key itself, so
+// that a file whose name collides with another key's hash isn't loaded. The
+// on-disk cache is best effort: unreadable, stale, or colliding files are
+// ignored (and overwritten after compiling).
+CompiledLibrary* LibraryCache::load(Device* device, const std::string& path,
+                                    const std::string& key) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return nullptr;
+  }
+
+  std::stringstream data;
+  data << file.rdbuf();
+  std::string contents = data.str();
+
+  std::string header = std::to_string(key.size()) + '\n';
+  size_t offset = header.size() + key.size();
+  if (contents.size() < offset || contents.compare(0, header.size(), header) != 0 ||
+      contents.compare(header.size(), key.size(), key) != 0) {
+    return nullptr;
+  }
+
+  return device->load_compiled_library(contents.substr(offset));
+}
+
+// Files are written under a temporary name and renamed so that a concurrent
+// session never reads a partially written file
+void LibraryCache::save(CompiledLibrary* compiled, const std::string& path,
+                        const std::string& key) {
+  std::string data;
+  if (!compiled->serialize(&data)) {
+    return;
+  }
+
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      return;
+    }
+
+    file << key.size() << '\n' << key << data;
+    if (!file) {
+      std::remove(tmp_path.c_str());
+      return;
+    }
+  }
+
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+  }
+}
+
+LibraryCache* Device::library_cache() {
+  if (!library_cache_) {
+    library_cache_ = std::make_shared<LibraryCache>();
+  }
+
+  return library_cache_.get();
+}
+
+Library* Device::new_library(const std::string& code, const CompileOptions& options,
+                             std::string* error) {
+  CompiledLibrary* compiled = library_cache()->get(this, code, options, error);
+  if (compiled == nullptr) {
+    return nullptr;
+  }
+
+  Library* library = wrap_compiled_library(compiled);
+  compiled->release();
+  return library;
+}
+
+}  // namespace backend
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "backend.h"
+
+// Caches the libraries compiled by a device so that compiling the same source
+// with the same options (e.g., in a loop or in .onLoad) doesn't invoke the
+// compiler again. Compiled libraries can optionally be saved to a directory
+// when the backend can serialize them, so that they are also reused across
+// sessions. Files are named by a hash of the device, options, and source that
+// is stable across sessions and also contain the full key, which is compared
+// when loading them.
+namespace backend {
+
+struct LibraryCacheStats {
+  size_t hits;
+  size_t disk_hits;
+  size_t misses;
+  size_t size;
+};
+
+class LibraryCache {
+ public:
+  LibraryCache() : hits_(0), disk_hits_(0), misses_(0) {}
+  ~LibraryCache() { clear(); }
+
+  // An empty directory disables the on-disk cache
+  void set_directory(const std::string& directory);
+  std::string directory();
+
+  // Returns a retained compiled library, compiling code with device on a miss
+  CompiledLibrary* get(Device* device, const std::string& code,
+                       const CompileOptions& options, std::string* error);
+
+  void clear();
+  LibraryCacheStats stats();
+
+  // Identifies compiling code with options on device
+  static std::string key(Device* device, const std::string& code,
+                         const CompileOptions& options);
+
+  // 64-bit FNV-1a
+  static uint64_t hash(const std::string& value);
+
+ private:
+  std::mutex mutex_;
+  std::string directory_;
+  size_t hits_;
+  size_t disk_hits_;
+  size_t misses_;
+  std::unordered_map<std::string, CompiledLibrary*> libraries_;
+
+  CompiledLibrary* load(Device* device, const std::string& path,
+                        const std::string& key);
+  void save(CompiledLibrary* compiled, const std::string& path, const std::string& key);
+};
+
+}  // namespace backend
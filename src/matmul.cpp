@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include "backend-cpu.h"
+#include "builtin-kernels.h"
+#include "float-convert.h"
+#include "matmul.h"
+
+namespace backend {
+
+struct MatmulParams {
+  uint32_t m;
+  uint32_t n;
+  uint32_t k;
+};
+
+static_assert(sizeof(MatmulParams) == 12, "MatmulParams must match the Metal source");
+
+// The tiled kernels need exactly kSide x kSide threads per threadgroup. Thread
+// (x, y) of a threadgroup accumulates the rows x, x + kSide, ... and columns
+// y, y + kSide, ... of its tile, so that neighbouring threads read neighbouring
+// elements of the staged tiles and write neighbouring rows of the result.
+// Matrices are column-major: element (i, j) of a is a[i + j * m].
+static const char* kMatmulSource = R"(
+#include <metal_stdlib>
+using namespace metal;
+
+enum { kTile = 64, kTileK = 16, kSide = 16, kPerThread = kTile / kSide };
+
+struct MatmulParams {
+  uint m;
+  uint n;
+  uint k;
+};
+
+template <typename T>
+static void matmul_tile(device const T* a, device const T* b, device float* c,
+                        constant MatmulParams& params, uint2 group, uint2 local,
+                        threadgroup float* a_tile, threadgroup float* b_tile) {
+  ulong row0 = ulong(group.x) * kTile;
+  ulong col0 = ulong(group.y) * kTile;
+  uint tid = local.y * kSide + local.x;
+
+  float acc[kPerThread][kPerThread];
+  for (uint i = 0; i < kPerThread; i++) {
+    for (uint j = 0; j < kPerThread; j++) {
+      acc[i][j] = 0.0f;
+    }
+  }
+
+  for (ulong kk = 0; kk < params.k; kk += kTileK) {
+    // a_tile[p * kTile + i] is a[row0 + i, kk + p] and b_tile[p * kTile + j]
+    // is b[kk + p, col0 + j] (zero outside of the matrices)
+    for (uint index = tid; index < kTile * kTileK; index += kSide * kSide) {
+      ulong row = row0 + index % kTile;
+      ulong depth = kk + index / kTile;
+      a_tile[index] = (row < params.m && depth < params.k)
+                          ? float(a[row + depth * params.m])
+                          : 0.0f;
+
+      uint p = index % kTileK;
+      uint j = index / kTileK;
+      ulong b_depth = kk + p;
+      ulong col = col0 + j;
+      b_tile[p * kTile + j] = (b_depth < params.k && col < params.n)
+                                  ? float(b[b_depth + col * params.k])
+                                  : 0.0f;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    for (uint p = 0; p < kTileK; p++) {
+      float a_values[kPerThread];
+      float b_values[kPerThread];
+      for (uint i = 0; i < kPerThread; i++) {
+        a_values[i] = a_tile[p * kTile + local.x + i * kSide];
+        b_values[i] = b_tile[p * kTile + local.y + i * kSide];
+      }
+
+      for (uint i = 0; i < kPerThread; i++) {
+        for (uint j = 0; j < kPerThread; j++) {
+          acc[i][j] = fma(a_values[i], b_values[j], acc[i][j]);
+        }
+      }
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+  }
+
+  for (uint j = 0; j < kPerThread; j++) {
+    ulong col = col0 + local.y + j * kSide;
+    for (uint i = 0; i < kPerThread; i++) {
+      ulong row = row0 + local.x + i * kSide;
+      if (row < params.m && col < params.n) {
+        c[row + col * params.m] = acc[i][j];
+      }
+    }
+  }
+}
+
+template <typename T>
+static void matvec_row(device const T* a, device const T* x, device float* y,
+                       constant MatmulParams& params, uint row) {
+  if (row >= params.m) {
+    return;
+  }
+
+  float sum = 0.0f;
+  for (ulong j = 0; j < params.k; j++) {
+    sum = fma(float(a[row + j * params.m]), float(x[j]), sum);
+  }
+
+  y[row] = sum;
+}
+
+kernel void mtl_matmul_float(device const float* a [[buffer(0)]],
+                             device const float* b [[buffer(1)]],
+                             device float* c [[buffer(2)]],
+                             constant MatmulParams& params [[buffer(3)]],
+                             uint2 group [[threadgroup_position_in_grid]],
+                             uint2 local [[thread_position_in_threadgroup]]) {
+  threadgroup float a_tile[kTile * kTileK];
+  threadgroup float b_tile[kTileK * kTile];
+  matmul_tile(a, b, c, params, group, local, a_tile, b_tile);
+}
+
+kernel void mtl_matmul_half(device const half* a [[buffer(0)]],
+                            device const half* b [[buffer(1)]],
+                            device float* c [[buffer(2)]],
+                            constant MatmulParams& params [[buffer(3)]],
+                            uint2 group [[threadgroup_position_in_grid]],
+                            uint2 local [[thread_position_in_threadgroup]]) {
+  threadgroup float a_tile[kTile * kTileK];
+  threadgroup float b_tile[kTileK * kTile];
+  matmul_tile(a, b, c, params, group, local, a_tile, b_tile);
+}
+
+kernel void mtl_matvec_float(device const float* a [[buffer(0)]],
+                             device const float* x [[buffer(1)]],
+                             device float* y [[buffer(2)]],
+                             constant MatmulParams& params [[buffer(3)]],
+                             uint row [[thread_position_in_grid]]) {
+  matvec_row(a, x, y, params, row);
+}
+
+kernel void mtl_matvec_half(device const half* a [[buffer(0)]],
+                            device const half* x [[buffer(1)]],
+                            device float* y [[buffer(2)]],
+                            constant MatmulParams& params [[buffer(3)]],
+                            uint row [[thread_position_in_grid]]) {
+  matvec_row(a, x, y, params, row);
+}
+)";
+
+static constexpr size_t kTile = 64;
+static constexpr size_t kSide = 16;
+static constexpr size_t kMatvecThreads = 256;
+
+namespace cpu {
+
+// The CPU kernels stage blocks of kBlockK columns of a (and rows of b) as
+// floats, so that the inner loop over the rows of a tile is the same for both
+// element types and has a fixed trip count that the compiler can vectorize.
+// The blocks and the tile's accumulators use 48 KB of the worker's stack.
+static constexpr size_t kBlockK = 64;
+
+// Columns of the tile are accumulated four at a time, so that each element of
+// a staged column of a is loaded once for four columns of the result
+static constexpr size_t kColumnsPerStep = 4;
+
+template <typename T>
+static void load_floats(const T* x, float* out, size_t n) {
+  if constexpr (std::is_same<T, uint16_t>::value) {
+    floats::half_to_float(x, out, n);
+  } else {
+    std::memcpy(out, x, n * sizeof(float));
+  }
+}
+
+// kernel void mtl_matmul_float(device const float* a, device const float* b,
+//                              device float* c, constant MatmulParams& params,
+//                              ...)
+template <typename T>
+static void matmul_tile(const KernelArguments& args, const ThreadgroupContext& ctx) {
+  MatmulParams params = args.value<MatmulParams>(3);
+  size_t m = params.m;
+  size_t n = params.n;
+  size_t k = params.k;
+  size_t row0 = ctx.threadgroup_position_in_grid.width * kTile;
+  size_t col0 = ctx.threadgroup_position_in_grid.height * kTile;
+  if (row0 >= m || col0 >= n) {
+    return;
+  }
+
+  size_t rows = std::min(kTile, m - row0);
+  size_t cols = std::min(kTile, n - col0);
+  size_t step_cols = (cols + kColumnsPerStep - 1) / kColumnsPerStep * kColumnsPerStep;
+  const T* a = args.buffer<T>(0);
+  const T* b = args.buffer<T>(1);
+
+  // acc[j][i] is element (row0 + i, col0 + j) of the result, a_block[p][i] is
+  // a[row0 + i, kk + p], and b_block[j][p] is b[kk + p, col0 + j]
+  alignas(64) float acc[kTile][kTile] = {};
+  alignas(64) float a_block[kBlockK][kTile] = {};
+  alignas(64) float b_block[kTile][kBlockK] = {};
+
+  for (size_t kk = 0; kk < k; kk += kBlockK) {
+    size_t depth = std::min(kBlockK, k - kk);
+    for (size_t p = 0; p < depth; p++) {
+      load_floats(a + row0 + (kk + p) * m, a_block[p], rows);
+    }
+
+    for (size_t j = 0; j < cols; j++) {
+      load_floats(b + kk + (col0 + j) * k, b_block[j], depth);
+    }
+
+    for (size_t j = 0; j < step_cols; j += kColumnsPerStep) {
+      float* c0 = acc[j];
+      float* c1 = acc[j + 1];
+      float* c2 = acc[j + 2];
+      float* c3 = acc[j + 3];
+      for (size_t p = 0; p < depth; p++) {
+        const float* a_col = a_block[p];
+        float b0 = b_block[j][p];
+        float b1 = b_block[j + 1][p];
+        float b2 = b_block[j + 2][p];
+        float b3 = b_block[j + 3][p];
+        for (size_t i = 0; i < kTile; i++) {
+          c0[i] += a_col[i] * b0;
+          c1[i] += a_col[i] * b1;
+          c2[i] += a_col[i] * b2;
+          c3[i] += a_col[i] * b3;
+        }
+      }
+    }
+  }
+
+  float* c = args.buffer<float>(2);
+  for (size_t j = 0; j < cols; j++) {
+    std::memcpy(c + row0 + (col0 + j) * m, acc[j], rows * sizeof(float));
+  }
+}
+
+// kernel void mtl_matvec_float(device const float* a, device const float* x,
+//                              device float* y, constant MatmulParams& params,
+//                              uint row [[thread_position_in_grid]])
+template <typename T>
+static void matvec_rows(const KernelArguments& args, const ThreadgroupContext& ctx) {
+  MatmulParams params = args.value<MatmulParams>(3);
+  size_t m = params.m;
+  size_t row0 = ctx.threadgroup_position_in_grid.width * kMatvecThreads;
+  if (row0 >= m) {
+    return;
+  }
+
+  size_t rows = std::min(kMatvecThreads, m - row0);
+  const T* a = args.buffer<T>(0);
+  const T* x = args.buffer<T>(1);
+  float sum[kMatvecThreads] = {};
+  float a_col[kMatvecThreads];
+  for (size_t j = 0; j < params.k; j++) {
+    float x_j;
+    load_floats(x + j, &x_j, 1);
+    load_floats(a + row0 + j * m, a_col, rows);
+    for (size_t i = 0; i < rows; i++) {
+      sum[i] += a_col[i] * x_j;
+    }
+  }
+
+  std::memcpy(args.buffer<float>(2) + row0, sum, rows * sizeof(float));
+}
+
+static KernelRegistration matmul_float("mtl_matmul_float", matmul_tile<float>);
+static KernelRegistration matmul_half("mtl_matmul_half", matmul_tile<uint16_t>);
+static KernelRegistration matvec_float("mtl_matvec_float", matvec_rows<float>);
+static KernelRegistration matvec_half("mtl_matvec_half", matvec_rows<uint16_t>);
+
+}  // namespace cpu
+
+bool matmul_buffers(Device* device, CommandQueue* queue, Buffer* a, Buffer* b,
+                    MatmulElement element, size_t m, size_t k, size_t n, Buffer* out,
+                    std::string* error) {
+  size_t max_dim = std::numeric_limits<uint32_t>::max();
+  if (m > max_dim || k > max_dim || n > max_dim) {
+    *error = "Can't multiply matrices with 2^32 or more rows or columns";
+    return false;
+  } else if (m == 0 || n == 0) {
+    return true;
+  } else if (k == 0) {
+    std::memset(out->contents(), 0, m * n * sizeof(float));
+    return true;
+  }
+
+  bool matvec = n == 1;
+  std::string name = matvec ? "mtl_matvec" : "mtl_matmul";
+  name += element == MatmulElement::Half ? "_half" : "_float";
+
+  DispatchSequence sequence;
+  ComputePipeline* pipeline = sequence.keep(
+      builtin_pipeline(device, kMatmulSource, name, FunctionConstants(), error));
+  if (!pipeline) {
+    return false;
+  }
+
+  MatmulParams params{static_cast<uint32_t>(m), static_cast<uint32_t>(n),
+                      static_cast<uint32_t>(k)};
+
+  Dispatch dispatch;
+  dispatch.pipeline = pipeline;
+  dispatch.buffers = {a, b, out, nullptr};
+  dispatch.bytes = {"", "", "", dispatch_bytes(params)};
+  if (matvec) {
+    // The CPU kernel computes blocks of exactly kMatvecThreads rows
+    dispatch.grid = Size::Make(m);
+    dispatch.threadgroup = Size::Make(
+        std::min(kMatvecThreads, pipeline->max_total_threads_per_threadgroup()));
+  } else {
+    if (pipeline->max_total_threads_per_threadgroup() < kSide * kSide) {
+      *error = "Pipeline for '" + name + "' can't run " +
+               std::to_string(kSide * kSide) + " threads per threadgroup";
+      return false;
+    }
+
+    dispatch.grid = Size::Make((m + kTile - 1) / kTile * kSide,
+                               (n + kTile - 1) / kTile * kSide);
+    dispatch.threadgroup = Size::Make(kSide, kSide);
+  }
+
+  sequence.add(dispatch);
+  return sequence.run(queue, error);
+}
+
+}  // namespace backend
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "backend.h"
+
+// Single-precision products of column-major matrices (like R's), for "float"
+// and "half" inputs with float results. Products with more than one column
+// use a 2D grid of threadgroups that each compute a 64 x 64 tile of the result
+// from 64 x 16 and 16 x 64 tiles of the inputs staged in threadgroup memory
+// (each thread accumulates a 4 x 4 block of the tile in registers). Products
+// with one column (matrix-vector products) use one thread per row instead,
+// since a tile would be mostly empty. The CPU backend registers C++ kernels
+// with the same names that compute a whole tile (or block of rows) on one
+// worker thread with cache-sized blocks and loops that the compiler can
+// vectorize.
+namespace backend {
+
+enum class MatmulElement { Float, Half };
+
+// Writes the m x n product of a (m x k) and b (k x n) into out. Each dimension
+// must be less than 2^32.
+bool matmul_buffers(Device* device, CommandQueue* queue, Buffer* a, Buffer* b,
+                    MatmulElement element, size_t m, size_t k, size_t n, Buffer* out,
+                    std::string* error);
+
+}  // namespace backend
@@ -1,143 +1,125 @@
-
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <cpp11.hpp>
 using namespace cpp11;
 
-#include "Metal/Metal.hpp"
-
-template <typename T>
-const char* owner_xptr_classname();
-
-template <>
-const char* owner_xptr_classname<MTL::Device>() {
-  return "mtl_device";
-}
-
-template <>
-const char* owner_xptr_classname<MTL::Library>() {
-  return "mtl_library";
-}
-
-template <>
-const char* owner_xptr_classname<MTL::Function>() {
-  return "mtl_function";
-}
-
-template <>
-const char* owner_xptr_classname<MTL::ComputePipelineState>() {
-  return "mtl_compute_pipeline";
-}
-
-template <>
-const char* owner_xptr_classname<MTL::CommandQueue>() {
-  return "mtl_command_queue";
-}
-
-template <>
-const char* owner_xptr_classname<MTL::Buffer>() {
-  return "mtl_buffer";
-}
-
-template <>
-const char* owner_xptr_classname<NS::String>() {
-  return "ns_string";
-}
-
-template <>
-const char* owner_xptr_classname<MTL::CompileOptions>() {
-  return "mtl_compile_options";
-}
-
-template <typename T>
-class Owner {
- public:
-  Owner() : ptr_(nullptr) {}
-  Owner(T* ptr) : ptr_(ptr) {}
-
-  void reset(T* ptr) {
-    ptr_->release();
-    ptr_ = ptr;
-  }
-
-  T* get() { return ptr_; }
-
-  ~Owner() { reset(nullptr); }
-
- private:
-  T* ptr_;
-};
-
-template <typename T>
-class OwnerXPtr : public external_pointer<Owner<T>> {
- public:
-  OwnerXPtr(T* ptr) : external_pointer<Owner<T>>(new Owner<T>(ptr)) {
-    sexp xptr_sexp = (SEXP)(*this);
-    xptr_sexp.attr("class") = owner_xptr_classname<T>();
-  }
+#include "backend.h"
+#include "buffer-pool.h"
+#include "float-convert.h"
+#include "fusion.h"
+#include "library-cache.h"
+#include "matmul.h"
+#include "owner-xptr.h"
+#include "pipeline-cache.h"
+#include "reduce.h"
+#include "scan.h"
+#include "sort.h"
+#include "tuning-cache.h"
+
+// Looking up the default device is on the hot path of every
+// mtl_compute_pipeline_execute() call, so it is created once and kept alive for
+// the life of the session.
+static SEXP default_device_sexp = nullptr;
 
-  OwnerXPtr(sexp xptr) : external_pointer<Owner<T>>(xptr) {
-    if (!Rf_inherits(xptr, owner_xptr_classname<T>())) {
-      stop("external pointer does not inherit from '%s'", owner_xptr_classname<T>());
-    }
+[[cpp11::register]] sexp cpp_default_device() {
+  if (default_device_sexp != nullptr) {
+    return default_device_sexp;
   }
-};
-
-using DeviceXPtr = OwnerXPtr<MTL::Device>;
-using LibraryXPtr = OwnerXPtr<MTL::Library>;
-using FunctionXptr = OwnerXPtr<MTL::Function>;
-using ComputePipelineXptr = OwnerXPtr<MTL::ComputePipelineState>;
-using CommandQueueXptr = OwnerXPtr<MTL::CommandQueue>;
-using BufferXptr = OwnerXPtr<MTL::Buffer>;
 
-[[cpp11::register]] sexp cpp_default_device() {
-  MTL::Device* default_device = MTL::CreateSystemDefaultDevice();
+  backend::Device* default_device = backend::create_system_default_device();
   if (default_device == nullptr) {
-    stop("No default device found");
+    default_device = backend::create_cpu_device(0);
   }
 
   DeviceXPtr device(default_device);
+  default_device_sexp = (SEXP)device;
+  R_PreserveObject(default_device_sexp);
+  return default_device_sexp;
+}
+
+[[cpp11::register]] sexp cpp_cpu_device(int n_threads) {
+  DeviceXPtr device(backend::create_cpu_device(n_threads));
   return (SEXP)device;
 }
 
 [[cpp11::register]] list cpp_device_info(sexp device_sexp) {
   DeviceXPtr device_xptr(device_sexp);
-  NS::String* name = device_xptr->get()->name();
-  NS::String* description = device_xptr->get()->description();
+  backend::Device* device = device_xptr->get();
 
-  writable::list out = {as_sexp(name->utf8String()), as_sexp(description->utf8String())};
-  out.names() = {"name", "description"};
+  std::string name = device->name();
+  std::string description = device->description();
+  std::string backend_name = device->backend_name();
+
+  writable::list out = {as_sexp(name.c_str()), as_sexp(description.c_str()),
+                        as_sexp(backend_name.c_str())};
+  out.names() = {"name", "description", "backend"};
   return out;
 }
 
-[[cpp11::register]] sexp cpp_make_library(sexp device_sexp, std::string code) {
+[[cpp11::register]] sexp cpp_make_library(sexp device_sexp, std::string code,
+                                          bool fast_math, bool cache,
+                                          std::string cache_dir) {
   DeviceXPtr device_xptr(device_sexp);
+  backend::Device* device = device_xptr->get();
+
+  backend::CompileOptions options;
+  options.fast_math = fast_math;
+
+  std::string error;
+  backend::Library* library = nullptr;
+  if (cache) {
+    device->library_cache()->set_directory(cache_dir);
+    library = device->new_library(code, options, &error);
+  } else {
+    Owner<backend::CompiledLibrary> compiled(
+        device->compile_library(code, options, &error));
+    if (compiled.get() != nullptr) {
+      std::string key = backend::LibraryCache::key(device, code, options);
+      compiled.get()->set_source_hash(backend::LibraryCache::hash(key));
+      library = device->wrap_compiled_library(compiled.get());
+    }
+  }
 
-  NS::Error* error = nullptr;
-  Owner<NS::String> ns_code =
-      NS::String::string(code.c_str(), NS::StringEncoding::UTF8StringEncoding);
-  Owner<MTL::CompileOptions> options = MTL::CompileOptions::alloc();
-  options.get()->init();
-
-  MTL::Library* library =
-      device_xptr->get()->newLibrary(ns_code.get(), options.get(), &error);
   if (library == nullptr) {
-    const char* description = error->localizedDescription()->utf8String();
-    stop("Error compiling metal code:\n%s", description);
+    stop("Error compiling metal code:\n%s", error.c_str());
   }
 
   LibraryXPtr library_xptr(library);
   return (SEXP)library_xptr;
 }
 
+[[cpp11::register]] list cpp_library_cache_info(sexp device_sexp) {
+  DeviceXPtr device_xptr(device_sexp);
+  backend::LibraryCache* cache = device_xptr->get()->library_cache();
+  backend::LibraryCacheStats stats = cache->stats();
+  std::string directory = cache->directory();
+
+  writable::list out = {as_sexp((double)stats.hits), as_sexp((double)stats.disk_hits),
+                        as_sexp((double)stats.misses), as_sexp((double)stats.size),
+                        directory.empty() ? R_NilValue : as_sexp(directory.c_str())};
+  out.names() = {"hits", "disk_hits", "misses", "libraries", "directory"};
+  return out;
+}
+
+[[cpp11::register]] void cpp_library_cache_clear(sexp device_sexp) {
+  DeviceXPtr device_xptr(device_sexp);
+  device_xptr->get()->library_cache()->clear();
+}
+
 [[cpp11::register]] strings cpp_library_function_names(sexp library_sexp) {
   LibraryXPtr library_xptr(library_sexp);
-  NS::Array* ns_names = library_xptr->get()->functionNames();
+  std::vector<std::string> names = library_xptr->get()->function_names();
 
-  R_xlen_t num_names = ns_names->count();
+  R_xlen_t num_names = names.size();
   writable::strings out(num_names);
   for (R_xlen_t i = 0; i < num_names; i++) {
-    out[i] = ((NS::String*)ns_names->object(i))->utf8String();
+    out[i] = names[i].c_str();
   }
 
   return out;
@@ -145,9 +127,7 @@ using BufferXptr = OwnerXPtr<MTL::Buffer>;
 
 [[cpp11::register]] sexp cpp_library_function(sexp library_sexp, std::string name) {
   LibraryXPtr library_xptr(library_sexp);
-  Owner<NS::String> ns_name =
-      NS::String::string(name.c_str(), NS::StringEncoding::UTF8StringEncoding);
-  MTL::Function* function = library_xptr->get()->newFunction(ns_name.get());
+  backend::Function* function = library_xptr->get()->new_function(name);
 
   if (function == nullptr) {
     return R_NilValue;
@@ -157,24 +137,69 @@ using BufferXptr = OwnerXPtr<MTL::Buffer>;
   return (SEXP)function_xptr;
 }
 
+static backend::ConstantType constant_type(const std::string& type) {
+  if (type == "bool") {
+    return backend::ConstantType::Bool;
+  } else if (type == "int32") {
+    return backend::ConstantType::Int;
+  } else if (type == "uint32") {
+    return backend::ConstantType::UInt;
+  } else if (type == "int16") {
+    return backend::ConstantType::Short;
+  } else if (type == "uint16") {
+    return backend::ConstantType::UShort;
+  } else if (type == "uint8") {
+    return backend::ConstantType::UChar;
+  } else if (type == "float") {
+    return backend::ConstantType::Float;
+  } else if (type == "half") {
+    return backend::ConstantType::Half;
+  } else {
+    stop("Unsupported function constant type: '%s'", type.c_str());
+  }
+}
+
+// constants is a named list of mtl_scalars (the bytes of each value with its
+// type as an attribute)
+[[cpp11::register]] sexp cpp_library_specialized_function(sexp library_sexp,
+                                                          std::string name,
+                                                          list constants) {
+  backend::FunctionConstants function_constants;
+  strings constant_names(Rf_getAttrib(constants, R_NamesSymbol));
+  for (R_xlen_t i = 0; i < constants.size(); i++) {
+    SEXP value = constants[i];
+    strings type(Rf_getAttrib(value, Rf_install("type")));
+    std::string bytes(reinterpret_cast<const char*>(RAW(value)), Rf_xlength(value));
+    function_constants.add(constant_names[i], constant_type(type[0]), bytes);
+  }
+
+  LibraryXPtr library_xptr(library_sexp);
+  std::string error;
+  backend::Function* function =
+      library_xptr->get()->new_specialized_function(name, function_constants, &error);
+  if (function == nullptr) {
+    stop("Error specializing function '%s':\n%s", name.c_str(), error.c_str());
+  }
+
+  FunctionXptr function_xptr(function);
+  return (SEXP)function_xptr;
+}
+
 [[cpp11::register]] list cpp_function_info(sexp function_sexp) {
   FunctionXptr function_xptr(function_sexp);
 
-  NS::String* ns_name = function_xptr->get()->name();
-
-  MTL::FunctionType type = function_xptr->get()->functionType();
   std::string type_string;
-  switch (type) {
-    case MTL::FunctionType::FunctionTypeFragment:
+  switch (function_xptr->get()->type()) {
+    case backend::FunctionType::Fragment:
       type_string = "fragment";
       break;
-    case MTL::FunctionType::FunctionTypeIntersection:
+    case backend::FunctionType::Intersection:
       type_string = "intersection";
       break;
-    case MTL::FunctionType::FunctionTypeKernel:
+    case backend::FunctionType::Kernel:
       type_string = "kernel";
       break;
-    case MTL::FunctionType::FunctionTypeVertex:
+    case backend::FunctionType::Vertex:
       type_string = "vertex";
       break;
     default:
@@ -182,24 +207,50 @@ using BufferXptr = OwnerXPtr<MTL::Buffer>;
       break;
   }
 
-  writable::list out = {as_sexp(ns_name->utf8String()), as_sexp(type_string)};
+  std::string name = function_xptr->get()->name();
+  writable::list out = {as_sexp(name.c_str()), as_sexp(type_string)};
   out.names() = {"name", "type"};
   return out;
 }
 
-static std::unordered_map<const void*, SEXP> buffer_shelter;
+// R objects whose memory is aliased by a buffer are preserved until the buffer
+// is destroyed. Buffers can be destroyed on a backend thread (e.g., when the
+// last command buffer using one completes), where the R API must not be used,
+// so those releases are deferred until the next buffer is created on the R
+// thread.
+static std::thread::id buffer_shelter_thread_id;
+static std::mutex buffer_shelter_mutex;
+static std::vector<SEXP> buffer_shelter_deferred;
+
+static void buffer_shelter_flush() {
+  std::vector<SEXP> deferred;
+  {
+    std::lock_guard<std::mutex> lock(buffer_shelter_mutex);
+    deferred.swap(buffer_shelter_deferred);
+  }
+
+  for (SEXP token : deferred) {
+    preserved.release(token);
+  }
+}
+
+static void buffer_shelter_release(SEXP token) {
+  if (std::this_thread::get_id() == buffer_shelter_thread_id) {
+    preserved.release(token);
+  } else {
+    std::lock_guard<std::mutex> lock(buffer_shelter_mutex);
+    buffer_shelter_deferred.push_back(token);
+  }
+}
 
 [[cpp11::register]] sexp cpp_buffer(sexp device_sexp, double size_dbl) {
-  const void* ptr = nullptr;
-  NS::UInteger size = size_dbl;
+  buffer_shelter_flush();
+  size_t size = size_dbl;
 
   DeviceXPtr device_xptr(device_sexp);
-  MTL::Buffer* buffer =
-      device_xptr->get()->newBuffer(size, MTL::ResourceStorageModeShared);
+  backend::Buffer* buffer = device_xptr->get()->new_pooled_buffer(size);
 
   if (buffer == nullptr) {
-    preserved.release(buffer_shelter[ptr]);
-    buffer_shelter.erase(ptr);
     stop("Failed to create buffer");
   }
 
@@ -207,11 +258,88 @@ static std::unordered_map<const void*, SEXP> buffer_shelter;
   return (SEXP)buffer_xptr;
 }
 
+[[cpp11::register]] list cpp_buffer_pool_info(sexp device_sexp) {
+  DeviceXPtr device_xptr(device_sexp);
+  backend::BufferPoolStats stats = device_xptr->get()->buffer_pool()->stats();
+
+  writable::list out = {as_sexp((double)stats.hits), as_sexp((double)stats.misses),
+                        as_sexp((double)stats.retained_count),
+                        as_sexp((double)stats.retained_bytes),
+                        as_sexp((double)stats.capacity)};
+  out.names() = {"hits", "misses", "buffers", "bytes", "capacity"};
+  return out;
+}
+
+[[cpp11::register]] void cpp_buffer_pool_set_capacity(sexp device_sexp, double capacity) {
+  if (capacity < 0) {
+    stop("Invalid capacity");
+  }
+
+  DeviceXPtr device_xptr(device_sexp);
+  device_xptr->get()->buffer_pool()->set_capacity(capacity);
+}
+
+[[cpp11::register]] void cpp_buffer_pool_trim(sexp device_sexp, double bytes) {
+  if (bytes < 0) {
+    stop("Invalid size");
+  }
+
+  DeviceXPtr device_xptr(device_sexp);
+  device_xptr->get()->buffer_pool()->trim(bytes);
+}
+
+// Returns a buffer that aliases the memory of x or NULL if the device can't use
+// that memory directly. Writes to the buffer modify x in place!
+[[cpp11::register]] sexp cpp_buffer_wrap(sexp device_sexp, sexp x) {
+  buffer_shelter_flush();
+  buffer_shelter_thread_id = std::this_thread::get_id();
+
+  size_t size;
+  switch (TYPEOF(x)) {
+    case INTSXP:
+    case LGLSXP:
+      size = Rf_xlength(x) * sizeof(int);
+      break;
+    case REALSXP:
+      size = Rf_xlength(x) * sizeof(double);
+      break;
+    case RAWSXP:
+      size = Rf_xlength(x);
+      break;
+    default:
+      stop("Vector type not supported for x");
+  }
+
+  DeviceXPtr device_xptr(device_sexp);
+  void* ptr = DATAPTR(x);
+  SEXP token = preserved.insert(x);
+  backend::Buffer* buffer = device_xptr->get()->new_buffer_no_copy(
+      ptr, size, [token]() { buffer_shelter_release(token); });
+
+  if (buffer == nullptr) {
+    preserved.release(token);
+    return R_NilValue;
+  }
+
+  BufferXptr buffer_xptr(buffer);
+  return (SEXP)buffer_xptr;
+}
+
 [[cpp11::register]] double cpp_buffer_size(sexp buffer_sexp) {
   BufferXptr buffer_xptr(buffer_sexp);
   return buffer_xptr->get()->length();
 }
 
+// Defined in floats.cpp
+bool lazy_floats_copy(sexp x, R_xlen_t offset, R_xlen_t n, float* out);
+
+// mtl_halfs and mtl_bfloat16s are integer vectors with one 16-bit payload per
+// element that occupy two bytes per element in a buffer. Offsets and lengths
+// for these refer to the 16-bit storage.
+bool is_16_bit_floats(sexp x) {
+  return Rf_inherits(x, "mtl_halfs") || Rf_inherits(x, "mtl_bfloat16s");
+}
+
 [[cpp11::register]] void cpp_buffer_copy_from(sexp src_sexp, sexp buffer_sexp,
                                               double src_offset, double buffer_offset,
                                               double length) {
@@ -227,11 +355,12 @@ static std::unordered_map<const void*, SEXP> buffer_shelter;
   R_xlen_t min_size = src_offset + length;
   R_xlen_t element_size;
   R_xlen_t actual_size;
+  bool is_16_bit = is_16_bit_floats(src_sexp);
   switch (TYPEOF(src_sexp)) {
     case INTSXP:
     case LGLSXP:
-      element_size = sizeof(int);
-      actual_size = r_length * sizeof(int);
+      element_size = is_16_bit ? sizeof(uint16_t) : sizeof(int);
+      actual_size = r_length * element_size;
       break;
     case REALSXP:
       element_size = sizeof(double);
@@ -259,13 +388,180 @@ static std::unordered_map<const void*, SEXP> buffer_shelter;
     stop("Buffer not long enough for specified arguments");
   }
 
-  auto src = reinterpret_cast<const uint8_t*>(DATAPTR_RO(src_sexp));
   auto dst = reinterpret_cast<uint8_t*>(buffer_xptr->get()->contents());
   int64_t buffer_offset_int = buffer_offset;
   int64_t src_offset_int = src_offset;
+
+  // A lazy mtl_floats is converted straight into the buffer (if the offsets are
+  // aligned) without materializing it
+  if ((src_offset_int % sizeof(float)) == 0 && (buffer_offset_int % sizeof(float)) == 0 &&
+      lazy_floats_copy(src_sexp, src_offset_int / sizeof(float), length / sizeof(float),
+                       reinterpret_cast<float*>(dst + buffer_offset_int))) {
+    return;
+  }
+
+  auto src = reinterpret_cast<const uint8_t*>(DATAPTR_RO(src_sexp));
+
+  if (is_16_bit) {
+    if ((src_offset_int % element_size) != 0 || (buffer_offset_int % element_size) != 0) {
+      stop("Offsets must be a multiple of vector element size");
+    }
+
+    const int* src_payloads = INTEGER_RO(src_sexp) + src_offset_int / element_size;
+    auto dst_payloads = reinterpret_cast<uint16_t*>(dst + buffer_offset_int);
+    floats::narrow_16(src_payloads, dst_payloads, length / element_size);
+    return;
+  }
+
   memcpy(dst + buffer_offset_int, src + src_offset_int, length);
 }
 
+static floats::Storage buffer_storage(const std::string& buffer_type) {
+  if (buffer_type == "float") {
+    return floats::Storage::kFloat;
+  } else if (buffer_type == "half") {
+    return floats::Storage::kHalf;
+  } else if (buffer_type == "bfloat16") {
+    return floats::Storage::kBfloat16;
+  } else {
+    stop("Can't convert directly to or from a buffer of type '%s'", buffer_type.c_str());
+  }
+}
+
+static int64_t storage_element_size(floats::Storage storage) {
+  return storage == floats::Storage::kFloat ? sizeof(float) : sizeof(uint16_t);
+}
+
+// The size of an element of a buffer that can be converted to or from a double
+// vector directly
+static int64_t convert_element_size(const std::string& buffer_type) {
+  if (buffer_type == "uint64") {
+    return sizeof(uint64_t);
+  }
+
+  return storage_element_size(buffer_storage(buffer_type));
+}
+
+// R has no 64-bit integers, so "uint64" elements are converted from whole
+// non-negative numbers (which are exact up to 2^53) and into doubles
+template <typename T>
+static void store_uint64(const T* x, uint64_t* dst, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    double value = x[i];
+    // NA_integer_ is negative and NA_real_ fails every comparison
+    if (!(value >= 0 && value < 18446744073709551616.0 && value == std::trunc(value))) {
+      stop("Can't convert element %d to uint64", static_cast<int>(i + 1));
+    }
+
+    dst[i] = static_cast<uint64_t>(value);
+  }
+}
+
+static void load_uint64(const uint64_t* src, double* x, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    x[i] = static_cast<double>(src[i]);
+  }
+}
+
+// Converts length elements of a logical, integer, or double vector (starting
+// at element src_offset) directly into a "float", "half", "bfloat16", or
+// "uint64" buffer (starting at byte buffer_offset)
+[[cpp11::register]] void cpp_buffer_convert_from(sexp src_sexp, sexp buffer_sexp,
+                                                 std::string buffer_type,
+                                                 double src_offset, double buffer_offset,
+                                                 double length) {
+  int64_t element_size = convert_element_size(buffer_type);
+  if (Rf_isObject(src_sexp)) {
+    stop("Vector type not supported for src");
+  }
+
+  if (src_offset < 0 || buffer_offset < 0 || length < 0) {
+    stop("Invalid src_offset, buffer offset, or length");
+  }
+
+  if ((src_offset + length) > Rf_xlength(src_sexp)) {
+    stop("Vector not long enough for specified arguments");
+  }
+
+  int64_t buffer_offset_int = buffer_offset;
+  if ((buffer_offset_int % element_size) != 0) {
+    stop("Buffer offset must be a multiple of buffer element size");
+  }
+
+  BufferXptr buffer_xptr(buffer_sexp);
+  if ((buffer_offset + length * element_size) > buffer_xptr->get()->length()) {
+    stop("Buffer not long enough for specified arguments");
+  }
+
+  auto dst = reinterpret_cast<uint8_t*>(buffer_xptr->get()->contents());
+  dst += buffer_offset_int;
+  R_xlen_t offset = src_offset;
+  size_t n = length;
+  if (buffer_type == "uint64") {
+    auto dst_uint64 = reinterpret_cast<uint64_t*>(dst);
+    switch (TYPEOF(src_sexp)) {
+      case LGLSXP:
+        store_uint64(LOGICAL_RO(src_sexp) + offset, dst_uint64, n);
+        return;
+      case INTSXP:
+        store_uint64(INTEGER_RO(src_sexp) + offset, dst_uint64, n);
+        return;
+      case REALSXP:
+        store_uint64(REAL_RO(src_sexp) + offset, dst_uint64, n);
+        return;
+      default:
+        stop("Vector type not supported for src");
+    }
+  }
+
+  floats::Storage storage = buffer_storage(buffer_type);
+  switch (TYPEOF(src_sexp)) {
+    case LGLSXP:
+      floats::store_lgl(LOGICAL_RO(src_sexp) + offset, storage, dst, n);
+      break;
+    case INTSXP:
+      floats::store_int(INTEGER_RO(src_sexp) + offset, storage, dst, n);
+      break;
+    case REALSXP:
+      floats::store_dbl(REAL_RO(src_sexp) + offset, storage, dst, n);
+      break;
+    default:
+      stop("Vector type not supported for src");
+  }
+}
+
+// Converts length elements of a "float", "half", "bfloat16", or "uint64" buffer
+// (starting at byte buffer_offset) directly into a double vector
+[[cpp11::register]] sexp cpp_buffer_convert_into(sexp buffer_sexp,
+                                                 std::string buffer_type,
+                                                 double buffer_offset, double length) {
+  int64_t element_size = convert_element_size(buffer_type);
+  if (buffer_offset < 0 || length < 0) {
+    stop("Invalid buffer offset or length");
+  }
+
+  int64_t buffer_offset_int = buffer_offset;
+  if ((buffer_offset_int % element_size) != 0) {
+    stop("Buffer offset must be a multiple of buffer element size");
+  }
+
+  BufferXptr buffer_xptr(buffer_sexp);
+  if ((buffer_offset + length * element_size) > buffer_xptr->get()->length()) {
+    stop("Buffer not long enough for specified arguments");
+  }
+
+  auto src = reinterpret_cast<const uint8_t*>(buffer_xptr->get()->contents());
+  sexp result_sexp = safe[Rf_allocVector](REALSXP, length);
+  if (buffer_type == "uint64") {
+    load_uint64(reinterpret_cast<const uint64_t*>(src + buffer_offset_int),
+                REAL(result_sexp), length);
+  } else {
+    floats::load_dbl(src + buffer_offset_int, buffer_storage(buffer_type),
+                     REAL(result_sexp), length);
+  }
+  return result_sexp;
+}
+
 [[cpp11::register]] sexp cpp_buffer_copy_into(sexp buffer_sexp, sexp ptype,
                                               double buffer_offset, double length) {
   BufferXptr buffer_xptr(buffer_sexp);
@@ -277,6 +573,24 @@ static std::unordered_map<const void*, SEXP> buffer_shelter;
     stop("Buffer not long enough for specified arguments");
   }
 
+  int64_t buffer_offset_int = buffer_offset;
+  auto src = reinterpret_cast<uint8_t*>(buffer_xptr->get()->contents());
+
+  if (is_16_bit_floats(ptype)) {
+    if ((buffer_offset_int % sizeof(uint16_t)) != 0) {
+      stop("Buffer offset must be a multiple of vector element size");
+    }
+
+    sexp result_sexp = writable::integers((R_xlen_t)length / 2);
+    if (Rf_xlength(result_sexp) * 2 != length) {
+      stop("Length must be a multiple of vector element size");
+    }
+
+    auto src_payloads = reinterpret_cast<const uint16_t*>(src + buffer_offset_int);
+    floats::widen_16(src_payloads, INTEGER(result_sexp), Rf_xlength(result_sexp));
+    return result_sexp;
+  }
+
   sexp result_sexp;
   R_xlen_t actual_size;
   switch (TYPEOF(ptype)) {
@@ -304,9 +618,7 @@ static std::unordered_map<const void*, SEXP> buffer_shelter;
     stop("Length must be a multiple of vector element size");
   }
 
-  auto src = reinterpret_cast<uint8_t*>(buffer_xptr->get()->contents());
   auto dst = reinterpret_cast<uint8_t*>(DATAPTR(result_sexp));
-  int64_t buffer_offset_int = buffer_offset;
   memcpy(dst, src + buffer_offset_int, length);
   return result_sexp;
 }
@@ -320,60 +632,620 @@ static std::unordered_map<const void*, SEXP> buffer_shelter;
 
 [[cpp11::register]] sexp cpp_command_queue(sexp device_sexp) {
   DeviceXPtr device_xptr(device_sexp);
-  CommandQueueXptr command_queue_xptr(device_xptr->get()->newCommandQueue());
+  CommandQueueXptr command_queue_xptr(device_xptr->get()->new_command_queue());
   return (SEXP)command_queue_xptr;
 }
 
-[[cpp11::register]] sexp cpp_compute_pipeline(sexp function_sexp) {
+[[cpp11::register]] sexp cpp_device_command_queue(sexp device_sexp) {
+  DeviceXPtr device_xptr(device_sexp);
+  backend::CommandQueue* queue = device_xptr->get()->command_queue();
+  queue->retain();
+  CommandQueueXptr command_queue_xptr(queue);
+  return (SEXP)command_queue_xptr;
+}
+
+// Resolves an mtl_command_queue or an mtl_device (whose persistent queue is
+// used) without allocating a new external pointer
+static backend::CommandQueue* command_queue_from_sexp(sexp queue_or_device_sexp) {
+  if (Rf_inherits(queue_or_device_sexp, "mtl_device")) {
+    DeviceXPtr device_xptr(queue_or_device_sexp);
+    return device_xptr->get()->command_queue();
+  }
+
+  CommandQueueXptr command_queue_xptr(queue_or_device_sexp);
+  return command_queue_xptr->get();
+}
+
+[[cpp11::register]] sexp cpp_compute_pipeline(sexp function_sexp,
+                                              std::string tuning_cache_dir) {
   FunctionXptr function_xptr(function_sexp);
-  NS::Error* error = nullptr;
-  MTL::Device* device = function_xptr->get()->device();
-  MTL::ComputePipelineState* pipeline =
-      device->newComputePipelineState(function_xptr->get(), &error);
+  std::string error;
+  backend::Device* device = function_xptr->get()->device();
+  device->tuning_cache()->set_directory(tuning_cache_dir);
+  backend::ComputePipeline* pipeline =
+      device->new_compute_pipeline(function_xptr->get(), &error);
   if (pipeline == nullptr) {
-    const char* description = error->localizedDescription()->utf8String();
-    stop("Error creating compute pipeline:\n%s", description);
+    stop("Error creating compute pipeline:\n%s", error.c_str());
   }
 
   ComputePipelineXptr pipeline_xptr(pipeline);
   return (SEXP)pipeline_xptr;
 }
 
-[[cpp11::register]] void cpp_compute_pipeline_execute(sexp pipeline_sexp,
-                                                      sexp commmand_queue_sexp,
-                                                      list args,
-                                                      double array_length_dbl) {
+[[cpp11::register]] list cpp_compute_pipeline_info(sexp pipeline_sexp) {
+  ComputePipelineXptr pipeline_xptr(pipeline_sexp);
+  backend::ComputePipeline* pipeline = pipeline_xptr->get();
+  writable::list out = {as_sexp((double)pipeline->max_total_threads_per_threadgroup()),
+                        as_sexp((double)pipeline->thread_execution_width())};
+  out.names() = {"max_total_threads_per_threadgroup", "thread_execution_width"};
+  return out;
+}
+
+[[cpp11::register]] list cpp_pipeline_cache_info(sexp device_sexp) {
+  DeviceXPtr device_xptr(device_sexp);
+  backend::PipelineCacheStats stats = device_xptr->get()->pipeline_cache()->stats();
+
+  writable::list out = {as_sexp((double)stats.size), as_sexp((double)stats.capacity),
+                        as_sexp((double)stats.hits), as_sexp((double)stats.misses),
+                        as_sexp((double)stats.evictions)};
+  out.names() = {"size", "capacity", "hits", "misses", "evictions"};
+  return out;
+}
+
+[[cpp11::register]] void cpp_pipeline_cache_set_capacity(sexp device_sexp,
+                                                         double capacity) {
+  if (capacity < 0) {
+    stop("Invalid capacity");
+  }
+
+  DeviceXPtr device_xptr(device_sexp);
+  device_xptr->get()->pipeline_cache()->set_capacity(capacity);
+}
+
+[[cpp11::register]] void cpp_pipeline_cache_clear(sexp device_sexp) {
+  DeviceXPtr device_xptr(device_sexp);
+  device_xptr->get()->pipeline_cache()->clear();
+}
+
+// Grids and threadgroups are numeric vectors of one to three dimensions
+static backend::Size size_from_dims(doubles dims, const char* what) {
+  if (dims.size() < 1 || dims.size() > 3) {
+    stop("%s must have 1, 2, or 3 dimensions", what);
+  }
+
+  size_t values[3] = {1, 1, 1};
+  for (R_xlen_t i = 0; i < dims.size(); i++) {
+    double value = dims[i];
+    if (!(value >= 0) || value != std::floor(value)) {
+      stop("%s dimensions must be non-negative whole numbers", what);
+    }
+
+    values[i] = value;
+  }
+
+  return backend::Size::Make(values[0], values[1], values[2]);
+}
+
+// 1D grids use threadgroups that are as large as possible. 2D and 3D grids use
+// rows that are one SIMD group wide stacked up to the maximum number of threads.
+static backend::Size default_threadgroup(backend::ComputePipeline* pipeline,
+                                         const backend::Size& grid, R_xlen_t n_dims) {
+  size_t max_threads = pipeline->max_total_threads_per_threadgroup();
+  if (n_dims == 1) {
+    return backend::Size::Make(std::min(max_threads, grid.width));
+  }
+
+  size_t width = std::min(pipeline->thread_execution_width(), grid.width);
+  size_t height = std::min(max_threads / width, grid.height);
+  size_t depth = std::min(max_threads / (width * height), grid.depth);
+  return backend::Size::Make(width, height, depth);
+}
+
+// A dispatch of pipeline over a grid of threads with everything but the
+// threadgroup. Each argument is an mtl_buffer, an mtl_scalar, or NULL.
+static backend::Dispatch make_dispatch(sexp pipeline_sexp, list args,
+                                       doubles grid_dims) {
   ComputePipelineXptr pipeline_xptr(pipeline_sexp);
-  CommandQueueXptr command_queue_xptr(commmand_queue_sexp);
 
-  MTL::CommandBuffer* command_buffer = command_queue_xptr->get()->commandBuffer();
-  Owner<MTL::CommandBuffer> command_buffer_owner(command_buffer);
-  MTL::ComputeCommandEncoder* command_encoder = command_buffer->computeCommandEncoder();
-  Owner<MTL::ComputeCommandEncoder> command_encoder_owner(command_encoder);
-  command_encoder->setComputePipelineState(pipeline_xptr->get());
+  backend::Dispatch dispatch;
+  dispatch.pipeline = pipeline_xptr->get();
 
   for (R_xlen_t i = 0; i < args.size(); i++) {
     SEXP item = args[i];
+    dispatch.bytes.emplace_back();
     if (item == R_NilValue) {
+      dispatch.buffers.push_back(nullptr);
+      continue;
+    }
+
+    // An mtl_scalar is a raw vector of the bytes to pass by value
+    if (TYPEOF(item) == RAWSXP) {
+      R_xlen_t size = Rf_xlength(item);
+      if (size == 0 || size > (R_xlen_t)backend::kMaxInlineBytes) {
+        stop("Argument %d must be between 1 and %d bytes to pass by value (use a buffer)",
+             (int)i + 1, (int)backend::kMaxInlineBytes);
+      }
+
+      dispatch.buffers.push_back(nullptr);
+      dispatch.bytes.back().assign(reinterpret_cast<const char*>(RAW(item)), size);
       continue;
     }
 
     BufferXptr buffer_xptr(item);
-    command_encoder->setBuffer(buffer_xptr->get(), 0, i);
+    dispatch.buffers.push_back(buffer_xptr->get());
+  }
+
+  dispatch.grid = size_from_dims(grid_dims, "Grid");
+  return dispatch;
+}
+
+// Uses the threadgroup and chunk size that were tuned for the dispatch's
+// pipeline and a grid in the same size bucket, if there are any
+static bool apply_tuning(backend::Dispatch* dispatch) {
+  backend::TuningCache* tuning_cache = dispatch->pipeline->tuning_cache();
+  backend::Tuning tuning;
+  if (tuning_cache == nullptr ||
+      !tuning_cache->get(dispatch->pipeline, dispatch->grid, &tuning)) {
+    return false;
+  }
+
+  // A grid in the same size bucket can be smaller than the grid it was tuned for
+  const backend::Size& grid = dispatch->grid;
+  dispatch->threadgroup =
+      backend::Size::Make(std::min(tuning.threadgroup.width, grid.width),
+                          std::min(tuning.threadgroup.height, grid.height),
+                          std::min(tuning.threadgroup.depth, grid.depth));
+  dispatch->chunk_size = tuning.chunk_size;
+  return true;
+}
+
+// Encodes a dispatch into command_buffer, which retains the pipeline and
+// buffers until it is released. A zero-length threadgroup uses the tuned
+// threadgroup for this pipeline and grid (see mtl_compute_pipeline_tune()) or
+// default_threadgroup().
+static void encode_dispatch(backend::CommandBuffer* command_buffer, sexp pipeline_sexp,
+                            list args, doubles grid_dims, doubles threadgroup_dims) {
+  backend::Dispatch dispatch = make_dispatch(pipeline_sexp, args, grid_dims);
+  backend::ComputePipeline* pipeline = dispatch.pipeline;
+  if (threadgroup_dims.size() > 0) {
+    dispatch.threadgroup = size_from_dims(threadgroup_dims, "Threadgroup");
+    size_t max_threads = pipeline->max_total_threads_per_threadgroup();
+    if (dispatch.threadgroup.count() == 0) {
+      stop("Threadgroup dimensions must be non-zero");
+    } else if (dispatch.threadgroup.count() > max_threads) {
+      stop("Threadgroup of %d threads exceeds the maximum of %d for this pipeline",
+           (int)dispatch.threadgroup.count(), (int)max_threads);
+    }
+
+    // Valid (Metal supports any threadgroup shape), but the last SIMD group of
+    // every threadgroup runs with idle lanes
+    size_t execution_width = pipeline->thread_execution_width();
+    if (dispatch.threadgroup.count() % execution_width != 0) {
+      warning("Threadgroup of %d threads isn't a multiple of the thread execution "
+              "width (%d) for this pipeline",
+              (int)dispatch.threadgroup.count(), (int)execution_width);
+    }
+  }
+
+  if (dispatch.grid.count() == 0) {
+    return;
+  }
+
+  if (threadgroup_dims.size() == 0 && !apply_tuning(&dispatch)) {
+    dispatch.threadgroup = default_threadgroup(pipeline, dispatch.grid, grid_dims.size());
+  }
+
+  std::string error;
+  if (!command_buffer->encode(dispatch, &error)) {
+    stop("Error encoding compute pipeline:\n%s", error.c_str());
+  }
+}
+
+static backend::CommandBuffer* encode_compute_pipeline(sexp pipeline_sexp,
+                                                       sexp commmand_queue_sexp,
+                                                       list args, doubles grid,
+                                                       doubles threadgroup) {
+  backend::CommandQueue* command_queue = command_queue_from_sexp(commmand_queue_sexp);
+  Owner<backend::CommandBuffer> command_buffer(
+      command_queue->new_command_buffer(backend::DispatchType::Serial));
+  encode_dispatch(command_buffer.get(), pipeline_sexp, args, grid, threadgroup);
+
+  backend::CommandBuffer* out = command_buffer.get();
+  out->retain();
+  return out;
+}
+
+static void wait_for_command_buffer(backend::CommandBuffer* command_buffer) {
+  command_buffer->wait_until_completed();
+
+  std::string error = command_buffer->error();
+  if (!error.empty()) {
+    stop("Error executing compute pipeline:\n%s", error.c_str());
+  }
+}
+
+[[cpp11::register]] void cpp_compute_pipeline_execute(sexp pipeline_sexp,
+                                                      sexp commmand_queue_sexp,
+                                                      list args, doubles grid,
+                                                      doubles threadgroup) {
+  Owner<backend::CommandBuffer> command_buffer(encode_compute_pipeline(
+      pipeline_sexp, commmand_queue_sexp, args, grid, threadgroup));
+
+  command_buffer.get()->commit();
+  wait_for_command_buffer(command_buffer.get());
+}
+
+[[cpp11::register]] sexp cpp_compute_pipeline_execute_async(sexp pipeline_sexp,
+                                                            sexp commmand_queue_sexp,
+                                                            list args, doubles grid,
+                                                            doubles threadgroup) {
+  CommandBufferXptr command_buffer_xptr(encode_compute_pipeline(
+      pipeline_sexp, commmand_queue_sexp, args, grid, threadgroup));
+  command_buffer_xptr->get()->commit();
+  return (SEXP)command_buffer_xptr;
+}
+
+// Times a dispatch with each candidate threadgroup (see tuning_candidates())
+// and saves the fastest in the device's tuning cache. Returns the timings as
+// the columns of a data frame.
+[[cpp11::register]] list cpp_compute_pipeline_tune(sexp pipeline_sexp,
+                                                   sexp commmand_queue_sexp, list args,
+                                                   doubles grid, int reps) {
+  if (reps < 1) {
+    stop("reps must be at least 1");
+  }
+
+  backend::Dispatch dispatch = make_dispatch(pipeline_sexp, args, grid);
+  backend::TuningCache* tuning_cache = dispatch.pipeline->tuning_cache();
+  if (tuning_cache == nullptr) {
+    stop("Compute pipeline was not created by mtl_compute_pipeline()");
+  } else if (dispatch.grid.count() == 0) {
+    stop("Can't tune a dispatch over an empty grid");
+  }
+
+  backend::CommandQueue* command_queue = command_queue_from_sexp(commmand_queue_sexp);
+  std::vector<backend::Tuning> timings;
+  std::string error;
+  if (!backend::tune_dispatch(command_queue, dispatch, grid.size(), reps, &timings,
+                              &error)) {
+    stop("Error tuning compute pipeline:\n%s", error.c_str());
+  }
+
+  R_xlen_t n = timings.size();
+  writable::doubles width(n), height(n), depth(n), chunk_size(n), seconds(n);
+  size_t best = 0;
+  for (R_xlen_t i = 0; i < n; i++) {
+    width[i] = timings[i].threadgroup.width;
+    height[i] = timings[i].threadgroup.height;
+    depth[i] = timings[i].threadgroup.depth;
+    chunk_size[i] = timings[i].chunk_size;
+    seconds[i] = timings[i].seconds;
+    if (timings[i].seconds < timings[best].seconds) {
+      best = i;
+    }
+  }
+
+  tuning_cache->put(dispatch.pipeline, dispatch.grid, timings[best]);
+
+  writable::list out = {width, height, depth, chunk_size, seconds};
+  out.names() = {"width", "height", "depth", "chunk_size", "seconds"};
+  return out;
+}
+
+[[cpp11::register]] list cpp_tuning_cache_info(sexp device_sexp) {
+  DeviceXPtr device_xptr(device_sexp);
+  backend::TuningCache* cache = device_xptr->get()->tuning_cache();
+  backend::TuningCacheStats stats = cache->stats();
+  std::string directory = cache->directory();
+
+  writable::list out = {as_sexp((double)stats.hits), as_sexp((double)stats.size),
+                        directory.empty() ? R_NilValue : as_sexp(directory.c_str())};
+  out.names() = {"hits", "tunings", "directory"};
+  return out;
+}
+
+[[cpp11::register]] void cpp_tuning_cache_clear(sexp device_sexp) {
+  DeviceXPtr device_xptr(device_sexp);
+  device_xptr->get()->tuning_cache()->clear();
+}
+
+// Reduces the elements of a "float", "half", "int32", or "double" buffer (see
+// reduce.h). Returns the result for the non-NA elements along with the number
+// of them and the number of NAs.
+[[cpp11::register]] list cpp_buffer_reduce(sexp buffer_sexp, std::string buffer_type,
+                                           std::string op, sexp device_sexp,
+                                           sexp commmand_queue_sexp) {
+  backend::ReduceElement element;
+  size_t element_size;
+  if (buffer_type == "float") {
+    element = backend::ReduceElement::Float;
+    element_size = sizeof(float);
+  } else if (buffer_type == "half") {
+    element = backend::ReduceElement::Half;
+    element_size = sizeof(uint16_t);
+  } else if (buffer_type == "int32") {
+    element = backend::ReduceElement::Int32;
+    element_size = sizeof(int32_t);
+  } else if (buffer_type == "double") {
+    element = backend::ReduceElement::Double;
+    element_size = sizeof(double);
+  } else {
+    stop("Can't reduce a buffer of type '%s'", buffer_type.c_str());
+  }
+
+  backend::ReduceOp reduce_op;
+  if (op == "sum") {
+    reduce_op = backend::ReduceOp::Sum;
+  } else if (op == "mean") {
+    reduce_op = backend::ReduceOp::Mean;
+  } else if (op == "var") {
+    reduce_op = backend::ReduceOp::Var;
+  } else if (op == "min") {
+    reduce_op = backend::ReduceOp::Min;
+  } else if (op == "max") {
+    reduce_op = backend::ReduceOp::Max;
+  } else {
+    stop("Unknown reduction '%s'", op.c_str());
+  }
+
+  DeviceXPtr device_xptr(device_sexp);
+  BufferXptr buffer_xptr(buffer_sexp);
+  backend::Buffer* buffer = buffer_xptr->get();
+  backend::CommandQueue* command_queue = command_queue_from_sexp(commmand_queue_sexp);
+
+  backend::ReduceState state;
+  std::string error;
+  if (!backend::reduce_buffer(device_xptr->get(), command_queue, buffer, element,
+                              reduce_op, buffer->length() / element_size, &state,
+                              &error)) {
+    stop("Error reducing buffer:\n%s", error.c_str());
+  }
+
+  double value = backend::reduce_value(reduce_op, element, state);
+  writable::list out = {as_sexp(value), as_sexp((double)state.count),
+                        as_sexp((double)state.na), as_sexp((double)state.nan)};
+  out.names() = {"value", "count", "na", "nan"};
+  return out;
+}
+
+// Replaces the elements of an "int32" or "float" buffer with their inclusive or
+// exclusive prefix sums (see scan.h)
+[[cpp11::register]] void cpp_buffer_scan(sexp buffer_sexp, std::string buffer_type,
+                                         bool exclusive, sexp device_sexp,
+                                         sexp commmand_queue_sexp) {
+  backend::ScanElement element;
+  if (buffer_type == "float") {
+    element = backend::ScanElement::Float;
+  } else if (buffer_type == "int32") {
+    element = backend::ScanElement::Int32;
+  } else {
+    stop("Can't scan a buffer of type '%s'", buffer_type.c_str());
+  }
+
+  DeviceXPtr device_xptr(device_sexp);
+  BufferXptr buffer_xptr(buffer_sexp);
+  backend::Buffer* buffer = buffer_xptr->get();
+  backend::CommandQueue* command_queue = command_queue_from_sexp(commmand_queue_sexp);
+
+  std::string error;
+  if (!backend::scan_buffer(device_xptr->get(), command_queue, buffer, element,
+                            exclusive, buffer->length() / sizeof(float), &error)) {
+    stop("Error scanning buffer:\n%s", error.c_str());
+  }
+}
+
+// Writes the m x n product of the column-major "float" or "half" buffers a_sexp
+// (m x k) and b_sexp (k x n) into the "float" buffer out_sexp (see matmul.h)
+[[cpp11::register]] void cpp_buffer_matmul(sexp a_sexp, sexp b_sexp,
+                                           std::string buffer_type, double m, double k,
+                                           double n, sexp out_sexp, sexp device_sexp,
+                                           sexp commmand_queue_sexp) {
+  backend::MatmulElement element;
+  size_t element_size;
+  if (buffer_type == "float") {
+    element = backend::MatmulElement::Float;
+    element_size = sizeof(float);
+  } else if (buffer_type == "half") {
+    element = backend::MatmulElement::Half;
+    element_size = sizeof(uint16_t);
+  } else {
+    stop("Can't multiply buffers of type '%s'", buffer_type.c_str());
+  }
+
+  if (m < 0 || k < 0 || n < 0) {
+    stop("Invalid matrix dimensions");
+  }
+
+  DeviceXPtr device_xptr(device_sexp);
+  BufferXptr a_xptr(a_sexp);
+  BufferXptr b_xptr(b_sexp);
+  BufferXptr out_xptr(out_sexp);
+  size_t m_int = m;
+  size_t k_int = k;
+  size_t n_int = n;
+  if (a_xptr->get()->length() < m_int * k_int * element_size ||
+      b_xptr->get()->length() < k_int * n_int * element_size) {
+    stop("Buffer not long enough for specified dimensions");
+  }
+
+  if (out_xptr->get()->length() < m_int * n_int * sizeof(float)) {
+    stop("Output buffer not long enough for specified dimensions");
+  }
+
+  backend::CommandQueue* command_queue = command_queue_from_sexp(commmand_queue_sexp);
+  std::string error;
+  if (!backend::matmul_buffers(device_xptr->get(), command_queue, a_xptr->get(),
+                               b_xptr->get(), element, m_int, k_int, n_int,
+                               out_xptr->get(), &error)) {
+    stop("Error multiplying buffers:\n%s", error.c_str());
+  }
+}
+
+static backend::SortKey sort_key(const std::string& buffer_type) {
+  if (buffer_type == "int32") {
+    return backend::SortKey::Int32;
+  } else if (buffer_type == "float") {
+    return backend::SortKey::Float;
+  } else if (buffer_type == "uint64") {
+    return backend::SortKey::UInt64;
+  } else {
+    stop("Can't sort a buffer of type '%s'", buffer_type.c_str());
+  }
+}
+
+static size_t sort_key_size(backend::SortKey key) {
+  return key == backend::SortKey::UInt64 ? sizeof(uint64_t) : sizeof(uint32_t);
+}
+
+// Sorts the elements of an "int32", "float", or "uint64" buffer in place along
+// with the first elements of payload_sexp (if it isn't NULL), which have
+// payload_size bytes (see sort.h)
+[[cpp11::register]] void cpp_buffer_sort(sexp buffer_sexp, std::string buffer_type,
+                                         sexp payload_sexp, int payload_size,
+                                         sexp device_sexp, sexp commmand_queue_sexp) {
+  backend::SortKey key = sort_key(buffer_type);
+  DeviceXPtr device_xptr(device_sexp);
+  BufferXptr buffer_xptr(buffer_sexp);
+  backend::Buffer* buffer = buffer_xptr->get();
+  size_t n = buffer->length() / sort_key_size(key);
+
+  backend::Buffer* payload = nullptr;
+  if (payload_sexp != R_NilValue) {
+    BufferXptr payload_xptr(payload_sexp);
+    payload = payload_xptr->get();
+    if (payload->length() < n * payload_size) {
+      stop("Payload buffer not long enough for %d elements", static_cast<int>(n));
+    }
+  }
+
+  backend::CommandQueue* command_queue = command_queue_from_sexp(commmand_queue_sexp);
+  std::string error;
+  if (!backend::sort_buffer(device_xptr->get(), command_queue, buffer, key, payload,
+                            payload_size, n, &error)) {
+    stop("Error sorting buffer:\n%s", error.c_str());
+  }
+}
+
+// Writes the 1-based indices that sort the elements of an "int32", "float", or
+// "uint64" buffer into the "int32" buffer out_sexp
+[[cpp11::register]] void cpp_buffer_order(sexp buffer_sexp, std::string buffer_type,
+                                          sexp out_sexp, sexp device_sexp,
+                                          sexp commmand_queue_sexp) {
+  backend::SortKey key = sort_key(buffer_type);
+  DeviceXPtr device_xptr(device_sexp);
+  BufferXptr buffer_xptr(buffer_sexp);
+  BufferXptr out_xptr(out_sexp);
+  size_t n = buffer_xptr->get()->length() / sort_key_size(key);
+  if (out_xptr->get()->length() < n * sizeof(int32_t)) {
+    stop("Output buffer not long enough for %d elements", static_cast<int>(n));
+  }
+
+  backend::CommandQueue* command_queue = command_queue_from_sexp(commmand_queue_sexp);
+  std::string error;
+  if (!backend::order_buffer(device_xptr->get(), command_queue, buffer_xptr->get(), key,
+                             n, out_xptr->get(), &error)) {
+    stop("Error ordering buffer:\n%s", error.c_str());
+  }
+}
+
+// Writes the result of an expression for the first n elements of the "float"
+// buffers in inputs into out_sexp. The expression is a postfix program of ops
+// (see fusion.h), where the operand of an "input" or "scalar" is its 0-based
+// index and the operand of a "constant" is its value.
+[[cpp11::register]] void cpp_buffer_eval(strings ops, doubles operands, list inputs,
+                                         doubles scalars, double n, sexp out_sexp,
+                                         sexp device_sexp, sexp commmand_queue_sexp) {
+  std::vector<backend::EvalInstruction> program(ops.size());
+  for (R_xlen_t i = 0; i < ops.size(); i++) {
+    std::string name = ops[i];
+    if (!backend::eval_op_from_name(name, &program[i].op)) {
+      stop("Can't fuse operator '%s'", name.c_str());
+    }
+
+    if (program[i].op == backend::EvalOp::Constant) {
+      float value = operands[i];
+      std::memcpy(&program[i].operand, &value, sizeof(float));
+    } else {
+      program[i].operand = operands[i];
+    }
+  }
+
+  DeviceXPtr device_xptr(device_sexp);
+  BufferXptr out_xptr(out_sexp);
+  size_t n_int = n;
+  if (out_xptr->get()->length() < n_int * sizeof(float)) {
+    stop("Output buffer not long enough for %d elements", static_cast<int>(n_int));
+  }
+
+  std::vector<backend::Buffer*> input_buffers;
+  for (R_xlen_t i = 0; i < inputs.size(); i++) {
+    BufferXptr input_xptr(inputs[i]);
+    if (input_xptr->get()->length() < n_int * sizeof(float)) {
+      stop("Buffer not long enough for %d elements", static_cast<int>(n_int));
+    }
+
+    input_buffers.push_back(input_xptr->get());
+  }
+
+  std::vector<float> scalar_values;
+  for (double scalar : scalars) {
+    scalar_values.push_back(scalar);
   }
 
-  NS::UInteger array_length = array_length_dbl;
-  MTL::Size grid_size = MTL::Size::Make(array_length, 1, 1);
-  NS::UInteger thread_group_size_n =
-      pipeline_xptr->get()->maxTotalThreadsPerThreadgroup();
-  if (thread_group_size_n > array_length) {
-    thread_group_size_n = array_length;
+  backend::CommandQueue* command_queue = command_queue_from_sexp(commmand_queue_sexp);
+  std::string error;
+  if (!backend::eval_buffers(device_xptr->get(), command_queue, program, input_buffers,
+                             scalar_values, n_int, out_xptr->get(), &error)) {
+    stop("Error evaluating expression:\n%s", error.c_str());
   }
+}
+
+[[cpp11::register]] void cpp_pending_wait(sexp pending_sexp) {
+  CommandBufferXptr command_buffer_xptr(pending_sexp);
+  command_buffer_xptr->get()->wait_until_completed();
+}
 
-  MTL::Size thread_group_size = MTL::Size::Make(thread_group_size_n, 1, 1);
+[[cpp11::register]] bool cpp_pending_is_done(sexp pending_sexp) {
+  CommandBufferXptr command_buffer_xptr(pending_sexp);
+  return command_buffer_xptr->get()->is_completed();
+}
+
+[[cpp11::register]] sexp cpp_pending_error(sexp pending_sexp) {
+  CommandBufferXptr command_buffer_xptr(pending_sexp);
+  std::string error = command_buffer_xptr->get()->error();
+  if (error.empty()) {
+    return R_NilValue;
+  }
+
+  return as_sexp(error.c_str());
+}
+
+// Encodes every step of an mtl_command_batch into one command buffer. Each step
+// is a list(pipeline, args, grid, threadgroup) or NULL for a barrier.
+[[cpp11::register]] sexp cpp_command_batch_commit(sexp commmand_queue_sexp, list steps,
+                                                  bool concurrent, bool wait) {
+  backend::CommandQueue* command_queue = command_queue_from_sexp(commmand_queue_sexp);
+  backend::DispatchType dispatch_type =
+      concurrent ? backend::DispatchType::Concurrent : backend::DispatchType::Serial;
+  CommandBufferXptr command_buffer_xptr(command_queue->new_command_buffer(dispatch_type));
+  backend::CommandBuffer* command_buffer = command_buffer_xptr->get();
+
+  for (R_xlen_t i = 0; i < steps.size(); i++) {
+    SEXP step = steps[i];
+    if (step == R_NilValue) {
+      command_buffer->barrier();
+      continue;
+    }
+
+    list step_list(step);
+    encode_dispatch(command_buffer, step_list[0], step_list[1], step_list[2],
+                    step_list[3]);
+  }
 
-  command_encoder->dispatchThreads(grid_size, thread_group_size);
-  command_encoder->endEncoding();
   command_buffer->commit();
-  command_buffer->waitUntilCompleted();
+  if (wait) {
+    wait_for_command_buffer(command_buffer);
+  }
+
+  return (SEXP)command_buffer_xptr;
 }
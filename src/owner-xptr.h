@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cpp11.hpp>
+
+#include "backend.h"
+
+// R owns backend objects through external pointers to an Owner<T>, which
+// releases the object when the external pointer is garbage collected. The
+// class of each external pointer is used to check the type of objects passed
+// back from R.
+template <typename T>
+const char* owner_xptr_classname();
+
+template <>
+inline const char* owner_xptr_classname<backend::Device>() {
+  return "mtl_device";
+}
+
+template <>
+inline const char* owner_xptr_classname<backend::Library>() {
+  return "mtl_library";
+}
+
+template <>
+inline const char* owner_xptr_classname<backend::Function>() {
+  return "mtl_function";
+}
+
+template <>
+inline const char* owner_xptr_classname<backend::ComputePipeline>() {
+  return "mtl_compute_pipeline";
+}
+
+template <>
+inline const char* owner_xptr_classname<backend::CommandQueue>() {
+  return "mtl_command_queue";
+}
+
+template <>
+inline const char* owner_xptr_classname<backend::CommandBuffer>() {
+  return "mtl_pending";
+}
+
+template <>
+inline const char* owner_xptr_classname<backend::Buffer>() {
+  return "mtl_buffer";
+}
+
+template <typename T>
+class Owner {
+ public:
+  Owner() : ptr_(nullptr) {}
+  Owner(T* ptr) : ptr_(ptr) {}
+
+  void reset(T* ptr) {
+    if (ptr_ != nullptr) {
+      ptr_->release();
+    }
+    ptr_ = ptr;
+  }
+
+  T* get() { return ptr_; }
+
+  ~Owner() { reset(nullptr); }
+
+ private:
+  T* ptr_;
+};
+
+template <typename T>
+class OwnerXPtr : public cpp11::external_pointer<Owner<T>> {
+ public:
+  OwnerXPtr(T* ptr) : cpp11::external_pointer<Owner<T>>(new Owner<T>(ptr)) {
+    cpp11::sexp xptr_sexp = (SEXP)(*this);
+    xptr_sexp.attr("class") = owner_xptr_classname<T>();
+  }
+
+  OwnerXPtr(cpp11::sexp xptr) : cpp11::external_pointer<Owner<T>>(xptr) {
+    if (!Rf_inherits(xptr, owner_xptr_classname<T>())) {
+      cpp11::stop("external pointer does not inherit from '%s'", owner_xptr_classname<T>());
+    }
+  }
+};
+
+using DeviceXPtr = OwnerXPtr<backend::Device>;
+using LibraryXPtr = OwnerXPtr<backend::Library>;
+using FunctionXptr = OwnerXPtr<backend::Function>;
+using ComputePipelineXptr = OwnerXPtr<backend::ComputePipeline>;
+using CommandQueueXptr = OwnerXPtr<backend::CommandQueue>;
+using CommandBufferXptr = OwnerXPtr<backend::CommandBuffer>;
+using BufferXptr = OwnerXPtr<backend::Buffer>;
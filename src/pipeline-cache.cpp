@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "pipeline-cache.h"
+#include "tuning-cache.h"
+
+namespace backend {
+
+ComputePipeline* PipelineCache::get(Device* device, Function* function,
+                                    std::string* error) {
+  CompiledLibrary* compiled = function->compiled_library();
+  char identity[32];
+  snprintf(identity, sizeof(identity), "%p", static_cast<void*>(compiled));
+  std::string key = std::string(identity) + '\0' + function->name() + '\0' +
+                    function->specialization_key();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto item = index_.find(key);
+  if (item != index_.end()) {
+    hits_++;
+    entries_.splice(entries_.begin(), entries_, item->second);
+    ComputePipeline* pipeline = item->second->pipeline;
+    pipeline->retain();
+    return pipeline;
+  }
+
+  misses_++;
+  ComputePipeline* pipeline = device->compile_compute_pipeline(function, error);
+  if (pipeline == nullptr) {
+    return nullptr;
+  }
+
+  if (capacity_ == 0) {
+    return pipeline;
+  }
+
+  evict_locked(capacity_ - 1);
+  compiled->retain();
+  pipeline->retain();
+  entries_.push_front(Entry{key, compiled, pipeline});
+  index_[key] = entries_.begin();
+  return pipeline;
+}
+
+void PipelineCache::set_capacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = capacity;
+  evict_locked(capacity_);
+}
+
+void PipelineCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t evictions = evictions_;
+  evict_locked(0);
+  evictions_ = evictions;
+}
+
+PipelineCacheStats PipelineCache::stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return PipelineCacheStats{entries_.size(), capacity_, hits_, misses_, evictions_};
+}
+
+void PipelineCache::evict_locked(size_t size) {
+  while (entries_.size() > size) {
+    Entry& entry = entries_.back();
+    index_.erase(entry.key);
+    entry.pipeline->release();
+    entry.compiled->release();
+    entries_.pop_back();
+    evictions_++;
+  }
+}
+
+// Each constant is written as name=type:bytes (in hex), sorted by name
+std::string FunctionConstants::key() const {
+  std::vector<std::string> parts;
+  for (const FunctionConstant& constant : constants_) {
+    int type = static_cast<int>(constant.type);
+    std::string part = constant.name + '=' + std::to_string(type) + ':';
+    for (unsigned char byte : constant.bytes) {
+      char hex[3];
+      snprintf(hex, sizeof(hex), "%02x", byte);
+      part += hex;
+    }
+
+    parts.push_back(part);
+  }
+
+  std::sort(parts.begin(), parts.end());
+  std::string out;
+  for (const std::string& part : parts) {
+    out += (out.empty() ? "" : ",") + part;
+  }
+
+  return out;
+}
+
+PipelineCache* Device::pipeline_cache() {
+  if (!pipeline_cache_) {
+    pipeline_cache_ = std::make_shared<PipelineCache>(PipelineCache::kDefaultCapacity);
+  }
+
+  return pipeline_cache_.get();
+}
+
+ComputePipeline* Device::new_compute_pipeline(Function* function, std::string* error) {
+  ComputePipeline* pipeline = pipeline_cache()->get(this, function, error);
+  if (pipeline != nullptr && pipeline->tuning_cache() == nullptr) {
+    tuning_cache();
+    pipeline->set_tuning_cache(TuningCache::function_key(function), tuning_cache_);
+  }
+
+  return pipeline;
+}
+
+}  // namespace backend
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "backend.h"
+
+// Caches the compute pipelines created by a device, which are expensive to
+// create, so that creating a pipeline for the same function again is a hash
+// lookup. Functions are identified by the compiled library they were created
+// from, their name, and their specialization key; each entry retains its
+// compiled library so that its address can't be reused by another one while
+// it is in the cache. The least recently used entries are evicted when there
+// are more than capacity entries.
+namespace backend {
+
+struct PipelineCacheStats {
+  size_t size;
+  size_t capacity;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+};
+
+class PipelineCache {
+ public:
+  explicit PipelineCache(size_t capacity)
+      : capacity_(capacity), hits_(0), misses_(0), evictions_(0) {}
+
+  ~PipelineCache() { clear(); }
+
+  // Returns a retained pipeline, compiling it with device on a miss
+  ComputePipeline* get(Device* device, Function* function, std::string* error);
+
+  void set_capacity(size_t capacity);
+  void clear();
+  PipelineCacheStats stats();
+
+  static constexpr size_t kDefaultCapacity = 128;
+
+ private:
+  struct Entry {
+    std::string key;
+    CompiledLibrary* compiled;
+    ComputePipeline* pipeline;
+  };
+
+  std::mutex mutex_;
+  size_t capacity_;
+  size_t hits_;
+  size_t misses_;
+  size_t evictions_;
+
+  // Most recently used first
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+
+  void evict_locked(size_t size);
+};
+
+}  // namespace backend
@@ -0,0 +1,500 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "backend-cpu.h"
+#include "builtin-kernels.h"
+#include "float-convert.h"
+#include "reduce.h"
+
+namespace backend {
+
+static_assert(sizeof(ReducePartial) == 24, "ReducePartial must match the Metal source");
+
+// Each threadgroup reduces one contiguous block of the buffer: every thread
+// reduces a strided slice of the block (so that neighbouring threads read
+// neighbouring elements) and the threads' partials are merged with a tree in
+// threadgroup memory. Threadgroups must have a power of two of at most
+// kMaxThreads (the size of the scratch array) threads.
+static const char* kReduceSource = R"(
+#include <metal_stdlib>
+using namespace metal;
+
+constant uint op [[function_constant(0)]];
+
+constant uint kVar = 2;
+constant uint kMin = 3;
+constant uint kMax = 4;
+
+struct Partial {
+  uint count;
+  uint na;
+  float a;
+  float b;
+  long exact;
+};
+
+static bool is_na(float value) { return isnan(value); }
+static bool is_na(half value) { return isnan(value); }
+static bool is_na(int value) { return value == int(0x80000000); }
+
+static Partial push(Partial p, float value) {
+  p.count++;
+  if (op == kVar) {
+    float delta = value - p.a;
+    p.a += delta / float(p.count);
+    p.b += delta * (value - p.a);
+  } else if (op == kMin) {
+    p.a = p.count == 1 ? value : min(p.a, value);
+  } else if (op == kMax) {
+    p.a = p.count == 1 ? value : max(p.a, value);
+  } else {
+    p.a += value;
+  }
+
+  return p;
+}
+
+static Partial push(Partial p, half value) { return push(p, float(value)); }
+
+static Partial push(Partial p, int value) {
+  if (op == kVar) {
+    return push(p, float(value));
+  }
+
+  p.count++;
+  if (op == kMin) {
+    p.exact = (p.count == 1 || value < p.exact) ? long(value) : p.exact;
+  } else if (op == kMax) {
+    p.exact = (p.count == 1 || value > p.exact) ? long(value) : p.exact;
+  } else {
+    p.exact += value;
+  }
+
+  return p;
+}
+
+static Partial merge(Partial x, Partial y) {
+  if (x.count == 0 || y.count == 0) {
+    Partial out = x.count == 0 ? y : x;
+    out.na = x.na + y.na;
+    return out;
+  }
+
+  Partial out = x;
+  out.count = x.count + y.count;
+  out.na = x.na + y.na;
+  if (op == kVar) {
+    float delta = y.a - x.a;
+    float weight = float(y.count) / float(out.count);
+    out.a = x.a + delta * weight;
+    out.b = x.b + y.b + delta * delta * float(x.count) * weight;
+  } else if (op == kMin) {
+    out.a = min(x.a, y.a);
+    out.exact = y.exact < x.exact ? y.exact : x.exact;
+  } else if (op == kMax) {
+    out.a = max(x.a, y.a);
+    out.exact = y.exact > x.exact ? y.exact : x.exact;
+  } else {
+    out.a = x.a + y.a;
+    out.exact = x.exact + y.exact;
+  }
+
+  return out;
+}
+
+template <typename T>
+static void reduce_block(device const T* x, device Partial* partials, uint n,
+                         uint block, uint group, uint tid, uint threads,
+                         threadgroup Partial* scratch) {
+  ulong begin = ulong(group) * block;
+  ulong end = begin + block < n ? begin + block : n;
+
+  Partial p = {0, 0, 0, 0, 0};
+  for (ulong i = begin + tid; i < end; i += threads) {
+    T value = x[i];
+    if (is_na(value)) {
+      p.na++;
+    } else {
+      p = push(p, value);
+    }
+  }
+
+  scratch[tid] = p;
+  threadgroup_barrier(mem_flags::mem_threadgroup);
+  for (uint stride = threads / 2; stride > 0; stride /= 2) {
+    if (tid < stride) {
+      scratch[tid] = merge(scratch[tid], scratch[tid + stride]);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+  }
+
+  if (tid == 0) {
+    partials[group] = scratch[0];
+  }
+}
+
+kernel void mtl_reduce_float(device const float* x [[buffer(0)]],
+                             device Partial* partials [[buffer(1)]],
+                             constant uint& n [[buffer(2)]],
+                             constant uint& block [[buffer(3)]],
+                             uint group [[threadgroup_position_in_grid]],
+                             uint tid [[thread_position_in_threadgroup]],
+                             uint threads [[threads_per_threadgroup]]) {
+  threadgroup Partial scratch[256];
+  reduce_block(x, partials, n, block, group, tid, threads, scratch);
+}
+
+kernel void mtl_reduce_half(device const half* x [[buffer(0)]],
+                            device Partial* partials [[buffer(1)]],
+                            constant uint& n [[buffer(2)]],
+                            constant uint& block [[buffer(3)]],
+                            uint group [[threadgroup_position_in_grid]],
+                            uint tid [[thread_position_in_threadgroup]],
+                            uint threads [[threads_per_threadgroup]]) {
+  threadgroup Partial scratch[256];
+  reduce_block(x, partials, n, block, group, tid, threads, scratch);
+}
+
+kernel void mtl_reduce_int32(device const int* x [[buffer(0)]],
+                             device Partial* partials [[buffer(1)]],
+                             constant uint& n [[buffer(2)]],
+                             constant uint& block [[buffer(3)]],
+                             uint group [[threadgroup_position_in_grid]],
+                             uint tid [[thread_position_in_threadgroup]],
+                             uint threads [[threads_per_threadgroup]]) {
+  threadgroup Partial scratch[256];
+  reduce_block(x, partials, n, block, group, tid, threads, scratch);
+}
+)";
+
+static constexpr size_t kMaxThreads = 256;
+
+// Each thread reduces at least this many elements before the tree, and there
+// are at most kMaxGroups partials to merge on the host
+static constexpr size_t kElementsPerThread = 16;
+static constexpr size_t kMaxGroups = 16384;
+
+void ReduceState::merge(ReduceOp op, const ReduceState& other) {
+  na += other.na;
+  nan += other.nan;
+  if (other.count == 0) {
+    return;
+  } else if (count == 0) {
+    size_t total_na = na;
+    size_t total_nan = nan;
+    *this = other;
+    na = total_na;
+    nan = total_nan;
+    return;
+  }
+
+  size_t total = count + other.count;
+  switch (op) {
+    case ReduceOp::Var: {
+      // Chan et al.'s update for the sum of squared deviations of two groups
+      double delta = other.a - a;
+      double weight = static_cast<double>(other.count) / total;
+      a += delta * weight;
+      b += other.b + delta * delta * count * weight;
+      break;
+    }
+    case ReduceOp::Min:
+      a = std::min(a, other.a);
+      exact = std::min(exact, other.exact);
+      break;
+    case ReduceOp::Max:
+      a = std::max(a, other.a);
+      exact = std::max(exact, other.exact);
+      break;
+    default:
+      a += other.a;
+      exact += other.exact;
+      break;
+  }
+
+  count = total;
+}
+
+static bool is_na(float value) { return value != value; }
+static bool is_na(double value) { return value != value; }
+
+// NA_integer_
+static bool is_na(int32_t value) { return value == std::numeric_limits<int32_t>::min(); }
+
+// Whether an element is NaN but not R's NA, which is the NaN whose low word is
+// 1954 (as in R_IsNA()). Float and half elements can't hold R's NA.
+static bool is_nan(float value) { return value != value; }
+static bool is_nan(int32_t) { return false; }
+
+static bool is_nan(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return value != value && (bits & 0xffffffff) != 1954;
+}
+
+// Reduces the elements of a block in double precision (or exactly, for sums,
+// minimums, and maximums of int32 elements). Each loop selects instead of
+// branching on NAs so that the compiler can vectorize it, and variances take
+// a second pass over the block (which is still in cache) instead of using
+// Welford's update.
+template <ReduceOp Op, typename T>
+static ReduceState reduce_elements(const T* x, size_t n) {
+  constexpr bool kExact = std::is_integral<T>::value && Op != ReduceOp::Var;
+  using Accumulator = typename std::conditional<kExact, int64_t, double>::type;
+
+  ReduceState state;
+  size_t count = 0;
+  size_t nan = 0;
+  Accumulator result = 0;
+  if (Op == ReduceOp::Min || Op == ReduceOp::Max) {
+    constexpr bool kMin = Op == ReduceOp::Min;
+    using Limits = std::numeric_limits<Accumulator>;
+    Accumulator skip = kExact ? (kMin ? Limits::max() : Limits::lowest())
+                              : (kMin ? Limits::infinity() : -Limits::infinity());
+    result = skip;
+    for (size_t i = 0; i < n; i++) {
+      bool valid = !is_na(x[i]);
+      Accumulator value = valid ? static_cast<Accumulator>(x[i]) : skip;
+      result = kMin ? std::min(result, value) : std::max(result, value);
+      count += valid;
+      nan += is_nan(x[i]);
+    }
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      bool valid = !is_na(x[i]);
+      result += valid ? static_cast<Accumulator>(x[i]) : 0;
+      count += valid;
+      nan += is_nan(x[i]);
+    }
+  }
+
+  if (kExact) {
+    state.exact = static_cast<int64_t>(result);
+  } else {
+    state.a = static_cast<double>(result);
+  }
+
+  if (Op == ReduceOp::Var && count > 0) {
+    double mean = state.a / count;
+    double m2 = 0;
+    for (size_t i = 0; i < n; i++) {
+      double deviation = is_na(x[i]) ? 0 : static_cast<double>(x[i]) - mean;
+      m2 += deviation * deviation;
+    }
+
+    state.a = mean;
+    state.b = m2;
+  }
+
+  state.count = count;
+  state.na = n - count;
+  state.nan = nan;
+  return state;
+}
+
+// Halfs are converted to floats a block at a time
+template <ReduceOp Op>
+static ReduceState reduce_halfs(const uint16_t* x, size_t n) {
+  constexpr size_t kBlock = 256;
+  float block[kBlock];
+
+  ReduceState state;
+  for (size_t i = 0; i < n; i += kBlock) {
+    size_t block_size = std::min(kBlock, n - i);
+    floats::half_to_float(x + i, block, block_size);
+    state.merge(Op, reduce_elements<Op>(block, block_size));
+  }
+
+  return state;
+}
+
+static ReduceState from_partial(const ReducePartial& partial) {
+  ReduceState state;
+  state.count = partial.count;
+  state.na = partial.na;
+  state.a = partial.a;
+  state.b = partial.b;
+  state.exact = partial.exact;
+  return state;
+}
+
+static ReducePartial to_partial(const ReduceState& state) {
+  return ReducePartial{static_cast<uint32_t>(state.count),
+                       static_cast<uint32_t>(state.na), static_cast<float>(state.a),
+                       static_cast<float>(state.b), state.exact};
+}
+
+namespace cpu {
+
+// kernel void mtl_reduce_float(device const float* x, device Partial* partials,
+//                              constant uint& n, constant uint& block, ...)
+//
+// (and likewise for half and int32 elements). One call reduces the block of a
+// whole threadgroup, so the kernel ignores the threads within it.
+template <typename T, ReduceOp Op>
+static void reduce_group(const KernelArguments& args, const ThreadgroupContext& ctx) {
+  size_t n = args.value<uint32_t>(2);
+  size_t block = args.value<uint32_t>(3);
+  size_t group = ctx.threadgroup_position_in_grid.width;
+  size_t begin = std::min(group * block, n);
+  size_t end = std::min(begin + block, n);
+
+  const T* x = args.buffer<T>(0) + begin;
+  ReduceState state;
+  if constexpr (std::is_same<T, uint16_t>::value) {
+    state = reduce_halfs<Op>(x, end - begin);
+  } else {
+    state = reduce_elements<Op>(x, end - begin);
+  }
+
+  args.buffer<ReducePartial>(1)[group] = to_partial(state);
+}
+
+template <typename T>
+static KernelFactory reduce_kernel() {
+  return [](const FunctionConstants& constants, Kernel* kernel, std::string* error) {
+    uint32_t op;
+    if (!constants.value("op", ConstantType::UInt, &op)) {
+      *error = "Function constant 'op' of type uint was not set";
+      return false;
+    }
+
+    bool found = with_constant<uint32_t, 0, 1, 2, 3, 4>(op, [&](auto value) {
+      *kernel = reduce_group<T, static_cast<ReduceOp>(decltype(value)::value)>;
+    });
+    if (!found) {
+      *error = "Invalid reduction op " + std::to_string(op);
+    }
+
+    return found;
+  };
+}
+
+static KernelRegistration reduce_float("mtl_reduce_float", reduce_kernel<float>());
+static KernelRegistration reduce_half("mtl_reduce_half", reduce_kernel<uint16_t>());
+static KernelRegistration reduce_int32("mtl_reduce_int32", reduce_kernel<int32_t>());
+
+}  // namespace cpu
+
+// Metal devices can't use doubles, so double buffers are reduced on the host,
+// in chunks on the thread pool used by mtl_floats
+template <ReduceOp Op>
+static ReduceState reduce_doubles(const double* x, size_t n) {
+  std::vector<ReduceState> states(floats::num_chunks(n));
+  floats::for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+    states[chunk] = reduce_elements<Op>(x + begin, end - begin);
+  });
+
+  ReduceState state;
+  for (const ReduceState& chunk_state : states) {
+    state.merge(Op, chunk_state);
+  }
+
+  return state;
+}
+
+static const char* reduce_kernel_name(ReduceElement element) {
+  switch (element) {
+    case ReduceElement::Half:
+      return "mtl_reduce_half";
+    case ReduceElement::Int32:
+      return "mtl_reduce_int32";
+    default:
+      return "mtl_reduce_float";
+  }
+}
+
+bool reduce_buffer(Device* device, CommandQueue* queue, Buffer* buffer,
+                   ReduceElement element, ReduceOp op, size_t n, ReduceState* out,
+                   std::string* error) {
+  *out = ReduceState();
+  if (n > std::numeric_limits<uint32_t>::max()) {
+    *error = "Can't reduce more than 2^32 - 1 elements";
+    return false;
+  } else if (n == 0) {
+    return true;
+  }
+
+  uint32_t op_value = static_cast<uint32_t>(op);
+  if (element == ReduceElement::Double) {
+    auto x = static_cast<const double*>(buffer->contents());
+    cpu::with_constant<uint32_t, 0, 1, 2, 3, 4>(op_value, [&](auto value) {
+      *out = reduce_doubles<static_cast<ReduceOp>(decltype(value)::value)>(x, n);
+    });
+    return true;
+  }
+
+  FunctionConstants constants;
+  constants.add("op", ConstantType::UInt, dispatch_bytes(op_value));
+  ObjectPtr<ComputePipeline> pipeline(builtin_pipeline(
+      device, kReduceSource, reduce_kernel_name(element), constants, error));
+  if (!pipeline) {
+    return false;
+  }
+
+  size_t max_threads =
+      std::min(kMaxThreads, pipeline->max_total_threads_per_threadgroup());
+  size_t threads = 1;
+  while (threads * 2 <= max_threads) {
+    threads *= 2;
+  }
+
+  size_t per_group = threads * kElementsPerThread;
+  size_t n_groups = std::min(kMaxGroups, (n + per_group - 1) / per_group);
+  size_t block = (n + n_groups - 1) / n_groups;
+  n_groups = (n + block - 1) / block;
+
+  ObjectPtr<Buffer> partials(device->new_pooled_buffer(n_groups * sizeof(ReducePartial)));
+  if (!partials) {
+    *error = "Failed to create buffer";
+    return false;
+  }
+
+  Dispatch dispatch;
+  dispatch.pipeline = pipeline.get();
+  dispatch.buffers = {buffer, partials.get(), nullptr, nullptr};
+  dispatch.bytes = {"", "", dispatch_bytes(static_cast<uint32_t>(n)),
+                    dispatch_bytes(static_cast<uint32_t>(block))};
+  dispatch.grid = Size::Make(n_groups * threads);
+  dispatch.threadgroup = Size::Make(threads);
+  DispatchSequence sequence;
+  sequence.add(dispatch);
+  if (!sequence.run(queue, error)) {
+    return false;
+  }
+
+  auto results = static_cast<const ReducePartial*>(partials->contents());
+  for (size_t i = 0; i < n_groups; i++) {
+    out->merge(op, from_partial(results[i]));
+  }
+
+  // Partials don't count NaNs separately because every missing float or half
+  // element is NaN
+  if (element != ReduceElement::Int32) {
+    out->nan = out->na;
+  }
+
+  return true;
+}
+
+double reduce_value(ReduceOp op, ReduceElement element, const ReduceState& state) {
+  bool exact = element == ReduceElement::Int32 && op != ReduceOp::Var;
+  double result = exact ? static_cast<double>(state.exact) : state.a;
+  double nan = std::numeric_limits<double>::quiet_NaN();
+  switch (op) {
+    case ReduceOp::Sum:
+      return result;
+    case ReduceOp::Mean:
+      return state.count == 0 ? nan : result / state.count;
+    case ReduceOp::Var:
+      return state.count < 2 ? nan : state.b / (state.count - 1);
+    default:
+      return state.count == 0 ? nan : result;
+  }
+}
+
+}  // namespace backend
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "backend.h"
+
+// Sums, means, variances, minimums, and maximums of the elements of a buffer.
+// Each threadgroup of the reduction kernel reduces a contiguous block of the
+// buffer with a tree in threadgroup memory and writes one partial result,
+// and the partials (at most a few thousand) are merged on the host. The CPU
+// backend registers C++ kernels with the same names that reduce each block
+// with vectorized loops. Elements that are NA (NaN or NA_integer_) are skipped
+// and counted separately so that callers can implement na.rm.
+namespace backend {
+
+// The values of the `op` function constant of the kernels
+enum class ReduceOp { Sum = 0, Mean = 1, Var = 2, Min = 3, Max = 4 };
+
+enum class ReduceElement { Float, Half, Int32, Double };
+
+// A partial result as written by the kernels, whose layout matches `struct
+// Partial` in the Metal source. Sums, minimums, and maximums of int32 elements
+// are exact; everything else is accumulated in a (the running sum, or for
+// variances, the running mean) and b (for variances, the sum of squared
+// deviations from the mean).
+struct ReducePartial {
+  uint32_t count;
+  uint32_t na;
+  float a;
+  float b;
+  int64_t exact;
+};
+
+// The same in double precision, which is used to merge partials on the host.
+// nan counts the NA elements that are NaN rather than R's NA (which only double
+// elements can distinguish), so that callers can return NaN like R does.
+struct ReduceState {
+  size_t count;
+  size_t na;
+  size_t nan;
+  double a;
+  double b;
+  int64_t exact;
+
+  ReduceState() : count(0), na(0), nan(0), a(0), b(0), exact(0) {}
+
+  void merge(ReduceOp op, const ReduceState& other);
+};
+
+// Reduces the first n elements of buffer using the device's reduction kernels
+// (or, for double elements, which Metal devices can't use, on the host). n
+// must be less than 2^32.
+bool reduce_buffer(Device* device, CommandQueue* queue, Buffer* buffer,
+                   ReduceElement element, ReduceOp op, size_t n, ReduceState* out,
+                   std::string* error);
+
+// The result of op for the non-NA elements of a reduction, which is NaN if
+// there are too few of them (i.e., none, or one for a variance)
+double reduce_value(ReduceOp op, ReduceElement element, const ReduceState& state);
+
+}  // namespace backend
@@ -0,0 +1,406 @@
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#include "backend-cpu.h"
+#include "builtin-kernels.h"
+#include "scan.h"
+
+namespace backend {
+
+// Within a block, each thread scans a contiguous segment of elements and the
+// threads' segment sums are scanned in threadgroup memory (Hillis and Steele),
+// which gives each thread the offset that its segment starts at. Threadgroups
+// must have at most kMaxThreads (the size of the scratch arrays) threads.
+static const char* kScanSource = R"(
+#include <metal_stdlib>
+using namespace metal;
+
+constant bool exclusive [[function_constant(0)]];
+
+static float combine(float x, float y) { return x + y; }
+
+// NA_integer_ absorbs anything that it is added to
+static int combine(int x, int y) {
+  int na = int(0x80000000);
+  return (x == na || y == na) ? na : int(uint(x) + uint(y));
+}
+
+struct Segment {
+  ulong begin;
+  ulong end;
+};
+
+// The elements of [begin, end) that one thread of a threadgroup scans
+static Segment thread_segment(ulong begin, ulong end, uint tid, uint threads) {
+  ulong per_thread = (end - begin + threads - 1) / threads;
+  Segment out;
+  out.begin = begin + tid * per_thread;
+  out.begin = out.begin < end ? out.begin : end;
+  out.end = out.begin + per_thread < end ? out.begin + per_thread : end;
+  return out;
+}
+
+static Segment block_segment(uint n, uint block, uint group, uint tid,
+                             uint threads) {
+  ulong begin = ulong(group) * block;
+  ulong end = begin + block < n ? begin + block : n;
+  begin = begin < n ? begin : n;
+  return thread_segment(begin, end, tid, threads);
+}
+
+template <typename T>
+static T segment_sum(device const T* x, Segment segment) {
+  T sum = T(0);
+  for (ulong i = segment.begin; i < segment.end; i++) {
+    sum = combine(sum, x[i]);
+  }
+
+  return sum;
+}
+
+// Returns the sum of value for the threads before this one and sets total to
+// the sum for all threads
+template <typename T>
+static T threadgroup_exclusive_scan(T value, uint tid, uint threads,
+                                    threadgroup T* scratch, thread T* total) {
+  scratch[tid] = value;
+  threadgroup_barrier(mem_flags::mem_threadgroup);
+  for (uint offset = 1; offset < threads; offset *= 2) {
+    T previous = tid >= offset ? scratch[tid - offset] : T(0);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    if (tid >= offset) {
+      scratch[tid] = combine(previous, scratch[tid]);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+  }
+
+  T out = tid == 0 ? T(0) : scratch[tid - 1];
+  *total = scratch[threads - 1];
+  threadgroup_barrier(mem_flags::mem_threadgroup);
+  return out;
+}
+
+template <typename T>
+static void scan_reduce(device const T* x, device T* sums, uint n, uint block,
+                        uint group, uint tid, uint threads, threadgroup T* scratch) {
+  T sum = segment_sum(x, block_segment(n, block, group, tid, threads));
+  T total;
+  threadgroup_exclusive_scan(sum, tid, threads, scratch, &total);
+  if (tid == 0) {
+    sums[group] = total;
+  }
+}
+
+// One threadgroup replaces the block sums with the offset of each block
+template <typename T>
+static void scan_offsets(device T* sums, uint n_groups, uint tid, uint threads,
+                         threadgroup T* scratch) {
+  Segment segment = thread_segment(0, n_groups, tid, threads);
+  T total;
+  T running = threadgroup_exclusive_scan(segment_sum(sums, segment), tid,
+                                         threads, scratch, &total);
+  for (ulong i = segment.begin; i < segment.end; i++) {
+    T value = sums[i];
+    sums[i] = running;
+    running = combine(running, value);
+  }
+}
+
+template <typename T>
+static void scan_apply(device T* x, device const T* offsets, uint n, uint block,
+                       uint group, uint tid, uint threads, threadgroup T* scratch) {
+  Segment segment = block_segment(n, block, group, tid, threads);
+  T total;
+  T running = threadgroup_exclusive_scan(segment_sum(x, segment), tid, threads,
+                                         scratch, &total);
+  running = combine(offsets[group], running);
+  for (ulong i = segment.begin; i < segment.end; i++) {
+    T value = x[i];
+    if (exclusive) {
+      x[i] = running;
+      running = combine(running, value);
+    } else {
+      running = combine(running, value);
+      x[i] = running;
+    }
+  }
+}
+
+kernel void mtl_scan_reduce_float(device const float* x [[buffer(0)]],
+                                  device float* sums [[buffer(1)]],
+                                  constant uint& n [[buffer(2)]],
+                                  constant uint& block [[buffer(3)]],
+                                  uint group [[threadgroup_position_in_grid]],
+                                  uint tid [[thread_position_in_threadgroup]],
+                                  uint threads [[threads_per_threadgroup]]) {
+  threadgroup float scratch[256];
+  scan_reduce(x, sums, n, block, group, tid, threads, scratch);
+}
+
+kernel void mtl_scan_reduce_int32(device const int* x [[buffer(0)]],
+                                  device int* sums [[buffer(1)]],
+                                  constant uint& n [[buffer(2)]],
+                                  constant uint& block [[buffer(3)]],
+                                  uint group [[threadgroup_position_in_grid]],
+                                  uint tid [[thread_position_in_threadgroup]],
+                                  uint threads [[threads_per_threadgroup]]) {
+  threadgroup int scratch[256];
+  scan_reduce(x, sums, n, block, group, tid, threads, scratch);
+}
+
+kernel void mtl_scan_offsets_float(device float* sums [[buffer(0)]],
+                                   constant uint& n_groups [[buffer(1)]],
+                                   uint tid [[thread_position_in_threadgroup]],
+                                   uint threads [[threads_per_threadgroup]]) {
+  threadgroup float scratch[256];
+  scan_offsets(sums, n_groups, tid, threads, scratch);
+}
+
+kernel void mtl_scan_offsets_int32(device int* sums [[buffer(0)]],
+                                   constant uint& n_groups [[buffer(1)]],
+                                   uint tid [[thread_position_in_threadgroup]],
+                                   uint threads [[threads_per_threadgroup]]) {
+  threadgroup int scratch[256];
+  scan_offsets(sums, n_groups, tid, threads, scratch);
+}
+
+kernel void mtl_scan_apply_float(device float* x [[buffer(0)]],
+                                 device const float* offsets [[buffer(1)]],
+                                 constant uint& n [[buffer(2)]],
+                                 constant uint& block [[buffer(3)]],
+                                 uint group [[threadgroup_position_in_grid]],
+                                 uint tid [[thread_position_in_threadgroup]],
+                                 uint threads [[threads_per_threadgroup]]) {
+  threadgroup float scratch[256];
+  scan_apply(x, offsets, n, block, group, tid, threads, scratch);
+}
+
+kernel void mtl_scan_apply_int32(device int* x [[buffer(0)]],
+                                 device const int* offsets [[buffer(1)]],
+                                 constant uint& n [[buffer(2)]],
+                                 constant uint& block [[buffer(3)]],
+                                 uint group [[threadgroup_position_in_grid]],
+                                 uint tid [[thread_position_in_threadgroup]],
+                                 uint threads [[threads_per_threadgroup]]) {
+  threadgroup int scratch[256];
+  scan_apply(x, offsets, n, block, group, tid, threads, scratch);
+}
+)";
+
+static constexpr size_t kMaxThreads = 256;
+
+// Like the reductions in reduce.cpp, each thread scans at least this many
+// elements and there are at most kMaxGroups blocks
+static constexpr size_t kElementsPerThread = 16;
+static constexpr size_t kMaxGroups = 16384;
+
+namespace cpu {
+
+static float combine(float x, float y) { return x + y; }
+
+// NA_integer_ absorbs anything that it is added to. The addition is done on
+// unsigned integers so that overflow wraps around like it does in Metal.
+static int32_t combine(int32_t x, int32_t y) {
+  constexpr int32_t kNA = std::numeric_limits<int32_t>::min();
+  return (x == kNA || y == kNA)
+             ? kNA
+             : static_cast<int32_t>(static_cast<uint32_t>(x) + static_cast<uint32_t>(y));
+}
+
+// The sum of a block, which (unlike the scan itself) can be vectorized
+static float block_sum(const float* x, size_t n) {
+  float sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += x[i];
+  }
+
+  return sum;
+}
+
+static int32_t block_sum(const int32_t* x, size_t n) {
+  constexpr int32_t kNA = std::numeric_limits<int32_t>::min();
+  uint32_t sum = 0;
+  bool na = false;
+  for (size_t i = 0; i < n; i++) {
+    sum += static_cast<uint32_t>(x[i]);
+    na |= x[i] == kNA;
+  }
+
+  return na ? kNA : static_cast<int32_t>(sum);
+}
+
+// The elements of the threadgroup's block, which the CPU kernels process on
+// one worker thread instead of splitting it among the threads of the group
+static void block_range(const KernelArguments& args, const ThreadgroupContext& ctx,
+                        size_t* begin, size_t* end) {
+  size_t n = args.value<uint32_t>(2);
+  size_t block = args.value<uint32_t>(3);
+  *begin = std::min(ctx.threadgroup_position_in_grid.width * block, n);
+  *end = std::min(*begin + block, n);
+}
+
+// kernel void mtl_scan_reduce_float(device const float* x, device float* sums,
+//                                   constant uint& n, constant uint& block, ...)
+template <typename T>
+static void scan_reduce(const KernelArguments& args, const ThreadgroupContext& ctx) {
+  size_t begin, end;
+  block_range(args, ctx, &begin, &end);
+  T* sums = args.buffer<T>(1);
+  sums[ctx.threadgroup_position_in_grid.width] =
+      block_sum(args.buffer<T>(0) + begin, end - begin);
+}
+
+// kernel void mtl_scan_offsets_float(device float* sums, constant uint& n_groups,
+//                                    ...)
+template <typename T>
+static void scan_offsets(const KernelArguments& args, const ThreadgroupContext& ctx) {
+  T* sums = args.buffer<T>(0);
+  size_t n_groups = args.value<uint32_t>(1);
+  T running = 0;
+  for (size_t i = 0; i < n_groups; i++) {
+    T value = sums[i];
+    sums[i] = running;
+    running = combine(running, value);
+  }
+}
+
+// constant bool exclusive [[function_constant(0)]];
+//
+// kernel void mtl_scan_apply_float(device float* x, device const float* offsets,
+//                                  constant uint& n, constant uint& block, ...)
+template <typename T, bool Exclusive>
+static void scan_apply(const KernelArguments& args, const ThreadgroupContext& ctx) {
+  size_t begin, end;
+  block_range(args, ctx, &begin, &end);
+  T* x = args.buffer<T>(0);
+  T running = args.buffer<T>(1)[ctx.threadgroup_position_in_grid.width];
+  for (size_t i = begin; i < end; i++) {
+    T value = x[i];
+    if (Exclusive) {
+      x[i] = running;
+      running = combine(running, value);
+    } else {
+      running = combine(running, value);
+      x[i] = running;
+    }
+  }
+}
+
+template <typename T>
+static KernelFactory scan_apply_kernel() {
+  return [](const FunctionConstants& constants, Kernel* kernel, std::string* error) {
+    bool exclusive;
+    if (!constants.value("exclusive", ConstantType::Bool, &exclusive)) {
+      *error = "Function constant 'exclusive' of type bool was not set";
+      return false;
+    }
+
+    with_constant<bool, false, true>(exclusive, [&](auto value) {
+      *kernel = scan_apply<T, decltype(value)::value>;
+    });
+    return true;
+  };
+}
+
+static KernelRegistration scan_reduce_float("mtl_scan_reduce_float",
+                                            scan_reduce<float>);
+static KernelRegistration scan_reduce_int32("mtl_scan_reduce_int32",
+                                            scan_reduce<int32_t>);
+static KernelRegistration scan_offsets_float("mtl_scan_offsets_float",
+                                             scan_offsets<float>);
+static KernelRegistration scan_offsets_int32("mtl_scan_offsets_int32",
+                                             scan_offsets<int32_t>);
+static KernelRegistration scan_apply_float("mtl_scan_apply_float",
+                                           scan_apply_kernel<float>());
+static KernelRegistration scan_apply_int32("mtl_scan_apply_int32",
+                                           scan_apply_kernel<int32_t>());
+
+}  // namespace cpu
+
+bool encode_scan(Device* device, Buffer* buffer, ScanElement element,
+                 bool exclusive, size_t n, DispatchSequence* sequence,
+                 std::string* error) {
+  if (n > std::numeric_limits<uint32_t>::max()) {
+    *error = "Can't scan more than 2^32 - 1 elements";
+    return false;
+  } else if (n == 0) {
+    return true;
+  }
+
+  std::string suffix = element == ScanElement::Int32 ? "_int32" : "_float";
+  FunctionConstants no_constants;
+  FunctionConstants apply_constants;
+  apply_constants.add("exclusive", ConstantType::Bool,
+                      std::string(1, static_cast<char>(exclusive)));
+
+  ComputePipeline* reduce = sequence->keep(builtin_pipeline(
+      device, kScanSource, "mtl_scan_reduce" + suffix, no_constants, error));
+  if (!reduce) {
+    return false;
+  }
+
+  ComputePipeline* offsets = sequence->keep(builtin_pipeline(
+      device, kScanSource, "mtl_scan_offsets" + suffix, no_constants, error));
+  if (!offsets) {
+    return false;
+  }
+
+  ComputePipeline* apply = sequence->keep(builtin_pipeline(
+      device, kScanSource, "mtl_scan_apply" + suffix, apply_constants, error));
+  if (!apply) {
+    return false;
+  }
+
+  size_t max_threads = kMaxThreads;
+  for (ComputePipeline* pipeline : {reduce, offsets, apply}) {
+    max_threads = std::min(max_threads, pipeline->max_total_threads_per_threadgroup());
+  }
+
+  size_t per_group = max_threads * kElementsPerThread;
+  size_t n_groups = std::min(kMaxGroups, (n + per_group - 1) / per_group);
+  size_t block = (n + n_groups - 1) / n_groups;
+  n_groups = (n + block - 1) / block;
+
+  // Both element types are 4 bytes
+  Buffer* sums = sequence->keep(device->new_pooled_buffer(n_groups * sizeof(float)));
+  if (!sums) {
+    *error = "Failed to create buffer";
+    return false;
+  }
+
+  std::string n_bytes = dispatch_bytes(static_cast<uint32_t>(n));
+  std::string block_bytes = dispatch_bytes(static_cast<uint32_t>(block));
+
+  Dispatch reduce_dispatch;
+  reduce_dispatch.pipeline = reduce;
+  reduce_dispatch.buffers = {buffer, sums, nullptr, nullptr};
+  reduce_dispatch.bytes = {"", "", n_bytes, block_bytes};
+  reduce_dispatch.grid = Size::Make(n_groups * max_threads);
+  reduce_dispatch.threadgroup = Size::Make(max_threads);
+
+  Dispatch offsets_dispatch;
+  offsets_dispatch.pipeline = offsets;
+  offsets_dispatch.buffers = {sums, nullptr};
+  offsets_dispatch.bytes = {"", dispatch_bytes(static_cast<uint32_t>(n_groups))};
+  offsets_dispatch.grid = Size::Make(max_threads);
+  offsets_dispatch.threadgroup = Size::Make(max_threads);
+
+  Dispatch apply_dispatch = reduce_dispatch;
+  apply_dispatch.pipeline = apply;
+
+  sequence->add(reduce_dispatch);
+  sequence->add(offsets_dispatch);
+  sequence->add(apply_dispatch);
+  return true;
+}
+
+bool scan_buffer(Device* device, CommandQueue* queue, Buffer* buffer,
+                 ScanElement element, bool exclusive, size_t n, std::string* error) {
+  DispatchSequence sequence;
+  return encode_scan(device, buffer, element, exclusive, n, &sequence, error) &&
+         sequence.run(queue, error);
+}
+
+}  // namespace backend
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "backend.h"
+#include "builtin-kernels.h"
+
+// In-place prefix sums of the elements of a buffer as a blocked scan of three
+// dispatches in one command buffer: each threadgroup sums a contiguous block
+// of the buffer, one threadgroup scans the block sums into block offsets, and
+// each threadgroup then scans its block again starting at its offset. The
+// buffer never leaves the device between the phases. The CPU backend
+// registers C++ kernels with the same names that scan each block on one
+// worker thread.
+//
+// int32 sums wrap around on overflow and an NA_integer_ element makes every
+// later sum NA (like cumsum()); float NaNs propagate the same way.
+namespace backend {
+
+enum class ScanElement { Float, Int32 };
+
+// Scans the first n elements of buffer, which must be less than 2^32.
+// Exclusive scans start at zero and leave out each element's own value.
+bool scan_buffer(Device* device, CommandQueue* queue, Buffer* buffer,
+                 ScanElement element, bool exclusive, size_t n, std::string* error);
+
+// Appends the dispatches of scan_buffer() to sequence, so that other built-in
+// operations (e.g., the radix sort in sort.cpp) can scan a buffer between
+// their own steps without waiting on the host
+bool encode_scan(Device* device, Buffer* buffer, ScanElement element,
+                 bool exclusive, size_t n, DispatchSequence* sequence,
+                 std::string* error);
+
+}  // namespace backend
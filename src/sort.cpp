@@ -0,0 +1,518 @@
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#include "backend-cpu.h"
+#include "builtin-kernels.h"
+#include "scan.h"
+#include "sort.h"
+
+namespace backend {
+
+struct RadixParams {
+  uint32_t n;
+  uint32_t segment;
+  uint32_t shift;
+  uint32_t n_segments;
+};
+
+static_assert(sizeof(RadixParams) == 16, "RadixParams must match the Metal source");
+
+// Each thread counts and moves the keys of one contiguous segment with private
+// digit counters, which keeps the scatter stable without ranking keys within a
+// threadgroup. The 32-bit kernels map int32 and float keys to unsigned
+// integers that sort in the same order (key_type) and uint64 keys are sorted
+// as they are. Payloads are moved as payload_words uints per element.
+static const char* kSortSource = R"(
+#include <metal_stdlib>
+using namespace metal;
+
+constant uint key_type [[function_constant(0)]];
+constant uint payload_words [[function_constant(1)]];
+constant bool has_payload = payload_words > 0;
+
+constant uint kInt32 = 0;
+
+struct RadixParams {
+  uint n;
+  uint segment;
+  uint shift;
+  uint n_segments;
+};
+
+// NA_integer_ (the smallest int) and NaN map to the largest value
+static uint sortable(uint bits) {
+  if (key_type == kInt32) {
+    return (bits ^ 0x80000000u) - 1u;
+  }
+
+  if ((bits & 0x7fffffffu) > 0x7f800000u) {
+    return 0xffffffffu;
+  } else if ((bits & 0x7fffffffu) == 0) {
+    bits = 0;
+  }
+
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+static uint digit(uint key, uint shift) { return (sortable(key) >> shift) & 0xffu; }
+
+static uint digit(ulong key, uint shift) { return uint(key >> shift) & 0xffu; }
+
+static ulong segment_begin(constant RadixParams& params, uint index) {
+  return ulong(index) * params.segment;
+}
+
+static ulong segment_end(constant RadixParams& params, uint index) {
+  ulong end = segment_begin(params, index) + params.segment;
+  return end < params.n ? end : params.n;
+}
+
+// The counts are digit-major: counts[digit * n_segments + segment]
+template <typename K>
+static void radix_histogram(device const K* keys, device uint* counts,
+                            constant RadixParams& params, uint index) {
+  if (index >= params.n_segments) {
+    return;
+  }
+
+  uint local[256];
+  for (uint d = 0; d < 256; d++) {
+    local[d] = 0;
+  }
+
+  ulong end = segment_end(params, index);
+  for (ulong i = segment_begin(params, index); i < end; i++) {
+    local[digit(keys[i], params.shift)]++;
+  }
+
+  for (uint d = 0; d < 256; d++) {
+    counts[ulong(d) * params.n_segments + index] = local[d];
+  }
+}
+
+template <typename K>
+static void radix_scatter(device const K* keys, device K* keys_out,
+                          device const uint* offsets, constant RadixParams& params,
+                          device const uint* payload, device uint* payload_out,
+                          uint index) {
+  if (index >= params.n_segments) {
+    return;
+  }
+
+  uint local[256];
+  for (uint d = 0; d < 256; d++) {
+    local[d] = offsets[ulong(d) * params.n_segments + index];
+  }
+
+  ulong end = segment_end(params, index);
+  for (ulong i = segment_begin(params, index); i < end; i++) {
+    K key = keys[i];
+    ulong j = local[digit(key, params.shift)]++;
+    keys_out[j] = key;
+    if (has_payload) {
+      for (uint w = 0; w < payload_words; w++) {
+        payload_out[j * payload_words + w] = payload[i * payload_words + w];
+      }
+    }
+  }
+}
+
+kernel void mtl_radix_histogram_32(device const uint* keys [[buffer(0)]],
+                                   device uint* counts [[buffer(1)]],
+                                   constant RadixParams& params [[buffer(2)]],
+                                   uint index [[thread_position_in_grid]]) {
+  radix_histogram(keys, counts, params, index);
+}
+
+kernel void mtl_radix_histogram_64(device const ulong* keys [[buffer(0)]],
+                                   device uint* counts [[buffer(1)]],
+                                   constant RadixParams& params [[buffer(2)]],
+                                   uint index [[thread_position_in_grid]]) {
+  radix_histogram(keys, counts, params, index);
+}
+
+kernel void mtl_radix_scatter_32(
+    device const uint* keys [[buffer(0)]], device uint* keys_out [[buffer(1)]],
+    device const uint* offsets [[buffer(2)]],
+    constant RadixParams& params [[buffer(3)]],
+    device const uint* payload [[buffer(4), function_constant(has_payload)]],
+    device uint* payload_out [[buffer(5), function_constant(has_payload)]],
+    uint index [[thread_position_in_grid]]) {
+  if (has_payload) {
+    radix_scatter(keys, keys_out, offsets, params, payload, payload_out, index);
+  } else {
+    radix_scatter(keys, keys_out, offsets, params, nullptr, nullptr, index);
+  }
+}
+
+kernel void mtl_radix_scatter_64(
+    device const ulong* keys [[buffer(0)]], device ulong* keys_out [[buffer(1)]],
+    device const uint* offsets [[buffer(2)]],
+    constant RadixParams& params [[buffer(3)]],
+    device const uint* payload [[buffer(4), function_constant(has_payload)]],
+    device uint* payload_out [[buffer(5), function_constant(has_payload)]],
+    uint index [[thread_position_in_grid]]) {
+  if (has_payload) {
+    radix_scatter(keys, keys_out, offsets, params, payload, payload_out, index);
+  } else {
+    radix_scatter(keys, keys_out, offsets, params, nullptr, nullptr, index);
+  }
+}
+
+kernel void mtl_sort_iota(device int* out [[buffer(0)]],
+                          uint index [[thread_position_in_grid]]) {
+  out[index] = int(index) + 1;
+}
+)";
+
+static constexpr size_t kDigitBits = 8;
+static constexpr size_t kDigits = 256;
+
+// Each thread sorts at least this many keys and there are at most
+// kMaxSegments segments (which bounds the size of the counts to scan)
+static constexpr size_t kMinSegment = 1024;
+static constexpr size_t kMaxSegments = 65536;
+
+// Threads sort whole segments, so threadgroups are small to spread the segments
+// of smaller buffers over the worker threads of a CPU device
+static constexpr size_t kThreads = 64;
+
+namespace cpu {
+
+template <uint32_t KeyType>
+static uint32_t sortable(uint32_t bits) {
+  if (KeyType == static_cast<uint32_t>(SortKey::Int32)) {
+    return (bits ^ 0x80000000u) - 1u;
+  }
+
+  if ((bits & 0x7fffffffu) > 0x7f800000u) {
+    return 0xffffffffu;
+  } else if ((bits & 0x7fffffffu) == 0) {
+    bits = 0;
+  }
+
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+template <uint32_t KeyType>
+static uint32_t radix_digit(uint32_t key, uint32_t shift) {
+  return (sortable<KeyType>(key) >> shift) & 0xffu;
+}
+
+template <uint32_t KeyType>
+static uint32_t radix_digit(uint64_t key, uint32_t shift) {
+  return static_cast<uint32_t>(key >> shift) & 0xffu;
+}
+
+// constant uint key_type [[function_constant(0)]];
+//
+// kernel void mtl_radix_histogram_32(device const uint* keys, device uint* counts,
+//                                    constant RadixParams& params, ...)
+template <typename K, uint32_t KeyType>
+static void radix_histogram(const KernelArguments& args, const Size& position) {
+  RadixParams params = args.value<RadixParams>(2);
+  size_t index = position.width;
+  if (index >= params.n_segments) {
+    return;
+  }
+
+  const K* keys = args.buffer<K>(0);
+  uint32_t local[kDigits] = {0};
+  size_t begin = index * params.segment;
+  size_t end = std::min<size_t>(begin + params.segment, params.n);
+  for (size_t i = begin; i < end; i++) {
+    local[radix_digit<KeyType>(keys[i], params.shift)]++;
+  }
+
+  uint32_t* counts = args.buffer<uint32_t>(1);
+  for (size_t d = 0; d < kDigits; d++) {
+    counts[d * params.n_segments + index] = local[d];
+  }
+}
+
+// constant uint key_type [[function_constant(0)]];
+// constant uint payload_words [[function_constant(1)]];
+//
+// kernel void mtl_radix_scatter_32(device const uint* keys, device uint* keys_out,
+//                                  device const uint* offsets,
+//                                  constant RadixParams& params,
+//                                  device const uint* payload,
+//                                  device uint* payload_out, ...)
+template <typename K, uint32_t KeyType, uint32_t PayloadWords>
+static void radix_scatter(const KernelArguments& args, const Size& position) {
+  RadixParams params = args.value<RadixParams>(3);
+  size_t index = position.width;
+  if (index >= params.n_segments) {
+    return;
+  }
+
+  const uint32_t* offsets = args.buffer<uint32_t>(2);
+  uint32_t local[kDigits];
+  for (size_t d = 0; d < kDigits; d++) {
+    local[d] = offsets[d * params.n_segments + index];
+  }
+
+  const K* keys = args.buffer<K>(0);
+  K* keys_out = args.buffer<K>(1);
+  const uint32_t* payload = PayloadWords > 0 ? args.buffer<uint32_t>(4) : nullptr;
+  uint32_t* payload_out = PayloadWords > 0 ? args.buffer<uint32_t>(5) : nullptr;
+  size_t begin = index * params.segment;
+  size_t end = std::min<size_t>(begin + params.segment, params.n);
+  for (size_t i = begin; i < end; i++) {
+    K key = keys[i];
+    size_t j = local[radix_digit<KeyType>(key, params.shift)]++;
+    keys_out[j] = key;
+    for (size_t w = 0; w < PayloadWords; w++) {
+      payload_out[j * PayloadWords + w] = payload[i * PayloadWords + w];
+    }
+  }
+}
+
+// The 32-bit kernels sort int32 and float keys and the 64-bit kernels uint64 keys
+template <typename K>
+static bool key_type_constant(const FunctionConstants& constants, uint32_t* key_type,
+                              std::string* error) {
+  if (!constants.value("key_type", ConstantType::UInt, key_type)) {
+    *error = "Function constant 'key_type' of type uint was not set";
+    return false;
+  }
+
+  bool is_64 = *key_type == static_cast<uint32_t>(SortKey::UInt64);
+  if (*key_type > static_cast<uint32_t>(SortKey::UInt64) ||
+      is_64 != (sizeof(K) == sizeof(uint64_t))) {
+    *error = "Invalid key_type " + std::to_string(*key_type) + " for " +
+             std::to_string(sizeof(K) * 8) + "-bit keys";
+    return false;
+  }
+
+  return true;
+}
+
+// Calls f(std::integral_constant<uint32_t, KeyType>()) for the key types that
+// keys of type K can have
+template <typename K, typename F>
+static void with_key_type(uint32_t key_type, F f) {
+  if constexpr (sizeof(K) == sizeof(uint64_t)) {
+    with_constant<uint32_t, 2>(key_type, f);
+  } else {
+    with_constant<uint32_t, 0, 1>(key_type, f);
+  }
+}
+
+template <typename K>
+static KernelFactory radix_histogram_kernel() {
+  return [](const FunctionConstants& constants, Kernel* kernel, std::string* error) {
+    uint32_t key_type;
+    if (!key_type_constant<K>(constants, &key_type, error)) {
+      return false;
+    }
+
+    with_key_type<K>(key_type, [&](auto key_value) {
+      *kernel = per_thread(radix_histogram<K, decltype(key_value)::value>);
+    });
+    return true;
+  };
+}
+
+template <typename K>
+static KernelFactory radix_scatter_kernel() {
+  return [](const FunctionConstants& constants, Kernel* kernel, std::string* error) {
+    uint32_t key_type;
+    if (!key_type_constant<K>(constants, &key_type, error)) {
+      return false;
+    }
+
+    uint32_t payload_words;
+    if (!constants.value("payload_words", ConstantType::UInt, &payload_words)) {
+      *error = "Function constant 'payload_words' of type uint was not set";
+      return false;
+    } else if (payload_words > 2) {
+      *error = "Payloads must have at most 2 words per element";
+      return false;
+    }
+
+    with_key_type<K>(key_type, [&](auto key_value) {
+      with_constant<uint32_t, 0, 1, 2>(payload_words, [&](auto words_value) {
+        *kernel = per_thread(radix_scatter<K, decltype(key_value)::value,
+                                           decltype(words_value)::value>);
+      });
+    });
+    return true;
+  };
+}
+
+static KernelRegistration radix_histogram_32("mtl_radix_histogram_32",
+                                             radix_histogram_kernel<uint32_t>());
+static KernelRegistration radix_histogram_64("mtl_radix_histogram_64",
+                                             radix_histogram_kernel<uint64_t>());
+static KernelRegistration radix_scatter_32("mtl_radix_scatter_32",
+                                           radix_scatter_kernel<uint32_t>());
+static KernelRegistration radix_scatter_64("mtl_radix_scatter_64",
+                                           radix_scatter_kernel<uint64_t>());
+
+// kernel void mtl_sort_iota(device int* out, uint index [[thread_position_in_grid]])
+static KernelRegistration sort_iota(
+    "mtl_sort_iota", per_thread([](const KernelArguments& args, const Size& position) {
+      args.buffer<int32_t>(0)[position.width] = static_cast<int32_t>(position.width) + 1;
+    }));
+
+}  // namespace cpu
+
+static size_t key_size(SortKey key) {
+  return key == SortKey::UInt64 ? sizeof(uint64_t) : sizeof(uint32_t);
+}
+
+static size_t group_threads(ComputePipeline* pipeline) {
+  return std::min(kThreads, pipeline->max_total_threads_per_threadgroup());
+}
+
+// Appends the passes of the sort to sequence. n must be between 1 and INT_MAX.
+static bool encode_sort(Device* device, Buffer* keys, SortKey key, Buffer* payload,
+                        size_t payload_size, size_t n, DispatchSequence* sequence,
+                        std::string* error) {
+  size_t size = key_size(key);
+  std::string suffix = size == sizeof(uint64_t) ? "_64" : "_32";
+  uint32_t payload_words = payload == nullptr ? 0 : payload_size / sizeof(uint32_t);
+  FunctionConstants constants;
+  constants.add("key_type", ConstantType::UInt,
+                dispatch_bytes(static_cast<uint32_t>(key)));
+  constants.add("payload_words", ConstantType::UInt, dispatch_bytes(payload_words));
+
+  ComputePipeline* histogram = sequence->keep(builtin_pipeline(
+      device, kSortSource, "mtl_radix_histogram" + suffix, constants, error));
+  if (!histogram) {
+    return false;
+  }
+
+  ComputePipeline* scatter = sequence->keep(builtin_pipeline(
+      device, kSortSource, "mtl_radix_scatter" + suffix, constants, error));
+  if (!scatter) {
+    return false;
+  }
+
+  size_t n_segments = std::min(kMaxSegments, (n + kMinSegment - 1) / kMinSegment);
+  size_t segment = (n + n_segments - 1) / n_segments;
+  n_segments = (n + segment - 1) / segment;
+
+  // The scan treats the counts as int32, which can't overflow because they
+  // add up to n
+  Buffer* counts =
+      sequence->keep(device->new_pooled_buffer(kDigits * n_segments * sizeof(uint32_t)));
+  Buffer* keys_temp = sequence->keep(device->new_pooled_buffer(n * size));
+  Buffer* payload_temp = nullptr;
+  if (payload != nullptr) {
+    payload_temp = sequence->keep(device->new_pooled_buffer(n * payload_size));
+  }
+
+  if (!counts || !keys_temp || (payload != nullptr && !payload_temp)) {
+    *error = "Failed to create buffer";
+    return false;
+  }
+
+  Buffer* keys_in = keys;
+  Buffer* keys_out = keys_temp;
+  Buffer* payload_in = payload;
+  Buffer* payload_out = payload_temp;
+  for (size_t shift = 0; shift < size * 8; shift += kDigitBits) {
+    RadixParams params{static_cast<uint32_t>(n), static_cast<uint32_t>(segment),
+                       static_cast<uint32_t>(shift), static_cast<uint32_t>(n_segments)};
+    std::string params_bytes = dispatch_bytes(params);
+
+    Dispatch histogram_dispatch;
+    histogram_dispatch.pipeline = histogram;
+    histogram_dispatch.buffers = {keys_in, counts, nullptr};
+    histogram_dispatch.bytes = {"", "", params_bytes};
+    histogram_dispatch.grid = Size::Make(n_segments);
+    histogram_dispatch.threadgroup = Size::Make(group_threads(histogram));
+    sequence->add(histogram_dispatch);
+
+    if (!encode_scan(device, counts, ScanElement::Int32, true, kDigits * n_segments,
+                     sequence, error)) {
+      return false;
+    }
+
+    Dispatch scatter_dispatch;
+    scatter_dispatch.pipeline = scatter;
+    scatter_dispatch.buffers = {keys_in, keys_out, counts, nullptr};
+    scatter_dispatch.bytes = {"", "", "", params_bytes};
+    if (payload != nullptr) {
+      scatter_dispatch.buffers.push_back(payload_in);
+      scatter_dispatch.buffers.push_back(payload_out);
+      scatter_dispatch.bytes.resize(6);
+    }
+    scatter_dispatch.grid = Size::Make(n_segments);
+    scatter_dispatch.threadgroup = Size::Make(group_threads(scatter));
+    sequence->add(scatter_dispatch);
+
+    std::swap(keys_in, keys_out);
+    std::swap(payload_in, payload_out);
+  }
+
+  return true;
+}
+
+static bool check_sort_length(size_t n, std::string* error) {
+  if (n > static_cast<size_t>(INT_MAX)) {
+    *error = "Can't sort more than 2^31 - 1 elements";
+    return false;
+  }
+
+  return true;
+}
+
+bool sort_buffer(Device* device, CommandQueue* queue, Buffer* keys, SortKey key,
+                 Buffer* payload, size_t payload_size, size_t n, std::string* error) {
+  if (!check_sort_length(n, error)) {
+    return false;
+  } else if (payload != nullptr && payload_size != sizeof(uint32_t) &&
+             payload_size != sizeof(uint64_t)) {
+    *error = "Payload elements must have 4 or 8 bytes";
+    return false;
+  } else if (n == 0) {
+    return true;
+  }
+
+  DispatchSequence sequence;
+  return encode_sort(device, keys, key, payload, payload_size, n, &sequence, error) &&
+         sequence.run(queue, error);
+}
+
+bool order_buffer(Device* device, CommandQueue* queue, Buffer* keys, SortKey key,
+                  size_t n, Buffer* out, std::string* error) {
+  if (!check_sort_length(n, error)) {
+    return false;
+  } else if (n == 0) {
+    return true;
+  }
+
+  DispatchSequence sequence;
+  Buffer* sorted = sequence.keep(device->new_pooled_buffer(n * key_size(key)));
+  if (!sorted) {
+    *error = "Failed to create buffer";
+    return false;
+  }
+
+  std::memcpy(sorted->contents(), keys->contents(), n * key_size(key));
+
+  ComputePipeline* iota = sequence.keep(
+      builtin_pipeline(device, kSortSource, "mtl_sort_iota", FunctionConstants(), error));
+  if (!iota) {
+    return false;
+  }
+
+  Dispatch iota_dispatch;
+  iota_dispatch.pipeline = iota;
+  iota_dispatch.buffers = {out};
+  iota_dispatch.bytes = {""};
+  iota_dispatch.grid = Size::Make(n);
+  iota_dispatch.threadgroup =
+      Size::Make(std::min<size_t>(256, iota->max_total_threads_per_threadgroup()));
+  sequence.add(iota_dispatch);
+
+  return encode_sort(device, sorted, key, out, sizeof(int32_t), n, &sequence, error) &&
+         sequence.run(queue, error);
+}
+
+}  // namespace backend
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "backend.h"
+
+// Stable least-significant-digit radix sorts of the elements of a buffer, in
+// place, with an optional payload that is moved along with each key. Each pass
+// sorts on one 8-bit digit of the keys in three steps that are encoded into one
+// command buffer: every thread counts the digits of one contiguous segment of
+// the keys, the counts (digit-major, so that segments come in order within
+// each digit) are scanned into offsets with encode_scan(), and every thread
+// moves the keys of its segment to their offsets. Passes ping-pong between the
+// buffer and a temporary buffer of the same size; there is always an even
+// number of them, so the result ends up in the original buffer. The CPU
+// backend registers C++ kernels with the same names, so the same passes run
+// on the worker threads of a CPU device.
+//
+// int32 and float keys sort like order(): NA_integer_ and NaN come last and
+// -0 equals 0.
+namespace backend {
+
+enum class SortKey { Int32, Float, UInt64 };
+
+// Sorts the first n keys of keys (and, if payload isn't null, the first n
+// elements of payload, which have payload_size bytes: 4 or 8). n must be
+// at most INT_MAX.
+bool sort_buffer(Device* device, CommandQueue* queue, Buffer* keys, SortKey key,
+                 Buffer* payload, size_t payload_size, size_t n, std::string* error);
+
+// Writes the permutation that sorts the first n keys of keys into the first n
+// elements of out (an int32 buffer) as 1-based indices, like order(). keys
+// is left unchanged.
+bool order_buffer(Device* device, CommandQueue* queue, Buffer* keys, SortKey key,
+                  size_t n, Buffer* out, std::string* error);
+
+}  // namespace backend
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed-size pool of worker threads that runs parallel_for() loops. The
+// calling thread participates in each loop, so a pool of n threads starts n - 1
+// workers. Task functions must never call into the R API.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int n_threads)
+      : n_threads_(n_threads > 0 ? n_threads : hardware_threads()),
+        generation_(0),
+        stopping_(false),
+        fn_(nullptr),
+        n_tasks_(0),
+        next_(0),
+        n_busy_(0) {}
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    work_available_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  int num_threads() const { return n_threads_; }
+
+  static int hardware_threads() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : static_cast<int>(n);
+  }
+
+  // Calls fn(i) for every i in [0, n_tasks), distributing indices among the
+  // workers. The first exception thrown by a task is rethrown here after all
+  // workers have finished. Nested calls from inside a task run serially.
+  void parallel_for(size_t n_tasks, const std::function<void(size_t)>& fn) {
+    if (n_tasks == 0) {
+      return;
+    }
+
+    if (n_threads_ == 1 || n_tasks == 1 || in_worker()) {
+      for (size_t i = 0; i < n_tasks; i++) {
+        fn(i);
+      }
+      return;
+    }
+
+    std::lock_guard<std::mutex> loop_lock(loop_mutex_);
+    start_workers();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      fn_ = &fn;
+      n_tasks_ = n_tasks;
+      next_ = 0;
+      error_ = nullptr;
+      n_busy_ = static_cast<int>(workers_.size());
+      generation_++;
+    }
+    work_available_.notify_all();
+
+    in_worker() = true;
+    run_tasks();
+    in_worker() = false;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_done_.wait(lock, [&] { return n_busy_ == 0; });
+    fn_ = nullptr;
+
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+ private:
+  int n_threads_;
+  std::vector<std::thread> workers_;
+  std::mutex loop_mutex_;
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable work_done_;
+  uint64_t generation_;
+  bool stopping_;
+  const std::function<void(size_t)>* fn_;
+  size_t n_tasks_;
+  std::atomic<size_t> next_;
+  int n_busy_;
+  std::exception_ptr error_;
+
+  static bool& in_worker() {
+    static thread_local bool value = false;
+    return value;
+  }
+
+  void start_workers() {
+    if (!workers_.empty()) {
+      return;
+    }
+
+    for (int i = 1; i < n_threads_; i++) {
+      workers_.emplace_back([this] { worker_loop(); });
+    }
+  }
+
+  void run_tasks() {
+    size_t i;
+    while ((i = next_.fetch_add(1)) < n_tasks_) {
+      try {
+        (*fn_)(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+        next_ = n_tasks_;
+      }
+    }
+  }
+
+  void worker_loop() {
+    in_worker() = true;
+    uint64_t last_generation = 0;
+
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_available_.wait(
+            lock, [&] { return stopping_ || generation_ != last_generation; });
+        if (stopping_) {
+          return;
+        }
+        last_generation = generation_;
+      }
+
+      run_tasks();
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        n_busy_--;
+      }
+      work_done_.notify_one();
+    }
+  }
+};
@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+#include "library-cache.h"
+#include "tuning-cache.h"
+
+namespace backend {
+
+void TuningCache::set_directory(const std::string& directory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (directory == directory_) {
+    return;
+  }
+
+  directory_ = directory;
+  if (!directory_.empty()) {
+    std::unordered_map<std::string, Tuning> on_disk;
+    load_locked(&on_disk);
+    tunings_.insert(on_disk.begin(), on_disk.end());
+    size_ = tunings_.size();
+  }
+}
+
+std::string TuningCache::directory() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return directory_;
+}
+
+bool TuningCache::get(ComputePipeline* pipeline, const Size& grid, Tuning* tuning) {
+  if (size_ == 0) {
+    return false;
+  }
+
+  std::string key = pipeline->function_key() + '\t' + size_bucket(grid);
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto item = tunings_.find(key);
+  if (item == tunings_.end()) {
+    return false;
+  }
+
+  hits_++;
+  *tuning = item->second;
+  return true;
+}
+
+void TuningCache::put(ComputePipeline* pipeline, const Size& grid, const Tuning& tuning) {
+  std::string key = pipeline->function_key() + '\t' + size_bucket(grid);
+  std::lock_guard<std::mutex> lock(mutex_);
+  tunings_[key] = tuning;
+  size_ = tunings_.size();
+  if (!directory_.empty()) {
+    save_locked();
+  }
+}
+
+void TuningCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tunings_.clear();
+  size_ = 0;
+}
+
+TuningCacheStats TuningCache::stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return TuningCacheStats{hits_, tunings_.size()};
+}
+
+std::string TuningCache::function_key(Function* function) {
+  char source_hash[32];
+  snprintf(source_hash, sizeof(source_hash), "%016" PRIx64,
+           function->compiled_library()->source_hash());
+  std::string key = std::string(source_hash) + ':' + function->name();
+  std::string specialization_key = function->specialization_key();
+  if (!specialization_key.empty()) {
+    key += ':' + specialization_key;
+  }
+
+  return key;
+}
+
+static int ceil_log2(size_t value) {
+  int out = 0;
+  while ((static_cast<size_t>(1) << out) < value) {
+    out++;
+  }
+
+  return out;
+}
+
+std::string TuningCache::size_bucket(const Size& grid) {
+  return std::to_string(ceil_log2(grid.width)) + ',' +
+         std::to_string(ceil_log2(grid.height)) + ',' +
+         std::to_string(ceil_log2(grid.depth));
+}
+
+std::string TuningCache::path_locked() {
+  char filename[32];
+  snprintf(filename, sizeof(filename), "%016" PRIx64 ".tuning",
+           LibraryCache::hash(device_key_));
+  return directory_ + "/" + filename;
+}
+
+// Each line is the key (which contains one tab) followed by the tab-separated
+// threadgroup width, height, depth, chunk size, and seconds. Like the library
+// cache, the file is best effort: unreadable lines are ignored.
+void TuningCache::load_locked(std::unordered_map<std::string, Tuning>* tunings) {
+  std::ifstream file(path_locked());
+  std::string line;
+  while (std::getline(file, line)) {
+    size_t fields_start = line.size();
+    for (int i = 0; i < 5 && fields_start != std::string::npos; i++) {
+      fields_start = fields_start == 0 ? std::string::npos
+                                       : line.rfind('\t', fields_start - 1);
+    }
+
+    if (fields_start == std::string::npos || fields_start == 0) {
+      continue;
+    }
+
+    std::istringstream fields(line.substr(fields_start + 1));
+    Tuning tuning;
+    fields >> tuning.threadgroup.width >> tuning.threadgroup.height >>
+        tuning.threadgroup.depth >> tuning.chunk_size >> tuning.seconds;
+    if (!fields || tuning.threadgroup.count() == 0) {
+      continue;
+    }
+
+    (*tunings)[line.substr(0, fields_start)] = tuning;
+  }
+}
+
+// Tunings saved by other sessions since this one loaded the file are kept, and
+// the file is written under a temporary name and renamed so that a concurrent
+// session never reads a partially written file
+void TuningCache::save_locked() {
+  std::unordered_map<std::string, Tuning> tunings;
+  load_locked(&tunings);
+  for (const auto& item : tunings_) {
+    tunings[item.first] = item.second;
+  }
+
+  std::string path = path_locked();
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::trunc);
+    if (!file) {
+      return;
+    }
+
+    for (const auto& item : tunings) {
+      if (item.first.find('\n') != std::string::npos) {
+        continue;
+      }
+
+      const Tuning& tuning = item.second;
+      char fields[128];
+      snprintf(fields, sizeof(fields), "\t%zu\t%zu\t%zu\t%zu\t%.9g\n",
+               tuning.threadgroup.width, tuning.threadgroup.height,
+               tuning.threadgroup.depth, tuning.chunk_size, tuning.seconds);
+      file << item.first << fields;
+    }
+
+    if (!file) {
+      std::remove(tmp_path.c_str());
+      return;
+    }
+  }
+
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+  }
+}
+
+std::vector<Tuning> tuning_candidates(ComputePipeline* pipeline, const Size& grid,
+                                      size_t n_dims) {
+  size_t max_threads = pipeline->max_total_threads_per_threadgroup();
+  size_t width = std::min(pipeline->thread_execution_width(), max_threads);
+
+  std::vector<size_t> totals;
+  for (size_t total = width; total <= max_threads; total *= 2) {
+    totals.push_back(total);
+  }
+
+  size_t largest = (max_threads / width) * width;
+  if (totals.back() != largest) {
+    totals.push_back(largest);
+  }
+
+  std::vector<Size> shapes;
+  auto add_shape = [&](size_t x, size_t y) {
+    Size shape = Size::Make(std::min(x, grid.width), std::min(y, grid.height));
+    for (const Size& existing : shapes) {
+      if (existing.width == shape.width && existing.height == shape.height) {
+        return;
+      }
+    }
+
+    shapes.push_back(shape);
+  };
+
+  for (size_t total : totals) {
+    if (n_dims == 1) {
+      add_shape(total, 1);
+      continue;
+    }
+
+    size_t square = 1;
+    while (square * square * 4 <= total) {
+      square *= 2;
+    }
+
+    add_shape(total, 1);
+    add_shape(width, total / width);
+    if (total % square == 0) {
+      add_shape(square, total / square);
+    }
+  }
+
+  std::vector<Tuning> candidates;
+  for (const Size& shape : shapes) {
+    if (!pipeline->has_chunk_size()) {
+      candidates.push_back(Tuning{shape, 0, 0});
+      continue;
+    }
+
+    size_t n_groups = ((grid.width + shape.width - 1) / shape.width) *
+                      ((grid.height + shape.height - 1) / shape.height) * grid.depth;
+    for (size_t chunk_size : {1, 4, 16, 64}) {
+      if (chunk_size == 1 || chunk_size < n_groups) {
+        candidates.push_back(Tuning{shape, chunk_size, 0});
+      }
+    }
+  }
+
+  return candidates;
+}
+
+bool tune_dispatch(CommandQueue* queue, const Dispatch& dispatch, size_t n_dims,
+                   int reps, std::vector<Tuning>* timings, std::string* error) {
+  timings->clear();
+  for (Tuning candidate : tuning_candidates(dispatch.pipeline, dispatch.grid, n_dims)) {
+    Dispatch trial = dispatch;
+    trial.threadgroup = candidate.threadgroup;
+    trial.chunk_size = candidate.chunk_size;
+    candidate.seconds = std::numeric_limits<double>::infinity();
+
+    for (int i = 0; i <= reps; i++) {
+      CommandBuffer* command_buffer = queue->new_command_buffer(DispatchType::Serial);
+      auto start = std::chrono::steady_clock::now();
+      bool encoded = command_buffer->encode(trial, error);
+      if (encoded) {
+        command_buffer->commit();
+        command_buffer->wait_until_completed();
+      }
+
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      std::string run_error = encoded ? command_buffer->error() : "";
+      command_buffer->release();
+
+      if (!encoded) {
+        return false;
+      } else if (!run_error.empty()) {
+        *error = run_error;
+        return false;
+      }
+
+      if (i > 0) {
+        candidate.seconds = std::min(candidate.seconds, elapsed.count());
+      }
+    }
+
+    timings->push_back(candidate);
+  }
+
+  return true;
+}
+
+TuningCache* Device::tuning_cache() {
+  if (!tuning_cache_) {
+    tuning_cache_ = std::make_shared<TuningCache>(backend_name() + '\0' + name() + '\0' +
+                                                  description());
+  }
+
+  return tuning_cache_.get();
+}
+
+}  // namespace backend
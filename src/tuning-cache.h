@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "backend.h"
+
+// Keeps the threadgroup shape (and chunk size, for backends that use one) that
+// dispatched a function fastest on a device, as measured by tune_dispatch().
+// Tunings are keyed by the function (see function_key()) and a size bucket of
+// the grid so that one tuning covers grids of similar shapes. They can
+// optionally be saved to a file in a directory (one file per device) so that
+// they are also reused across sessions.
+namespace backend {
+
+struct Tuning {
+  Size threadgroup;
+  size_t chunk_size;
+  // The fastest of the timed runs, including the time to submit and wait for
+  // the command buffer
+  double seconds;
+};
+
+struct TuningCacheStats {
+  size_t hits;
+  size_t size;
+};
+
+class TuningCache {
+ public:
+  explicit TuningCache(const std::string& device_key)
+      : device_key_(device_key), hits_(0), size_(0) {}
+
+  // An empty directory disables the on-disk cache. Tunings already saved in
+  // the directory for this device are loaded.
+  void set_directory(const std::string& directory);
+  std::string directory();
+
+  // Called for every dispatch that doesn't specify a threadgroup, so this
+  // returns immediately if nothing was tuned
+  bool get(ComputePipeline* pipeline, const Size& grid, Tuning* tuning);
+  void put(ComputePipeline* pipeline, const Size& grid, const Tuning& tuning);
+
+  void clear();
+  TuningCacheStats stats();
+
+  // Identifies a function across sessions by the source it was compiled from,
+  // its name, and its specialization key
+  static std::string function_key(Function* function);
+
+  // Rounds each dimension of grid up to a power of two
+  static std::string size_bucket(const Size& grid);
+
+ private:
+  std::mutex mutex_;
+  std::string device_key_;
+  std::string directory_;
+  size_t hits_;
+  std::atomic<size_t> size_;
+  std::unordered_map<std::string, Tuning> tunings_;
+
+  std::string path_locked();
+  void load_locked(std::unordered_map<std::string, Tuning>* tunings);
+  void save_locked();
+};
+
+// Threadgroups whose total number of threads is a power-of-two multiple of the
+// pipeline's thread execution width (or the largest multiple of it that the
+// pipeline allows), clipped to grid. For 2D and 3D grids, each of these is
+// tried as one row, as rows one SIMD group wide, and as a roughly square tile
+// (all one thread deep). Pipelines that use a chunk size try each threadgroup
+// with several chunk sizes.
+std::vector<Tuning> tuning_candidates(ComputePipeline* pipeline, const Size& grid,
+                                      size_t n_dims);
+
+// Times dispatch with each candidate reps times (after one untimed run) and
+// populates timings in candidate order. The kernel must be safe to run
+// repeatedly with the same arguments.
+bool tune_dispatch(CommandQueue* queue, const Dispatch& dispatch, size_t n_dims,
+                   int reps, std::vector<Tuning>* timings, std::string* error);
+
+}  // namespace backend